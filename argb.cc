@@ -0,0 +1,90 @@
+#include <algorithm>
+
+#include "argb.h"
+
+ArgbImage::ArgbImage(int width, int height)
+    : width_(width), height_(height), pixels_(width * height) {}
+
+// static
+ArgbImage ArgbImage::FromPixels(const unsigned long* data,
+                                int width,
+                                int height) {
+  ArgbImage res(width, height);
+  uint32_t* out = res.pixels_.data();
+  const int len = width * height;
+  for (int i = 0; i < len; i++) {
+    const uint32_t argb = data[i];
+    const uint32_t a = argb >> 24;
+    const uint32_t r = Div255(((argb >> 16) & 0xff) * a);
+    const uint32_t g = Div255(((argb >> 8) & 0xff) * a);
+    const uint32_t b = Div255((argb & 0xff) * a);
+    out[i] = (a << 24) | (r << 16) | (g << 8) | b;
+  }
+  return res;
+}
+
+ArgbImage ArgbImage::Downscale(int width, int height) const {
+  if (width == width_ && height == height_) {
+    return *this;
+  }
+  ArgbImage res(width, height);
+  // The four channels are averaged independently, so we can treat each row
+  // as bytes; which byte is which channel doesn't matter here.
+  const int row_bytes = width_ * 4;
+  std::vector<uint32_t> sums(row_bytes);
+  for (int y = 0; y < height; y++) {
+    const int src_min_y = y * height_ / height;
+    const int src_max_y = (y + 1) * height_ / height;  // exclusive
+    // First add up the block's rows, column by column...
+    std::fill(sums.begin(), sums.end(), 0);
+    for (int sy = src_min_y; sy < src_max_y; sy++) {
+      const uint8_t* row = reinterpret_cast<const uint8_t*>(Row(sy));
+      for (int i = 0; i < row_bytes; i++) {
+        sums[i] += row[i];
+      }
+    }
+    // ... then add up each block's columns.
+    uint8_t* out = reinterpret_cast<uint8_t*>(res.Row(y));
+    for (int x = 0; x < width; x++) {
+      const int src_min_x = x * width_ / width;
+      const int src_max_x = (x + 1) * width_ / width;  // exclusive
+      uint32_t total[4] = {0, 0, 0, 0};
+      for (int sx = src_min_x; sx < src_max_x; sx++) {
+        for (int c = 0; c < 4; c++) {
+          total[c] += sums[sx * 4 + c];
+        }
+      }
+      // The destination is never larger than the source, so no block is empty.
+      const uint32_t div = (src_max_y - src_min_y) * (src_max_x - src_min_x);
+      for (int c = 0; c < 4; c++) {
+        out[x * 4 + c] = (total[c] + div / 2) / div;
+      }
+    }
+  }
+  return res;
+}
+
+void ArgbImage::Composite(const Background* backgrounds,
+                          uint32_t* const* out,
+                          int num) const {
+  for (int y = 0; y < height_; y++) {
+    const uint32_t* src = Row(y);
+    for (int i = 0; i < num; i++) {
+      const uint32_t bg = backgrounds[i].At(y);
+      const uint32_t bgr = (bg >> 16) & 0xff;
+      const uint32_t bgg = (bg >> 8) & 0xff;
+      const uint32_t bgb = bg & 0xff;
+      uint32_t* dest = out[i] + y * width_;
+      for (int x = 0; x < width_; x++) {
+        // As the source is premultiplied, each channel is no more than alpha,
+        // and so the sums can't overflow a byte.
+        const uint32_t argb = src[x];
+        const uint32_t bga = 0xff - (argb >> 24);  // alpha for background.
+        const uint32_t r = ((argb >> 16) & 0xff) + Div255(bgr * bga);
+        const uint32_t g = ((argb >> 8) & 0xff) + Div255(bgg * bga);
+        const uint32_t b = (argb & 0xff) + Div255(bgb * bga);
+        dest[x] = 0xff000000 | (r << 16) | (g << 8) | b;
+      }
+    }
+  }
+}
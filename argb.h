@@ -0,0 +1,73 @@
+#ifndef LWM_ARGB_H_included
+#define LWM_ARGB_H_included
+
+#include <stdint.h>
+#include <vector>
+
+// ArgbImage holds an icon as 32-bit ARGB pixels (alpha in the top byte, then
+// red, green and blue), row by row with no padding. This is what the icon
+// pipeline works on, rather than XImages: working through XGetPixel and
+// XPutPixel costs a function call per pixel, which adds up to milliseconds for
+// the 256x256 icons that browsers like to give us. The loops here are all
+// straight runs over plain arrays, which the compiler can vectorise.
+//
+// The colour channels are kept premultiplied by alpha, which is what makes it
+// possible to scale an icon down once, and only then composite it onto each
+// of the backgrounds we need.
+class ArgbImage {
+ public:
+  // The background an icon is composited onto. If the user has configured a
+  // top border width, the icon for an active window has the active border
+  // colour at the top, and the title bar colour below; rows after boundary
+  // get the bottom colour. Otherwise top and bottom are the same.
+  struct Background {
+    explicit Background(uint32_t colour)
+        : top(colour), boundary(0), bottom(colour) {}
+    Background(uint32_t top, int boundary, uint32_t bottom)
+        : top(top), boundary(boundary), bottom(bottom) {}
+
+    uint32_t At(int y) const { return y > boundary ? bottom : top; }
+
+    uint32_t top;
+    int boundary;
+    uint32_t bottom;
+  };
+
+  // A fully transparent image.
+  ArgbImage(int width, int height);
+
+  // Converts _NET_WM_ICON pixel data (one non-premultiplied ARGB pixel per
+  // long, as Xlib gives them to us) to premultiplied form.
+  static ArgbImage FromPixels(const unsigned long* data, int width, int height);
+
+  int Width() const { return width_; }
+  int Height() const { return height_; }
+  uint32_t* Row(int y) { return &pixels_[y * width_]; }
+  const uint32_t* Row(int y) const { return &pixels_[y * width_]; }
+
+  // Returns the image scaled down to the given size, which must be no larger
+  // than the current one in either direction. Each destination pixel is the
+  // average of the block of source pixels it covers.
+  ArgbImage Downscale(int width, int height) const;
+
+  // Composites the image onto each of num backgrounds, writing opaque pixels
+  // to out[i], which must have room for Width() * Height() pixels. The source
+  // is only read once: each row is composited onto all the backgrounds while
+  // it's still in the cache.
+  void Composite(const Background* backgrounds,
+                 uint32_t* const* out,
+                 int num) const;
+
+  // Divides v (a channel multiplied by an alpha value) by 255, rounding to the
+  // nearest, without the cost of a division. Exact for v up to 255 * 255.
+  static uint32_t Div255(uint32_t v) {
+    return (v + 128 + ((v + 128) >> 8)) >> 8;
+  }
+
+ private:
+  int width_;
+  int height_;
+  std::vector<uint32_t> pixels_;
+};
+
+#endif  // LWM_ARGB_H_included
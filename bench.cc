@@ -0,0 +1,444 @@
+// lwmbench measures how LWM's start-up scales with the number of windows
+// already on the screen. For each window count, it starts a private Xvfb
+// server, fills it with client windows, then starts LWM and times how long it
+// takes to frame them all.
+//
+// Usage:
+//   lwmbench [-v] [-lwm=<path>] [-geometry=<W>x<H>] [-runs=<n>] [<count>...]
+//
+// The counts are the numbers of windows to try (default: 10 100 1000). -runs
+// gives the number of times to start LWM for each count (default: 3), and the
+// median of each measurement is reported. -v lets LWM's log messages through
+// to stderr. -lwm gives the LWM binary to run (default: ./lwm), and -geometry
+// the size of the Xvfb screen (default: 1920x1080).
+//
+// The windows are meant to look like a real desktop's: each has a name (in
+// both WM_NAME and _NET_WM_NAME), a class, WM_HINTS, WM_NORMAL_HINTS,
+// WM_PROTOCOLS, and a _NET_WM_ICON holding the 16x16, 32x32 and 48x48 icons of
+// one of a handful of applications. Two of them are docks, with struts, along
+// the top and bottom of the screen.
+//
+// LWM is run with -readyfd, so it tells us when start-up is over: every
+// window has been framed, its icon made and drawn, and the server has done
+// all it was asked. We report the time from starting LWM until then, and the
+// number of X requests LWM sent to get there. LWM is then killed, and we
+// report its CPU time and peak RSS. Each run gets a new, empty icon cache,
+// so the icons are always made from scratch.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#include "log.h"
+#include "xvfb.h"
+
+namespace {
+
+// The number of different applications the windows belong to, which is the
+// number of different icons.
+constexpr int kApps = 12;
+// The sizes of icon each application provides, as GTK applications do.
+constexpr int kIconSizes[] = {16, 32, 48};
+constexpr int kDockHeight = 24;
+
+uint64_t monotonicNanos() {
+  struct timespec spec = {};
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return uint64_t(spec.tv_sec) * 1000000000 + uint64_t(spec.tv_nsec);
+}
+
+uint64_t millis(const struct timeval& tv) {
+  return uint64_t(tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+}
+
+// Makes a _NET_WM_ICON for the given application: each size is a disc of a
+// colour particular to the application, with a soft edge, so that LWM has
+// real compositing to do.
+std::vector<long> makeIcon(int app) {
+  std::vector<long> res;
+  const unsigned long r = (app * 97) & 0xff;
+  const unsigned long g = (app * 151 + 64) & 0xff;
+  const unsigned long b = (app * 43 + 128) & 0xff;
+  for (const int size : kIconSizes) {
+    res.push_back(size);
+    res.push_back(size);
+    const double radius = size / 2.0;
+    for (int y = 0; y < size; y++) {
+      for (int x = 0; x < size; x++) {
+        const double dx = x + 0.5 - radius;
+        const double dy = y + 0.5 - radius;
+        const double edge = radius - dx * dx / radius - dy * dy / radius;
+        const unsigned long a = std::clamp(int(edge * 255), 0, 255);
+        res.push_back(long((a << 24) | (r << 16) | (g << 8) | b));
+      }
+    }
+  }
+  return res;
+}
+
+// Desktop fills an X server with client windows.
+class Desktop {
+ public:
+  Desktop(Display* dpy, int width, int height)
+      : dpy_(dpy),
+        width_(width),
+        height_(height),
+        utf8_string_(XInternAtom(dpy, "UTF8_STRING", false)),
+        wm_delete_window_(XInternAtom(dpy, "WM_DELETE_WINDOW", false)),
+        wm_take_focus_(XInternAtom(dpy, "WM_TAKE_FOCUS", false)),
+        net_wm_name_(XInternAtom(dpy, "_NET_WM_NAME", false)),
+        net_wm_icon_(XInternAtom(dpy, "_NET_WM_ICON", false)),
+        net_wm_strut_(XInternAtom(dpy, "_NET_WM_STRUT", false)),
+        net_wm_strut_partial_(XInternAtom(dpy, "_NET_WM_STRUT_PARTIAL", false)),
+        net_wm_window_type_(XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", false)),
+        net_wm_window_type_dock_(
+            XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_DOCK", false)) {
+    for (int app = 0; app < kApps; app++) {
+      icons_.push_back(makeIcon(app));
+    }
+  }
+
+  // Creates and maps n windows, and waits for the server to finish.
+  void Populate(int n);
+
+ private:
+  void addDock(int i, bool top);
+  void addWindow(int i);
+
+  // Sets the properties that every client window has.
+  void setCommonProperties(Window w, int i, int app);
+
+  Display* const dpy_;
+  const int width_;
+  const int height_;
+  const Atom utf8_string_;
+  const Atom wm_delete_window_;
+  const Atom wm_take_focus_;
+  const Atom net_wm_name_;
+  const Atom net_wm_icon_;
+  const Atom net_wm_strut_;
+  const Atom net_wm_strut_partial_;
+  const Atom net_wm_window_type_;
+  const Atom net_wm_window_type_dock_;
+  std::vector<std::vector<long>> icons_;
+};
+
+void Desktop::Populate(int n) {
+  for (int i = 0; i < n; i++) {
+    if (i < 2) {
+      addDock(i, i == 0);
+    } else {
+      addWindow(i);
+    }
+  }
+  XSync(dpy_, false);
+}
+
+void Desktop::setCommonProperties(Window w, int i, int app) {
+  std::string app_name = "benchapp" + std::to_string(app);
+  const std::string name = app_name + " - window " + std::to_string(i);
+  XChangeProperty(dpy_, w, XA_WM_NAME, XA_STRING, 8, PropModeReplace,
+                  reinterpret_cast<const unsigned char*>(name.data()),
+                  name.size());
+  // Real applications' names are rarely plain ASCII.
+  const std::string utf8_name = name + " \xe2\x80\x94 r\xc3\xa9sum\xc3\xa9";
+  XChangeProperty(dpy_, w, net_wm_name_, utf8_string_, 8, PropModeReplace,
+                  reinterpret_cast<const unsigned char*>(utf8_name.data()),
+                  utf8_name.size());
+
+  std::string class_name = app_name;
+  class_name[0] = 'B';
+  XClassHint class_hint = {&app_name[0], &class_name[0]};
+  XSetClassHint(dpy_, w, &class_hint);
+
+  XWMHints wm_hints = {};
+  wm_hints.flags = InputHint | StateHint;
+  wm_hints.input = true;
+  wm_hints.initial_state = NormalState;
+  XSetWMHints(dpy_, w, &wm_hints);
+
+  Atom protocols[] = {wm_delete_window_, wm_take_focus_};
+  XSetWMProtocols(dpy_, w, protocols, 2);
+
+  const std::vector<long>& icon = icons_[app];
+  XChangeProperty(dpy_, w, net_wm_icon_, XA_CARDINAL, 32, PropModeReplace,
+                  reinterpret_cast<const unsigned char*>(icon.data()),
+                  icon.size());
+}
+
+void Desktop::addDock(int i, bool top) {
+  const int y = top ? 0 : height_ - kDockHeight;
+  const Window w = XCreateSimpleWindow(dpy_, DefaultRootWindow(dpy_), 0, y,
+                                       width_, kDockHeight, 0, 0, 0);
+  setCommonProperties(w, i, i % kApps);
+  XChangeProperty(dpy_, w, net_wm_window_type_, XA_ATOM, 32, PropModeReplace,
+                  reinterpret_cast<const unsigned char*>(
+                      &net_wm_window_type_dock_),
+                  1);
+  // left, right, top, bottom, then the start and end of each edge's strut.
+  long strut[12] = {};
+  strut[top ? 2 : 3] = kDockHeight;
+  strut[top ? 9 : 11] = width_ - 1;
+  XChangeProperty(dpy_, w, net_wm_strut_, XA_CARDINAL, 32, PropModeReplace,
+                  reinterpret_cast<const unsigned char*>(strut), 4);
+  XChangeProperty(dpy_, w, net_wm_strut_partial_, XA_CARDINAL, 32,
+                  PropModeReplace,
+                  reinterpret_cast<const unsigned char*>(strut), 12);
+  XMapWindow(dpy_, w);
+}
+
+void Desktop::addWindow(int i) {
+  // Scatter the windows about the screen, with a variety of sizes, but the
+  // same ones every run.
+  const unsigned seed = i * 2654435761u;
+  const int width = 300 + seed % 500;
+  const int height = 200 + (seed >> 10) % 400;
+  const int x = 1 + (seed >> 4) % std::max(1, width_ - width - 1);
+  const int y =
+      kDockHeight + 1 +
+      (seed >> 14) % std::max(1, height_ - height - 2 * kDockHeight - 40);
+  const Window w = XCreateSimpleWindow(dpy_, DefaultRootWindow(dpy_), x, y,
+                                       width, height, 0, 0,
+                                       WhitePixel(dpy_, DefaultScreen(dpy_)));
+  const int app = i % kApps;
+  setCommonProperties(w, i, app);
+
+  XSizeHints size_hints = {};
+  size_hints.flags = USPosition | USSize | PMinSize;
+  size_hints.min_width = 100;
+  size_hints.min_height = 50;
+  // Every third application is a terminal, resizing a character at a time.
+  if (app % 3 == 0) {
+    size_hints.flags |= PBaseSize | PResizeInc;
+    size_hints.base_width = 4;
+    size_hints.base_height = 4;
+    size_hints.width_inc = 9;
+    size_hints.height_inc = 18;
+  }
+  XSetWMNormalHints(dpy_, w, &size_hints);
+  XMapWindow(dpy_, w);
+}
+
+// What we measure each time LWM starts.
+struct Result {
+  uint64_t ready_ms = 0;
+  uint64_t requests = 0;
+  uint64_t user_ms = 0;
+  uint64_t system_ms = 0;
+  uint64_t max_rss_kb = 0;
+};
+
+// Makes an empty directory for LWM's icon cache, returning its name, or an
+// empty string on failure.
+std::string makeCacheDir() {
+  char dir[] = "/tmp/lwmbench.XXXXXX";
+  if (!mkdtemp(dir)) {
+    LOGE() << "Failed to create cache directory: " << Log::Errno(errno);
+    return "";
+  }
+  return dir;
+}
+
+void removeCacheDir(const std::string& dir) {
+  // As made by IconDiskCache::DefaultPath and IconDiskCache::Open. Killing
+  // LWM may leave one of Open's temporary files behind, so take everything.
+  const std::string lwm_dir = dir + "/lwm";
+  if (DIR* d = opendir(lwm_dir.c_str())) {
+    while (const struct dirent* e = readdir(d)) {
+      if (strcmp(e->d_name, ".") && strcmp(e->d_name, "..")) {
+        unlink((lwm_dir + "/" + e->d_name).c_str());
+      }
+    }
+    closedir(d);
+  }
+  rmdir(lwm_dir.c_str());
+  rmdir(dir.c_str());
+}
+
+// Starts LWM, waits for it to finish starting up, then kills it. Returns
+// false (having logged why) on failure.
+bool runLWM(const std::string& path,
+            const std::string& display,
+            const std::string& cache_dir,
+            bool verbose,
+            Result* result) {
+  int fds[2];
+  if (pipe(fds)) {
+    LOGE() << "Failed to create pipe for LWM: " << Log::Errno(errno);
+    return false;
+  }
+  const std::string ready_arg = "-readyfd=" + std::to_string(fds[1]);
+  const uint64_t start = monotonicNanos();
+  const pid_t pid = fork();
+  if (pid < 0) {
+    LOGE() << "Failed to fork for LWM: " << Log::Errno(errno);
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    const int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    if (!verbose) {
+      dup2(null, STDERR_FILENO);
+    }
+    setenv("DISPLAY", display.c_str(), 1);
+    setenv("XDG_CACHE_HOME", cache_dir.c_str(), 1);
+    // Otherwise LWM would register with the session manager of whoever ran
+    // us, and spend start-up talking to it.
+    unsetenv("SESSION_MANAGER");
+    execl(path.c_str(), path.c_str(), ready_arg.c_str(), nullptr);
+    LOGE() << "Failed to run " << path << ": " << Log::Errno(errno);
+    _exit(EXIT_FAILURE);
+  }
+  close(fds[1]);
+  std::string line;
+  while (line.empty() || line.back() != '\n') {
+    char buf[64];
+    const ssize_t n = read(fds[0], buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    line.append(buf, n);
+  }
+  const uint64_t ready = monotonicNanos();
+  close(fds[0]);
+  // Killing LWM, rather than asking it to exit, keeps the time it would
+  // spend releasing the windows out of its CPU time.
+  kill(pid, SIGKILL);
+  struct rusage ru = {};
+  wait4(pid, nullptr, 0, &ru);
+  if (line.empty() || line.back() != '\n') {
+    LOGE() << "LWM exited during start-up";
+    return false;
+  }
+  result->ready_ms = (ready - start) / 1000000;
+  result->requests = strtoull(line.c_str(), nullptr, 10);
+  result->user_ms = millis(ru.ru_utime);
+  result->system_ms = millis(ru.ru_stime);
+  // Linux and the BSDs both give this in KiB.
+  result->max_rss_kb = ru.ru_maxrss;
+  return true;
+}
+
+// Starts a new Xvfb, fills it with n windows, and starts LWM on it.
+bool runOnce(const std::string& lwm,
+             int width,
+             int height,
+             int n,
+             bool verbose,
+             Result* result) {
+  Xvfb* xvfb = Xvfb::Start(width, height);
+  if (!xvfb) {
+    return false;
+  }
+  Display* dpy = XOpenDisplay(xvfb->DisplayName().c_str());
+  if (!dpy) {
+    LOGE() << "Can't open Xvfb display " << xvfb->DisplayName();
+    delete xvfb;
+    return false;
+  }
+  Desktop desktop(dpy, width, height);
+  desktop.Populate(n);
+  const std::string cache_dir = makeCacheDir();
+  const bool ok =
+      !cache_dir.empty() &&
+      runLWM(lwm, xvfb->DisplayName(), cache_dir, verbose, result);
+  if (!cache_dir.empty()) {
+    removeCacheDir(cache_dir);
+  }
+  XCloseDisplay(dpy);
+  delete xvfb;
+  return ok;
+}
+
+// Returns the median of one field of the results.
+uint64_t median(const std::vector<Result>& results, uint64_t Result::*field) {
+  std::vector<uint64_t> values;
+  for (const Result& r : results) {
+    values.push_back(r.*field);
+  }
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  bool verbose = false;
+  std::string lwm = "./lwm";
+  int width = 1920, height = 1080;
+  int runs = 3;
+  std::vector<int> counts;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-v")) {
+      verbose = true;
+    } else if (!strncmp(argv[i], "-lwm=", 5)) {
+      lwm = argv[i] + 5;
+    } else if (!strncmp(argv[i], "-geometry=", 10)) {
+      if (sscanf(argv[i] + 10, "%dx%d", &width, &height) != 2) {
+        LOGF() << "Bad geometry " << argv[i] + 10;
+      }
+    } else if (!strncmp(argv[i], "-runs=", 6)) {
+      runs = atoi(argv[i] + 6);
+      if (runs < 1) {
+        LOGF() << "Bad number of runs " << argv[i] + 6;
+      }
+    } else if (argv[i][0] != '-' && atoi(argv[i]) > 0) {
+      counts.push_back(atoi(argv[i]));
+    } else {
+      LOGF() << "Usage: " << argv[0]
+             << " [-v] [-lwm=<path>] [-geometry=<W>x<H>] [-runs=<n>]"
+                " [<count>...]";
+    }
+  }
+  if (counts.empty()) {
+    counts = {10, 100, 1000};
+  }
+
+  std::cout << std::setw(8) << "windows" << std::setw(11) << "ready ms"
+            << std::setw(11) << "requests" << std::setw(10) << "user ms"
+            << std::setw(10) << "sys ms" << std::setw(13) << "peak RSS KiB"
+            << "\n";
+  for (const int n : counts) {
+    std::vector<Result> results;
+    for (int run = 0; run < runs; run++) {
+      Result result;
+      if (!runOnce(lwm, width, height, n, verbose, &result)) {
+        return EXIT_FAILURE;
+      }
+      results.push_back(result);
+    }
+    std::cout << std::setw(8) << n << std::setw(11)
+              << median(results, &Result::ready_ms) << std::setw(11)
+              << median(results, &Result::requests) << std::setw(10)
+              << median(results, &Result::user_ms) << std::setw(10)
+              << median(results, &Result::system_ms) << std::setw(13)
+              << median(results, &Result::max_rss_kb) << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
@@ -26,8 +26,12 @@
 
 #include <unistd.h>
 
+#include "eventloop.h"
 #include "ewmh.h"
+#include "handoff.h"
+#include "icondecoder.h"
 #include "lwm.h"
+#include "xasync.h"
 #include "xlib.h"
 
 static int popup_width;  // The width of the size-feedback window.
@@ -181,15 +185,23 @@ Edge Client::EdgeAt(Window w, int x, int y) const {
 
 void Client::SetIcon(xlib::ImageIcon* icon) {
   if (icon) {
+    delete icon_;
     icon_ = icon;
+    icon_generation_++;
   }
 }
 
 void focusChildrenOf(Client* c, Window parent) {
   xlib::WindowTree wtree = xlib::WindowTree::Query(dpy, parent);
+  // Ask about all the children before looking at any of the answers, so this
+  // only costs one round trip however many children there are.
+  std::vector<xlib::async::Reply<XWindowAttributes>> attrs;
   for (Window win : wtree.children) {
-    const XWindowAttributes attr = xlib::XGetWindowAttributes(win);
-    if (attr.all_event_masks & FocusChangeMask) {
+    attrs.push_back(xlib::async::GetWindowAttributes(win));
+  }
+  for (size_t i = 0; i < attrs.size(); i++) {
+    const Window win = wtree.children[i];
+    if (attrs[i].Get().all_event_masks & FocusChangeMask) {
       LOGD(c) << "  Focusing child " << WinID(win);
       XSetInputFocus(dpy, win, RevertToPointerRoot, CurrentTime);
     }
@@ -204,7 +216,7 @@ void Client::FocusGained() {
     // focused.
     XUngrabButton(dpy, AnyButton, AnyModifier, window);
   }
-  DrawBorder();
+  Deferred::I->Redraw(this);
 }
 
 void Client::FocusLost() {
@@ -218,26 +230,35 @@ void Client::FocusLost() {
                 ButtonPressMask | ButtonReleaseMask, GrabModeAsync,
                 GrabModeSync, None, None);
   }
-  DrawBorder();
+  Deferred::I->Redraw(this);
 }
 
-void Client::DrawBorder() {
-  if (parent == LScr::I->Root() || parent == 0 || !framed ||
-      wstate.fullscreen) {
-    return;
-  }
-  const bool active = HasFocus();
+// damageHits returns true if there's no damage region (meaning everything is
+// to be drawn), or if the damage region intersects the given rectangle.
+static bool damageHits(Region damage, const Rect& r) {
+  return !damage || XRectInRegion(damage, r.xMin, r.yMin, r.width(),
+                                  r.height()) != RectangleOut;
+}
 
-  XSetWindowBackground(
-      dpy, parent,
-      active ? LScr::I->ActiveBorder() : LScr::I->InactiveBorder());
-  XClearWindow(dpy, parent);
+Client::~Client() {
+  freeTitlePixmaps();
+  if (IconDecoder::I) {
+    IconDecoder::I->Cancel(window);
+  }
+  delete icon_;
+}
 
-  // Cross for the close icon.
+// Cross for the close icon.
+void Client::drawCloseIcon(Drawable d, bool active) {
   const Rect r = closeBounds(true);  // true -> get display bounds.
   const GC close_gc = LScr::I->GetCloseIconGC(active);
-  XDrawLine(dpy, parent, close_gc, r.xMin, r.yMin, r.xMax, r.yMax);
-  XDrawLine(dpy, parent, close_gc, r.xMin, r.yMax, r.xMax, r.yMin);
+  XDrawLine(dpy, d, close_gc, r.xMin, r.yMin, r.xMax, r.yMax);
+  XDrawLine(dpy, d, close_gc, r.xMin, r.yMax, r.xMax, r.yMin);
+}
+
+// The title strip: background, icon and title text. This is drawn over
+// whatever's there, so the caller must clear the strip first.
+void Client::drawTitle(Drawable d, bool active) {
   const int bw = borderWidth();
   const int quarter = (titleBarHeight()) / 4;
   if (active) {
@@ -250,7 +271,7 @@ void Client::DrawBorder() {
     const int x = bw + 3 * quarter;
     const int w = FrameRect().width() - 2 * x;
     const int h = textHeight() + bw - topBW;
-    XFillRectangle(dpy, parent, LScr::I->GetTitleGC(), x, topBW, w, h);
+    XFillRectangle(dpy, d, LScr::I->GetTitleGC(), x, topBW, w, h);
   }
 
   // Find where the title stuff is going to go.
@@ -260,16 +281,129 @@ void Client::DrawBorder() {
   // Do we have an icon? If so, draw it to the left of the title text.
   if (Icon() && Resources::I->AppIconInWindowTitle()) {
     if (active) {
-      Icon()->PaintActive(parent, x, 0, titleBarHeight(), titleBarHeight());
+      Icon()->PaintActive(d, x, 0, titleBarHeight(), titleBarHeight());
     } else {
-      Icon()->PaintInactive(parent, x, 0, titleBarHeight(), titleBarHeight());
+      Icon()->PaintInactive(d, x, 0, titleBarHeight(), titleBarHeight());
     }
     x += titleBarHeight();  // Title bar text must come after.
   }
 
   // Draw window title.
   XftColor* color = active ? &g_font_active_title : &g_font_inactive_title;
-  drawString(parent, x, y, Name(), color);
+  drawString(d, x, y, Name(), color);
+}
+
+void Client::DrawBorder(Region damage) {
+  if (parent == LScr::I->Root() || parent == 0 || !framed ||
+      wstate.fullscreen) {
+    return;
+  }
+  const bool active = HasFocus();
+  const unsigned long background =
+      active ? LScr::I->ActiveBorder() : LScr::I->InactiveBorder();
+
+  // The borders are simply the frame's background. When repairing damage,
+  // the server has already cleared the damaged area to the background for us,
+  // so the borders need no further attention. That's only true if we've set
+  // the right background, though; if not, repaint everything.
+  if (damage && background != frame_background_) {
+    damage = nullptr;
+  }
+  if (Resources::I->CachedTitles()) {
+    drawCachedBorder(damage, active, background);
+    return;
+  }
+  if (!damage) {
+    XSetWindowBackground(dpy, parent, background);
+    frame_background_ = background;
+    XClearWindow(dpy, parent);
+  }
+
+  // The close icon's lines are 2 pixels wide, so grow the bounds to include
+  // the bits of line sticking out of them.
+  const Rect r = closeBounds(true);  // true -> get display bounds.
+  const Rect cross{r.xMin - 1, r.yMin - 1, r.xMax + 2, r.yMax + 2};
+  if (damageHits(damage, cross)) {
+    drawCloseIcon(parent, active);
+  }
+
+  // The title strip extends all the way to the right of the frame, as long
+  // titles aren't clipped.
+  const int bw = borderWidth();
+  const int quarter = (titleBarHeight()) / 4;
+  const Rect title{bw + 3 * quarter, 0, FrameRect().width(), titleBarHeight()};
+  if (!damageHits(damage, title)) {
+    return;
+  }
+  if (damage) {
+    // Only part of the title strip may be damaged, but we redraw all of it, so
+    // start from a clean background to avoid blending text over itself.
+    XClearArea(dpy, parent, title.xMin, title.yMin, title.width(),
+               title.height(), false);
+  }
+  drawTitle(parent, active);
+}
+
+void Client::drawCachedBorder(Region damage,
+                              bool active,
+                              unsigned long background) {
+  // The pixmap covers the whole width of the frame, from the top down to the
+  // client window, so it includes the close icon and the top border as well
+  // as the title strip.
+  const int width = FrameRect().width();
+  const int height = titleBarHeight();
+  if (width <= 0 || height <= 0) {
+    return;
+  }
+  Pixmap& pm = title_pm_[active];
+  TitleKey& drawn = title_key_[active];
+  const TitleKey key{Name(), icon_generation_, width};
+  if (!pm || !(key == drawn)) {
+    if (pm && drawn.width != width) {
+      forgetDrawable(pm);
+      XFreePixmap(dpy, pm);
+      pm = None;
+    }
+    if (!pm) {
+      pm = XCreatePixmap(dpy, parent, width, height,
+                         DefaultDepth(dpy, LScr::kOnlyScreenIndex));
+    }
+    XFillRectangle(dpy, pm, LScr::I->GetBorderGC(active), 0, 0, width, height);
+    drawCloseIcon(pm, active);
+    drawTitle(pm, active);
+    drawn = key;
+  }
+
+  Rect copy{0, 0, width, height};
+  if (damage) {
+    XRectangle box;
+    XClipBox(damage, &box);
+    copy = Rect::Intersect(
+        copy, Rect::FromXYWH(box.x, box.y, box.width, box.height));
+    if (copy.empty()) {
+      return;
+    }
+  } else {
+    if (background != frame_background_) {
+      XSetWindowBackground(dpy, parent, background);
+      frame_background_ = background;
+    }
+    // Only clear below the title bar, as the copy covers the rest. Clearing
+    // that too would make the title flicker.
+    XClearArea(dpy, parent, 0, height, 0, 0, false);
+  }
+  XCopyArea(dpy, pm, parent, LScr::I->GetCopyGC(), copy.xMin, copy.yMin,
+            copy.width(), copy.height(), copy.xMin, copy.yMin);
+}
+
+void Client::freeTitlePixmaps() {
+  for (Pixmap& pm : title_pm_) {
+    if (pm) {
+      forgetDrawable(pm);
+      XFreePixmap(dpy, pm);
+      pm = None;
+    }
+  }
 }
 
 Rect Client::FrameRect() const {
@@ -310,11 +444,11 @@ Rect Client::FrameFromContentRect(const Rect& r) {
 
 void Client::Remove() {
   if (parent != LScr::I->Root()) {
+    forgetDrawable(parent);
     XDestroyWindow(dpy, parent);
   }
   LScr::I->Remove(this);
-  ewmh_set_client_list();
-  ewmh_set_strut();
+  Deferred::I->Mark(Deferred::CLIENT_LIST | Deferred::WORKAREA);
 }
 
 std::string makeSizeString(int x, int y) {
@@ -323,14 +457,13 @@ std::string makeSizeString(int x, int y) {
   return buf.str();
 }
 
-void Client_SizeFeedback() {
+void Client_SizeFeedback(const MousePos& mp) {
   // Make the popup 10% wider than the widest string it needs to show.
   popup_width =
       textWidth(makeSizeString(DisplayWidth(dpy, 0), DisplayHeight(dpy, 0)));
   popup_width += popup_width / 10;
 
   // Put the popup in the right place to report on the window's size.
-  const MousePos mp = getMousePosition();
   xlib::XMoveResizeWindow(LScr::I->Popup(), mp.x + 8, mp.y + 8, popup_width,
                           textHeight() + 1);
   xlib::XMapRaised(LScr::I->Popup());
@@ -356,31 +489,26 @@ std::string Client::SizeString() const {
                         y_limiter_.DisplayableSize(content_rect_.height()));
 }
 
+// Raise and Lower only change our stacking model; the server is brought into
+// line when the deferred work is done, so a batch of them costs at most one
+// request per window which actually moves.
 void Client::Lower() {
-  xlib::XLowerWindow(window);
-  if (framed) {
-    xlib::XLowerWindow(parent);
-  }
-  ewmh_set_client_list();
+  LScr::I->GetStacking()->Lower(framed ? parent : window);
+  Deferred::I->Mark(Deferred::STACKING);
 }
 
 void Client::Raise() {
-  if (framed) {
-    xlib::XRaiseWindow(parent);
-  }
-  xlib::XRaiseWindow(window);
+  Stacking* stacking = LScr::I->GetStacking();
+  stacking->Raise(framed ? parent : window);
 
   for (auto it : LScr::I->Clients()) {
     Client* tr = it.second;
     if (tr->trans != window && !(framed && tr->trans == parent)) {
       continue;
     }
-    if (tr->framed) {
-      xlib::XRaiseWindow(tr->parent);
-    }
-    xlib::XRaiseWindow(tr->window);
+    stacking->Raise(tr->framed ? tr->parent : tr->window);
   }
-  ewmh_set_client_list();
+  Deferred::I->Mark(Deferred::STACKING);
 }
 
 void Client::Close() {
@@ -393,12 +521,18 @@ void Client::Close() {
 }
 
 void Client::SetState(int state) {
+  state_ = state;
+  if (state != WithdrawnState) {
+    Deferred::I->WriteState(this);
+    return;
+  }
+  // Withdrawal is followed by a sync and, often, the window's destruction, so
+  // there is no later batch end at which to write the properties.
   long data[2];
 
   data[0] = (long)state;
   data[1] = (long)None;
 
-  state_ = state;
   XChangeProperty(dpy, window, wm_state, wm_state, 32, PropModeReplace,
                   (unsigned char*)data, 2);
   ewmh_set_state(this);
@@ -459,6 +593,53 @@ void Client::Release() {
   XWindowChanges wc{};
   wc.border_width = original_border_width_;
   xlib::XConfigureWindow(window, CWBorderWidth, &wc);
+
+  // A frame adopted after a restart belongs to the old LWM's connection, so
+  // won't go when ours is closed.
+  forgetDrawable(parent);
+  XDestroyWindow(dpy, parent);
+}
+
+HandoffClient Client::SaveState() const {
+  HandoffClient s;
+  s.window = window;
+  s.frame = framed ? parent : 0;
+  s.hidden = hidden;
+  s.fullscreen = wstate.fullscreen;
+  s.content = content_rect_;
+  s.pre_full_screen = pre_full_screen_content_rect_;
+  s.original_border_width = original_border_width_;
+  s.visible_name = visible_name_;
+  return s;
+}
+
+void Client::HandOver() {
+  freeTitlePixmaps();
+  delete icon_;
+  icon_ = nullptr;
+  // The server keeps the event selections and grabs of a window's creator
+  // when it's retained, and only one client may select button presses or
+  // redirection, so the new LWM couldn't have them.
+  if (framed) {
+    XSelectInput(dpy, parent, NoEventMask);
+  }
+  XUngrabButton(dpy, AnyButton, AnyModifier, window);
+  // Make sure the window isn't taken out of its frame when we disconnect.
+  XRemoveFromSaveSet(dpy, window);
+}
+
+void Client::RestoreState(const HandoffClient& s) {
+  // EnterFullScreen will remember where the window was before, and a framed
+  // window's geometry is relative to the frame, so isn't what we want.
+  if (s.fullscreen) {
+    content_rect_ = s.pre_full_screen;
+  } else if (s.frame) {
+    content_rect_ = s.content;
+  }
+  pre_full_screen_content_rect_ = s.pre_full_screen;
+  // We set the window's border width to zero when we first managed it.
+  original_border_width_ = s.original_border_width;
+  visible_name_ = s.visible_name;
 }
 
 void Client::EnterFullScreen() {
@@ -482,7 +663,7 @@ void Client::EnterFullScreen() {
     xlib::XMoveResizeWindow(parent, content_rect_);
   }
   xlib::XMoveResizeWindow(window, content_rect_);
-  xlib::XRaiseWindow(framed ? parent : window);
+  Raise();
   SendConfigureNotify();
 }
 
@@ -620,7 +801,22 @@ void Client::FurnishAt(Rect rect) {
 Focuser::Focuser()
     : timer_fd_(timerfd_create(CLOCK_MONOTONIC, 0)),
       second_entry_delay_millis_(
-          Resources::I->GetInt(Resources::FOCUS_DELAY_MILLIS)) {}
+          Resources::I->GetInt(Resources::FOCUS_DELAY_MILLIS)) {
+  EventLoop::I->AddSource("focus timer", timer_fd_, [this] {
+    TimerFDTriggered();
+    // My best guess as to why we need this is that, because the event we
+    // received didn't come off the Xlib connection (but rather our own timer
+    // file descriptor), messages to the X server don't get flushed
+    // automatically. The effect of this is that the delayed focus granting
+    // sort of happens, but doesn't look like it did until the user does
+    // something that triggers any event in LWM (like moving the mouse by a
+    // pixel).
+    // So call XSync so that we're sure all outstanding messages to, for
+    // example, tell the client it has input focus, and redraw its frame, get
+    // through.
+    XSync(dpy, false);
+  });
+}
 
 uint64_t GetTimeMilliseconds() {
   struct timespec spec = {};
@@ -796,6 +992,13 @@ void Focuser::RemoveFromHistory(Client* c) {
   }
 }
 
+void Focuser::RestoreHistory(const std::vector<Client*>& history) {
+  focus_history_.assign(history.begin(), history.end());
+  if (!focus_history_.empty()) {
+    ReallyFocusClient(focus_history_.front(), true);
+  }
+}
+
 Client* Focuser::GetFocusedClient() {
   if (focus_history_.empty()) {
     return nullptr;
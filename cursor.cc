@@ -58,3 +58,11 @@ Cursor CursorMap::ForEdge(Edge e) const {
   auto it = edges_.find(e);
   return (it == edges_.end()) ? Root() : it->second;
 }
+
+void CursorMap::Free(Display* dpy) {
+  XFreeCursor(dpy, root_);
+  for (const auto& it : edges_) {
+    XFreeCursor(dpy, it.second);
+  }
+  edges_.clear();
+}
@@ -1,4 +1,10 @@
+#include <iomanip>
+
+#include "eventloop.h"
 #include "ewmh.h"
+#include "histogram.h"
+#include "iconcache.h"
+#include "icondecoder.h"
 #include "lwm.h"
 #include "xlib.h"
 
@@ -155,6 +161,86 @@ void DebugCLI::CmdDbg(string line) {
   LOGD(c) << "Debugging enabled for client";
 }
 
+void cmdLoop() {
+  cout << EventLoop::I->Wakeups() << " wakeups\n";
+  // The sequence number of the last request is the number we've sent.
+  cout << NextRequest(dpy) - 1 << " X requests sent\n";
+  for (const EventLoop::SourceStats& st : EventLoop::I->Stats()) {
+    cout << "  fd " << st.fd << " (" << st.name << "): " << st.wakes
+         << " wakes, " << st.callback_micros << "us in callback";
+    if (st.wakes) {
+      cout << " (" << st.callback_micros / st.wakes << "us average)";
+    }
+    cout << "\n";
+  }
+  cout << DroppedMotionEvents() << " motion events dropped by compression\n";
+  cout << Deferred::I->Marks() << " deferred work items, done in "
+       << Deferred::I->Runs() << " batches\n";
+}
+
+// Formats a duration for the latency table: microseconds, with one decimal
+// place, as that's the scale most of our handlers work on.
+string formatMicros(uint64_t nanos) {
+  ostringstream os;
+  os << nanos / 1000 << "." << (nanos % 1000) / 100;
+  return os.str();
+}
+
+void cmdLatency(string line) {
+  if (line == "reset") {
+    ResetDispatchLatencies();
+    cout << "Latency histograms reset\n";
+    return;
+  } else if (line != "") {
+    cout << "Usage: latency [reset]\n";
+    return;
+  }
+  cout << "handler                count   p50(us)   p99(us)   max(us)\n";
+  for (const auto& it : DispatchLatencies()) {
+    const LatencyHistogram* h = it.second;
+    cout << setw(20) << left << it.first << right << setw(9) << h->Count()
+         << setw(10) << formatMicros(h->Percentile(50)) << setw(10)
+         << formatMicros(h->Percentile(99)) << setw(10)
+         << formatMicros(h->Max()) << "\n";
+  }
+}
+
+void cmdTree(string line) {
+  ShadowTree* tree = LScr::I->Tree();
+  if (line == "check") {
+    const std::vector<string> diffs = tree->Check();
+    for (const string& diff : diffs) {
+      cout << diff << "\n";
+    }
+    cout << diffs.size() << " of " << tree->Size()
+         << " windows differ from the server\n";
+    return;
+  } else if (line == "verify on" || line == "verify off") {
+    tree->SetVerify(line == "verify on");
+    return;
+  } else if (line != "") {
+    cout << "Usage: tree [check | verify on | verify off]\n";
+    return;
+  }
+  cout << tree->Size() << " windows known, " << tree->Hits()
+       << " parent lookups answered locally, " << tree->Misses()
+       << " sent to the server; verify is " << (tree->Verify() ? "on" : "off")
+       << "\n";
+}
+
+void cmdIcons() {
+  if (!IconDecoder::I) {
+    cout << "Application icons are off\n";
+    return;
+  }
+  cout << IconDecoder::I->Outstanding() << " icons still being made\n";
+  if (IconDiskCache::I) {
+    cout << IconDiskCache::I->Loaded() << " icons loaded from the disk cache\n";
+  } else {
+    cout << "No disk cache\n";
+  }
+}
+
 void cmdLS() {
   for (const auto& kv : LScr::I->Clients()) {
     cout << *(kv.second) << "\n";
@@ -287,6 +373,12 @@ void DebugCLI::ResetDeadZones(const vector<Rect>& visible) {
 void DebugCLI::Read() {
   char buf[1024];
   ssize_t bytes = read(STDIN_FILENO, buf, sizeof(buf));
+  if (bytes <= 0) {
+    // Stdin has been closed; stop listening, or we'd be woken up constantly.
+    LOGI() << "End of input on stdin; debug CLI will no longer listen";
+    EventLoop::I->RemoveSource(STDIN_FILENO);
+    return;
+  }
   if (bytes == sizeof(buf)) {
     LOGE() << "A whole " << bytes << " bytes on one line? You're crazy.";
     return;
@@ -304,6 +396,7 @@ void DebugCLI::Init(const std::vector<std::string>& init_commands) {
   for (const std::string& s : init_commands) {
     ProcessLine(s);
   }
+  EventLoop::I->AddSource("debug CLI", STDIN_FILENO, [this] { Read(); });
   cout << "Debug CLI enabled. Will listen for commands on stdin.\n";
   cout << "Type 'help' for help\n> " << flush;
 }
@@ -316,11 +409,23 @@ void DebugCLI::ProcessLine(string line) {
     cmdLS();
   } else if (cmd == "dbg") {
     CmdDbg(line);
+  } else if (cmd == "icons") {
+    cmdIcons();
+  } else if (cmd == "latency") {
+    cmdLatency(line);
+  } else if (cmd == "loop") {
+    cmdLoop();
+  } else if (cmd == "tree") {
+    cmdTree(line);
   } else if (cmd == "help") {
     cout << "Available commands:\n";
     cout << "  dbg     enable/disable per-client debug messages\n";
     cout << "  help    print this help message\n";
+    cout << "  icons   show how many icons are still being made\n";
+    cout << "  latency show (or 'reset') per-event handler latency\n";
+    cout << "  loop    show event loop wakeup and callback time statistics\n";
     cout << "  ls      list active clients\n";
+    cout << "  tree    show (or 'check', or 'verify on|off') the window tree\n";
     cout << "  xrandr  simulate xrandr desktop screen config changes\n";
   } else if (cmd != "") {  // Silently ignore the user hammering Return
     cout << "Didn't understand command '" << cmd << "'\n";
@@ -0,0 +1,57 @@
+#include "ewmh.h"
+#include "lwm.h"
+
+Deferred* Deferred::I;
+
+void Deferred::Mark(unsigned items) {
+  marks_++;
+  items_ |= items;
+}
+
+void Deferred::Redraw(Client* c) {
+  marks_++;
+  redraws_.insert(c);
+}
+
+void Deferred::WriteState(Client* c) {
+  marks_++;
+  states_.insert(c);
+}
+
+void Deferred::Forget(Client* c) {
+  redraws_.erase(c);
+  states_.erase(c);
+}
+
+void Deferred::Run() {
+  if (!items_ && redraws_.empty() && states_.empty()) {
+    return;
+  }
+  runs_++;
+  const unsigned items = items_;
+  items_ = 0;
+  if (items & STACKING) {
+    fix_stack();
+  }
+  if (items & (STACKING | CLIENT_LIST)) {
+    ewmh_set_client_list();
+  }
+  if (items & WORKAREA) {
+    ewmh_set_strut();
+  }
+  // Take copies, in case anything below wants to defer more work. It will be
+  // picked up on the next run.
+  const std::set<Client*> states = std::move(states_);
+  states_.clear();
+  for (Client* c : states) {
+    long data[2] = {(long)c->State(), (long)None};
+    XChangeProperty(dpy, c->window, wm_state, wm_state, 32, PropModeReplace,
+                    (unsigned char*)data, 2);
+    ewmh_set_state(c);
+  }
+  const std::set<Client*> redraws = std::move(redraws_);
+  redraws_.clear();
+  for (Client* c : redraws) {
+    c->DrawBorder();
+  }
+}
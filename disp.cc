@@ -17,16 +17,26 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  */
 
+#include <errno.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <functional>
+
+#include "eventloop.h"
 #include "ewmh.h"
+#include "histogram.h"
 #include "lwm.h"
+#include "trace.h"
 
-void EvExpose(XEvent* ev) {
-  // Only handle the last in a group of Expose events.
-  if (ev->xexpose.count != 0) {
-    return;
-  }
+// Expose events come in groups, the last of which has a count of zero. Rather
+// than repainting everything when we see the last one, we accumulate all the
+// rectangles in a group into a damage region for the window, and only repaint
+// the bits of furniture that intersect it.
+static std::map<Window, Region> damage_regions;
 
-  Window w = ev->xexpose.window;
+void EvExpose(XEvent* ev) {
+  const XExposeEvent& e = ev->xexpose;
+  Window w = e.window;
 
   // We don't draw on the root window so that people can have
   // their favourite Spice Girls backdrop...
@@ -34,17 +44,33 @@ void EvExpose(XEvent* ev) {
     return;
   }
 
+  Region& damage = damage_regions[w];
+  if (!damage) {
+    damage = XCreateRegion();
+  }
+  XRectangle rect{short(e.x), short(e.y), (unsigned short)e.width,
+                  (unsigned short)e.height};
+  XUnionRectWithRegion(&rect, damage, damage);
+
+  // Only paint when we've seen the last in a group of Expose events.
+  if (e.count != 0) {
+    return;
+  }
+  Region region = damage;
+  damage_regions.erase(w);
+
   // Decide what needs redrawing: window frame or menu?
   if (w == LScr::I->Popup()) {
     size_expose();
   } else if (w == LScr::I->Menu()) {
-    LScr::I->GetHider()->Paint();
+    LScr::I->GetHider()->Paint(region);
   } else {
     Client* c = LScr::I->GetClient(w);
     if (c != 0) {
-      c->DrawBorder();
+      c->DrawBorder(region);
     }
   }
+  XDestroyRegion(region);
 }
 
 static DragHandler* current_dragger = nullptr;
@@ -84,6 +110,124 @@ class MenuDragger : public DragHandler {
   virtual void End(XEvent* ev) { LScr::I->GetHider()->MouseRelease(ev); }
 };
 
+// The refresh rate we assume for monitors XRandR hasn't told us about.
+#define DEFAULT_REFRESH_RATE 60
+
+// DragPacer limits how often an interactive move or resize is applied.
+// Reconfiguring a window more often than the monitor showing it refreshes is
+// wasted effort, both for us and for the client, which has to handle a
+// ConfigureNotify (and probably redraw) each time. So each new drag position
+// replaces any pending one, and the latest is applied at most once per refresh
+// interval. A timer makes sure the last position is applied even if the
+// pointer then stops moving.
+class DragPacer {
+ public:
+  DragPacer() = default;
+
+  // Submits a new drag position for a window whose frame occupies area.
+  // The apply function either gets called immediately, or when the timer next
+  // goes off (unless it's superseded by a later call to Submit first).
+  void Submit(const Rect& area, std::function<void()> apply);
+
+  // Applies any pending drag position now, and stops the timer.
+  void Flush();
+
+  // Drops any pending drag position without applying it.
+  void Cancel();
+
+ private:
+  static uint64_t intervalNanos(const Rect& area);
+  void applyPending();
+  void timerFired();
+  void disarm();
+
+  int timer_fd_ = -1;
+  bool armed_ = false;
+  uint64_t last_apply_nanos_ = 0;
+  std::function<void()> pending_;
+};
+
+static DragPacer drag_pacer;
+
+// static
+uint64_t DragPacer::intervalNanos(const Rect& area) {
+  double rate = LScr::I->RefreshRateFor(area);
+  if (rate <= 0) {
+    rate = DEFAULT_REFRESH_RATE;
+  }
+  const int max_rate = Resources::I->GetInt(Resources::MAX_DRAG_RATE);
+  if (max_rate > 0 && rate > max_rate) {
+    rate = max_rate;
+  }
+  return uint64_t(1e9 / rate);
+}
+
+void DragPacer::Submit(const Rect& area, std::function<void()> apply) {
+  pending_ = apply;
+  if (armed_) {
+    return;  // The timer will pick up the new position.
+  }
+  const uint64_t interval = intervalNanos(area);
+  const uint64_t now = MonotonicNanos();
+  if (now - last_apply_nanos_ >= interval) {
+    applyPending();
+    return;
+  }
+  if (timer_fd_ < 0) {
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd_ < 0) {
+      LOGE() << "Failed to create drag timer: " << Log::Errno(errno);
+      applyPending();
+      return;
+    }
+    EventLoop::I->AddSource("drag pacer", timer_fd_, [this] { timerFired(); });
+  }
+  const uint64_t wait = last_apply_nanos_ + interval - now;
+  struct itimerspec spec = {};
+  spec.it_value.tv_sec = wait / 1000000000;
+  spec.it_value.tv_nsec = wait % 1000000000;
+  timerfd_settime(timer_fd_, 0, &spec, nullptr);
+  armed_ = true;
+}
+
+void DragPacer::Flush() {
+  disarm();
+  applyPending();
+}
+
+void DragPacer::Cancel() {
+  disarm();
+  pending_ = nullptr;
+}
+
+void DragPacer::applyPending() {
+  if (!pending_) {
+    return;
+  }
+  std::function<void()> apply;
+  apply.swap(pending_);
+  last_apply_nanos_ = MonotonicNanos();
+  apply();
+}
+
+void DragPacer::timerFired() {
+  uint64_t expirations;
+  if (read(timer_fd_, &expirations, sizeof(expirations)) < 0) {
+    return;  // Disarmed since it went off.
+  }
+  armed_ = false;
+  applyPending();
+}
+
+void DragPacer::disarm() {
+  if (!armed_) {
+    return;
+  }
+  struct itimerspec spec = {};
+  timerfd_settime(timer_fd_, 0, &spec, nullptr);
+  armed_ = false;
+}
+
 // WindowDragger handles the shared bit of actions which involve dragging, such
 // as moving or resizing windows.
 // This class keeps track of where the mouse pointer was when the button was
@@ -93,20 +237,25 @@ class MenuDragger : public DragHandler {
 class WindowDragger : public DragHandler {
  public:
   WindowDragger(Client* c) : window_(c->parent) {}
+  virtual ~WindowDragger() { drag_pacer.Cancel(); }
 
-  virtual void Start(XEvent*) {
-    start_pos_ = getMousePosition();
+  virtual void Start(XEvent* ev) {
+    start_pos_ = mousePositionFromEvent(ev);
     LOGD(LScr::I->GetClient(window_))
         << "Window drag from " << start_pos_.x << ", " << start_pos_.y;
   }
 
   virtual bool Move(XEvent* ev) {
     Client* c = LScr::I->GetClient(window_);
-    MousePos mp = getMousePosition();
+    // All the information we need is in the motion event, so there's no need
+    // to ask the server where the pointer is (which would cost us a round trip
+    // per motion event).
+    MousePos mp = mousePositionFromEvent(ev);
     // Cancel everything if either the client has disappeared (window closed
     // while we were dragging it), or if we're somehow no longer holding the
     // mouse button down. This latter hack prevents randomly dragging around
-    // windows due to a race condition in X.
+    // windows due to a race condition in X. A motion event's state tells us
+    // which buttons were held when the pointer moved.
     if (!c || !(mp.modMask & MOVING_BUTTON_MASK)) {
       // Either the client window closed underneath us, or we're somehow not
       // holding the mouse button down, despite not having seen the unclick
@@ -114,14 +263,26 @@ class WindowDragger : public DragHandler {
       End(ev);
       return false;
     }
-    moveImpl(c, mp.x - start_pos_.x, mp.y - start_pos_.y);
+    const int dx = mp.x - start_pos_.x;
+    const int dy = mp.y - start_pos_.y;
+    drag_pacer.Submit(c->FrameRect(), [this, mp, dx, dy] {
+      // The window may have closed while this position was pending.
+      Client* c = LScr::I->GetClient(window_);
+      if (c) {
+        moveImpl(c, mp, dx, dy);
+      }
+    });
     return true;
   }
 
-  virtual void moveImpl(Client* c, int dx, int dy) = 0;
+  // Applies the drag, where mp is the current mouse position, and dx and dy
+  // are the distances it has moved since the drag started.
+  virtual void moveImpl(Client* c, const MousePos& mp, int dx, int dy) = 0;
 
-  virtual void End(XEvent*) {
-    MousePos mp = getMousePosition();
+  virtual void End(XEvent* ev) {
+    // Make sure the window ends up at the last position we saw.
+    drag_pacer.Flush();
+    MousePos mp = mousePositionFromEvent(ev);
     LOGD(LScr::I->GetClient(window_))
         << "Window drag to " << mp.x << ", " << mp.y << " (moved "
         << (mp.x - start_pos_.x) << ", " << (mp.y - start_pos_.y) << ")";
@@ -143,7 +304,7 @@ class WindowMover : public WindowDragger {
         start_frame_rect_(c->FrameRect()),
         start_content_rect_(c->ContentRect()) {}
 
-  virtual void moveImpl(Client* c, int dx, int dy) {
+  virtual void moveImpl(Client* c, const MousePos&, int dx, int dy) {
     Rect r = Rect::Translate(start_frame_rect_, Point{dx, dy});
     // Implement edge resistance for all of the visible areas. There can be
     // several if we're using multiple monitors with xrandr, and they can be
@@ -197,8 +358,8 @@ class WindowResizer : public WindowDragger {
   WindowResizer(Client* c, Edge edge)
       : WindowDragger(c), edge_(edge), start_content_rect_(c->ContentRect()) {}
 
-  virtual void moveImpl(Client* c, int dx, int dy) {
-    Client_SizeFeedback();
+  virtual void moveImpl(Client* c, const MousePos& mp, int dx, int dy) {
+    Client_SizeFeedback(mp);
     Rect ns = start_content_rect_;
     // Vertical.
     if (isTopEdge(edge_)) {
@@ -239,11 +400,11 @@ class WindowResizer : public WindowDragger {
 class WindowClicker : public DragHandler {
  public:
   WindowClicker(Client* c) : window_(c->parent) {}
-  virtual void Start(XEvent*) { start_pos_ = getMousePosition(); }
+  virtual void Start(XEvent* ev) { start_pos_ = mousePositionFromEvent(ev); }
   virtual bool Move(XEvent*) { return true; }
 
-  virtual void End(XEvent*) {
-    MousePos mp = getMousePosition();
+  virtual void End(XEvent* ev) {
+    MousePos mp = mousePositionFromEvent(ev);
     const int dx = std::abs(start_pos_.x - mp.x);
     const int dy = std::abs(start_pos_.y - mp.y);
     if (std::max(dx, dy) > MAX_CLICK_DISTANCE) {
@@ -373,10 +534,13 @@ DragHandler* getDragHandlerForEvent(XEvent* ev) {
     // (generally middle), then force the mouse pointer to turn into the move
     // pointer, even if it's over an area of the window furniture which usually
     // has another pointer.
-    XChangeActivePointerGrab(dpy,
-                             ButtonMask | PointerMotionHintMask |
-                                 ButtonMotionMask | OwnerGrabButtonMask,
-                             LScr::I->Cursors()->ForEdge(ENone), CurrentTime);
+    // Don't ask for PointerMotionHintMask here: with hints, the server sends
+    // one motion event and then waits for us to query the pointer before
+    // sending another, which is exactly the round trip we're avoiding by
+    // taking positions from the events themselves.
+    XChangeActivePointerGrab(
+        dpy, ButtonMask | ButtonMotionMask | OwnerGrabButtonMask,
+        LScr::I->Cursors()->ForEdge(ENone), CurrentTime);
     return new WindowMover(c);
   }
   if (e->button == RESHAPE_BUTTON) {
@@ -456,7 +620,7 @@ void EvMapRequest(XEvent* ev) {
       c->SendConfigureNotify();
       break;
   }
-  ewmh_set_client_list();
+  Deferred::I->Mark(Deferred::CLIENT_LIST);
 }
 
 void EvUnmapNotify(XEvent* ev) {
@@ -567,6 +731,22 @@ Rect makeVisible(Rect r, bool withStruts) {
   return Rect::Translate(r, translation);
 }
 
+// Clients' requests to restack their windows go through our stacking model,
+// rather than straight to the server, or the two would no longer agree. We
+// don't try to honour a sibling, just the direction. Returns the request's
+// value mask, without the stacking part.
+static unsigned long stackViaModel(Client* c, const XConfigureRequestEvent& e) {
+  if (!(e.value_mask & CWStackMode)) {
+    return e.value_mask;
+  }
+  if (e.detail == Below || e.detail == BottomIf) {
+    c->Lower();
+  } else {
+    c->Raise();
+  }
+  return e.value_mask & ~(CWStackMode | CWSibling);
+}
+
 void EvConfigureRequest(XEvent* ev) {
   const XConfigureRequestEvent& e = ev->xconfigurerequest;
   // There are several situations in which we can receive a configure request.
@@ -590,7 +770,8 @@ void EvConfigureRequest(XEvent* ev) {
     wc.border_width = e.border_width;
     wc.sibling = e.above;
     wc.stack_mode = e.detail;
-    xlib::XConfigureWindow(e.window, e.value_mask, &wc);
+    xlib::XConfigureWindow(e.window, c ? stackViaModel(c, e) : e.value_mask,
+                           &wc);
     return;
   }
   LOGD(c) << "ConfigureRequest: " << e;
@@ -649,17 +830,16 @@ void EvConfigureRequest(XEvent* ev) {
     new_rect.yMax = new_rect.yMin + e.height;
   }
 
+  const unsigned long value_mask = stackViaModel(c, e);
   XWindowChanges wc{};
   c->FrameRect().To(wc);
   wc.border_width = 1;
-  wc.sibling = e.above;
-  wc.stack_mode = e.detail;
-  xlib::XConfigureWindow(e.parent, e.value_mask, &wc);
+  xlib::XConfigureWindow(e.parent, value_mask, &wc);
   c->SendConfigureNotify();
 
   c->ContentRectRelative().To(wc);
   wc.border_width = 0;
-  xlib::XConfigureWindow(e.window, e.value_mask, &wc);
+  xlib::XConfigureWindow(e.window, value_mask, &wc);
 
   if (new_rect.area() == c->ContentRect().area()) {
     c->MoveTo(new_rect);
@@ -676,8 +856,14 @@ std::ostream& operator<<(std::ostream& os, const XConfigureEvent& e) {
 
 void EvConfigureNotify(XEvent*) {}
 
+void EvCreateNotify(XEvent* ev) {
+  const XCreateWindowEvent* e = &ev->xcreatewindow;
+  LScr::I->Tree()->Created(e->window, e->parent);
+}
+
 void EvDestroyNotify(XEvent* ev) {
   Window w = ev->xdestroywindow.window;
+  LScr::I->Tree()->Destroyed(w);
   // Request the client, but without scanning this window's parents for it.
   // The window is gone, so any attempt to scan the window tree will result in
   // errors.
@@ -897,6 +1083,7 @@ void EvPropertyNotify(XEvent* ev) {
 
 void EvReparentNotify(XEvent* ev) {
   XReparentEvent* e = &ev->xreparent;
+  LScr::I->Tree()->Reparented(e->window, e->parent);
   if (e->event != LScr::I->Root() || e->override_redirect ||
       e->parent == LScr::I->Root()) {
     return;
@@ -954,6 +1141,13 @@ void EvFocusIn(XEvent* ev) {
   Window focus_window;
   int revert_to;
   XGetInputFocus(dpy, &focus_window, &revert_to);
+  if (Trace::I) {
+    TraceWindowQuery q = {};
+    q.ok = true;
+    q.other = focus_window;
+    q.mask = revert_to;
+    Trace::I->WindowQuery(TraceInputFocus, q);
+  }
   // There seems to be a bug in the Xserver, whereupon for the first focus-in
   // event we receive, XGetInputFocus returns focus_window==1, which doesn't
   // correspond to any actual window. In this case, fall back to the window
@@ -1003,8 +1197,57 @@ void EvEnterNotify(XEvent* ev) {
   }
 }
 
+// Number of MotionNotify events which were never passed to a DragHandler,
+// because a newer one for the same drag was already in the queue.
+static uint64_t dropped_motion_events;
+
+extern uint64_t DroppedMotionEvents() {
+  return dropped_motion_events;
+}
+
+struct MotionScan {
+  Window window;
+  bool barrier;
+};
+
+// Predicate for XCheckIfEvent, matching MotionNotify events for the window in
+// the MotionScan, but only up to the first button event in the queue. We
+// mustn't apply motion from after a button release to the drag it ended.
+static Bool isCompressibleMotion(Display*, XEvent* ev, XPointer arg) {
+  MotionScan* scan = reinterpret_cast<MotionScan*>(arg);
+  if (ev->type == ButtonPress || ev->type == ButtonRelease) {
+    scan->barrier = true;
+  }
+  return !scan->barrier && ev->type == MotionNotify &&
+         ev->xmotion.window == scan->window;
+}
+
+// A fast mouse can generate motion events much faster than we can move or
+// resize windows, and if we handle each one in turn, the window lags further
+// and further behind the pointer. As only the latest position matters to a
+// drag, replace ev with the newest queued motion event for the same window,
+// discarding those in between.
+static void compressMotion(XEvent* ev) {
+  XEvent next;
+  while (true) {
+    MotionScan scan{ev->xmotion.window, false};
+    if (!XCheckIfEvent(dpy, &next, isCompressibleMotion,
+                       reinterpret_cast<XPointer>(&scan))) {
+      return;
+    }
+    // processXEvents only records the events it takes from the queue, and
+    // a replay must end the drag where we did.
+    if (Trace::I) {
+      Trace::I->Event(next);
+    }
+    *ev = next;
+    dropped_motion_events++;
+  }
+}
+
 void EvMotionNotify(XEvent* ev) {
   if (current_dragger) {
+    compressMotion(ev);
     if (!current_dragger->Move(ev)) {
       current_dragger = nullptr;
     }
@@ -1026,11 +1269,44 @@ void EvMotionNotify(XEvent* ev) {
   }
 }
 
+// Time spent in each of the Ev* handlers, indexed by event type. The name is
+// filled in the first time a handler runs.
+struct HandlerLatency {
+  const char* name = nullptr;
+  LatencyHistogram hist;
+};
+static HandlerLatency handler_latency[LASTEvent];
+
+static void recordLatency(int type, const char* name, uint64_t start) {
+  HandlerLatency& hl = handler_latency[type];
+  hl.name = name;
+  hl.hist.Record(MonotonicNanos() - start);
+}
+
+std::vector<std::pair<std::string, const LatencyHistogram*>>
+DispatchLatencies() {
+  std::vector<std::pair<std::string, const LatencyHistogram*>> res;
+  for (const HandlerLatency& hl : handler_latency) {
+    if (hl.name && hl.hist.Count()) {
+      res.push_back(std::make_pair(hl.name, &hl.hist));
+    }
+  }
+  return res;
+}
+
+void ResetDispatchLatencies() {
+  for (HandlerLatency& hl : handler_latency) {
+    hl.hist.Reset();
+  }
+}
+
 extern void DispatchXEvent(XEvent* ev) {
+  const uint64_t start = MonotonicNanos();
   switch (ev->type) {
-#define EV(x)  \
-  case x:      \
-    Ev##x(ev); \
+#define EV(x)                         \
+  case x:                             \
+    Ev##x(ev);                        \
+    recordLatency(x, "Ev" #x, start); \
     break
 
     EV(Expose);
@@ -1049,10 +1325,10 @@ extern void DispatchXEvent(XEvent* ev) {
     EV(EnterNotify);
     EV(CirculateRequest);
     EV(ConfigureNotify);
+    EV(CreateNotify);
 #undef EV
 
     case LeaveNotify:
-    case CreateNotify:
     case GravityNotify:
     case MapNotify:
     case MappingNotify:
@@ -0,0 +1,141 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include "eventloop.h"
+#include "log.h"
+
+EventLoop* EventLoop::I;
+
+uint64_t MonotonicNanos() {
+  struct timespec spec = {};
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return uint64_t(spec.tv_sec) * 1000000000 + uint64_t(spec.tv_nsec);
+}
+
+namespace {
+
+// How many ready file descriptors we collect per wakeup. If more than this are
+// ready at once, the rest will simply be reported on the next wakeup.
+constexpr int kMaxEvents = 16;
+
+}  // namespace
+
+EventLoop::EventLoop() {
+#ifdef __linux__
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  LOGF_IF(epoll_fd_ < 0) << "Failed to create epoll fd: " << Log::Errno(errno);
+#endif
+}
+
+EventLoop::~EventLoop() {
+  if (epoll_fd_ >= 0) {
+    close(epoll_fd_);
+  }
+}
+
+void EventLoop::AddSource(const std::string& name,
+                          int fd,
+                          std::function<void()> callback) {
+  auto it = sources_.find(fd);
+  LOGF_IF(it != sources_.end() && !it->second.removed)
+      << "Event source '" << name << "' uses fd " << fd
+      << ", which is already registered by '" << it->second.name << "'";
+  Source& src = sources_[fd];
+  src = Source();
+  src.name = name;
+  src.callback = callback;
+#ifdef __linux__
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev)) {
+    LOGE() << "Failed to add fd " << fd << " (" << name
+           << ") to epoll set: " << Log::Errno(errno);
+  }
+#endif
+}
+
+void EventLoop::RemoveSource(int fd) {
+  auto it = sources_.find(fd);
+  if (it == sources_.end() || it->second.removed) {
+    return;
+  }
+  it->second.removed = true;
+#ifdef __linux__
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+}
+
+void EventLoop::RunOnce() {
+#ifdef __linux__
+  struct epoll_event events[kMaxEvents];
+  const int n = epoll_wait(epoll_fd_, events, kMaxEvents, -1);
+  if (n < 0) {
+    LOGE_IF(errno != EINTR) << "epoll_wait failed: " << Log::Errno(errno);
+    return;
+  }
+  wakeups_++;
+  for (int i = 0; i < n; i++) {
+    dispatch(events[i].data.fd);
+  }
+#else
+  std::vector<struct pollfd> fds;
+  for (const auto& it : sources_) {
+    fds.push_back(pollfd{it.first, POLLIN, 0});
+  }
+  if (poll(fds.data(), fds.size(), -1) < 0) {
+    LOGE_IF(errno != EINTR) << "poll failed: " << Log::Errno(errno);
+    return;
+  }
+  wakeups_++;
+  for (const struct pollfd& pfd : fds) {
+    if (pfd.revents) {
+      dispatch(pfd.fd);
+    }
+  }
+#endif
+  reap();
+}
+
+void EventLoop::dispatch(int fd) {
+  auto it = sources_.find(fd);
+  if (it == sources_.end() || it->second.removed) {
+    return;
+  }
+  Source& src = it->second;
+  src.wakes++;
+  const uint64_t start = MonotonicNanos();
+  src.callback();
+  // Removed sources aren't erased until reap(), so src is still valid here.
+  src.callback_nanos += MonotonicNanos() - start;
+}
+
+void EventLoop::reap() {
+  for (auto it = sources_.begin(); it != sources_.end();) {
+    if (it->second.removed) {
+      it = sources_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+std::vector<EventLoop::SourceStats> EventLoop::Stats() const {
+  std::vector<SourceStats> res;
+  for (const auto& it : sources_) {
+    if (it.second.removed) {
+      continue;
+    }
+    res.push_back(SourceStats{it.second.name, it.first, it.second.wakes,
+                              it.second.callback_nanos / 1000});
+  }
+  return res;
+}
@@ -0,0 +1,91 @@
+#ifndef LWM_EVENTLOOP_H_included
+#define LWM_EVENTLOOP_H_included
+
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+// EventLoop is the thing LWM spends most of its life blocked in. Subsystems
+// which have a file descriptor that needs watching (the X connection, the
+// Focuser's timer, the session manager's ICE connection, the debug CLI's stdin
+// and so on) register it here along with a callback, and the callback is then
+// invoked whenever the file descriptor becomes readable.
+// On Linux this uses epoll, so the set of file descriptors is only given to the
+// kernel when it changes, rather than on every wakeup. Elsewhere it falls back
+// to poll().
+// For each source we keep a count of how many times it woke us up, and how
+// much time was spent in its callback, which can be seen with the debug CLI's
+// 'loop' command.
+class EventLoop {
+ public:
+  EventLoop();
+  ~EventLoop();
+
+  // Registers fd as a source of events, such that callback will be called each
+  // time fd is readable. The name is only used when reporting statistics.
+  // Callbacks must consume whatever made the fd readable, otherwise they'll
+  // just be called again immediately.
+  void AddSource(const std::string& name,
+                 int fd,
+                 std::function<void()> callback);
+
+  // Stops watching fd. It is safe to call this from within a callback, even
+  // the callback of fd itself.
+  void RemoveSource(int fd);
+
+  // Waits until at least one source is readable, and calls the callbacks for
+  // all those that are. Returns early (without calling anything) if the wait
+  // is interrupted by a signal.
+  void RunOnce();
+
+  struct SourceStats {
+    std::string name;
+    int fd;
+    uint64_t wakes;
+    uint64_t callback_micros;
+  };
+
+  // Returns the statistics for all currently-registered sources, in order of
+  // file descriptor.
+  std::vector<SourceStats> Stats() const;
+
+  // Returns the number of times RunOnce has returned from waiting.
+  uint64_t Wakeups() const { return wakeups_; }
+
+  // This is used as a static pointer to the global EventLoop instance,
+  // initialised on start-up in lwm.cc.
+  static EventLoop* I;
+
+ private:
+  struct Source {
+    std::string name;
+    std::function<void()> callback;
+    uint64_t wakes = 0;
+    uint64_t callback_nanos = 0;
+    // Set by RemoveSource; the entry is erased once RunOnce has finished
+    // calling callbacks, as it may be the one that's running.
+    bool removed = false;
+  };
+
+  // Calls the callback for fd, if it's still registered, and accounts for the
+  // time spent doing so.
+  void dispatch(int fd);
+
+  // Erases the sources which were removed during the last RunOnce.
+  void reap();
+
+  int epoll_fd_ = -1;
+  uint64_t wakeups_ = 0;
+  std::map<int, Source> sources_;
+
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+};
+
+// Returns the CLOCK_MONOTONIC time, in nanoseconds. This is the clock used for
+// all the event loop's accounting.
+uint64_t MonotonicNanos();
+
+#endif  // LWM_EVENTLOOP_H_included
@@ -18,7 +18,9 @@
  */
 
 #include "ewmh.h"
+#include "icondecoder.h"
 #include "lwm.h"
+#include "xasync.h"
 #include "xlib.h"
 
 // The following two arrays are co-indexed. The ewmh_atom_names is used to look
@@ -112,20 +114,18 @@ void ewmh_init() {
   utf8_string = XInternAtom(dpy, "UTF8_STRING", false);
 }
 
-EWMHWindowType ewmh_get_window_type(Window w) {
-  Atom rt = 0;
-  Atom* type = nullptr;
-  int fmt = 0;
-  unsigned long n = 0;
-  unsigned long extra = 0;
-  int i = XGetWindowProperty(dpy, w, ewmh_atom[_NET_WM_WINDOW_TYPE], 0, 100,
-                             false, XA_ATOM, &rt, &fmt, &n, &extra,
-                             (unsigned char**)&type);
-  if (i != Success || type == NULL) {
+xlib::async::Reply<xlib::async::Property> ewmh_request_window_type(Window w) {
+  return xlib::async::GetProperty(w, ewmh_atom[_NET_WM_WINDOW_TYPE], XA_ATOM,
+                                  0, 100);
+}
+
+EWMHWindowType ewmh_parse_window_type(const xlib::async::Property& prop) {
+  if (!prop.Exists()) {
     return WTypeNone;
   }
+  const Atom* type = prop.As<Atom>();
   EWMHWindowType ret = WTypeNone;
-  for (; n; n--) {
+  for (unsigned long n = prop.nitems; n; n--) {
     if (type[n - 1] == ewmh_atom[_NET_WM_WINDOW_TYPE_DESKTOP]) {
       ret = WTypeDesktop;
       break;
@@ -159,71 +159,183 @@ EWMHWindowType ewmh_get_window_type(Window w) {
       break;
     }
   }
-  XFree(type);
   return ret;
 }
 
-bool ewmh_get_window_name(Client* c) {
-  Atom rt;
-  char* name = nullptr;
-  int fmt = 0;
-  unsigned long n = 0;
-  unsigned long extra = 0;
-  int i = XGetWindowProperty(dpy, c->window, ewmh_atom[_NET_WM_NAME], 0, 100,
-                             false, LScr::I->GetUTF8StringAtom(), &rt, &fmt, &n,
-                             &extra, (unsigned char**)&name);
-  if (i != Success || name == nullptr) {
+EWMHWindowType ewmh_get_window_type(Window w) {
+  return ewmh_parse_window_type(ewmh_request_window_type(w).Get());
+}
+
+WindowNameReplies ewmh_request_window_name(Window w) {
+  // We ask for both names at once, even though we only need WM_NAME if
+  // there's no _NET_WM_NAME, as that's no slower than asking for one.
+  return WindowNameReplies{
+      xlib::async::GetProperty(w, ewmh_atom[_NET_WM_NAME],
+                               LScr::I->GetUTF8StringAtom(), 0, 100),
+      xlib::async::GetProperty(w, XA_WM_NAME, AnyPropertyType, 0, 100)};
+}
+
+bool ewmh_parse_window_name(Client* c, WindowNameReplies* replies) {
+  const xlib::async::Property* name = &replies->net_wm_name.Get();
+  if (!name->Exists()) {
     // While modern X11 displays always work with UTF8, some VNC servers don't.
     // As I'm using 'tightvnc' for testing LWM in a window, it's actually quite
     // useful to be able to fall back to bad old non-UTF8 strings.
-    i = XGetWindowProperty(dpy, c->window, XA_WM_NAME, 0, 100, false,
-                           AnyPropertyType, &rt, &fmt, &n, &extra,
-                           (unsigned char**)&name);
+    name = &replies->wm_name.Get();
   }
-  if (i != Success || name == nullptr) {
+  if (!name->Exists()) {
     return false;
   }
-  c->SetName(std::string(name, n));
-  XFree(name);
+  c->SetName(std::string(name->As<char>(), name->nitems));
   return true;
 }
 
-bool ewmh_get_visible_window_name(Client* c) {
-  Atom rt;
-  char* name = nullptr;
-  int fmt = 0;
-  unsigned long n = 0;
-  unsigned long extra = 0;
-  int i = XGetWindowProperty(dpy, c->window, ewmh_atom[_NET_WM_VISIBLE_NAME], 0,
-                             100, false, LScr::I->GetUTF8StringAtom(), &rt,
-                             &fmt, &n, &extra, (unsigned char**)&name);
-  if (i != Success || name == nullptr) {
+bool ewmh_get_window_name(Client* c) {
+  WindowNameReplies replies = ewmh_request_window_name(c->window);
+  return ewmh_parse_window_name(c, &replies);
+}
+
+xlib::async::Reply<xlib::async::Property> ewmh_request_visible_window_name(
+    Window w) {
+  return xlib::async::GetProperty(w, ewmh_atom[_NET_WM_VISIBLE_NAME],
+                                  LScr::I->GetUTF8StringAtom(), 0, 100);
+}
+
+bool ewmh_parse_visible_window_name(Client* c,
+                                    const xlib::async::Property& prop) {
+  if (!prop.Exists()) {
     return false;
   }
-  c->SetVisibleName(std::string(name, n));
-  XFree(name);
+  c->SetVisibleName(std::string(prop.As<char>(), prop.nitems));
   return true;
 }
 
-xlib::ImageIcon* ewmh_get_window_icon(Client* c) {
-  Atom rt;
-  unsigned long* data = NULL;
-  int fmt = 0;
-  unsigned long n = 0;
-  unsigned long extra = 0;
-  // Max allowed size for a window icon is 1MiB.
-  int i = XGetWindowProperty(dpy, c->window, ewmh_atom[_NET_WM_ICON], 0,
-                             1 << 20, false, XA_CARDINAL, &rt, &fmt, &n, &extra,
-                             (unsigned char**)&data);
-  if (i != Success || data == nullptr) {
-    return nullptr;
-  }
-  xlib::XFreer data_freer(data);
-  if (extra > 0) {
-    fprintf(stderr, "Icon size too large: %d bytes extra\n", int(extra));
-    return nullptr;
-  }
-  return xlib::ImageIcon::CreateFromPixels(data, n);
+bool ewmh_get_visible_window_name(Client* c) {
+  return ewmh_parse_visible_window_name(
+      c, ewmh_request_visible_window_name(c->window).Get());
+}
+
+// _NET_WM_ICON can be large (Chrome's is over 100KB), and hold several sizes
+// of icon, so at first we only ask for the start of it, in 32-bit units. That
+// holds the usual 16x16, 32x32 and 48x48 set whole, so most windows need no
+// more round trips. See ewmh_parse_window_icon for the rest.
+static constexpr long kIconPrefetch = 4096;
+
+xlib::async::Reply<xlib::async::Property> ewmh_request_window_icon(Window w) {
+  return xlib::async::GetProperty(w, ewmh_atom[_NET_WM_ICON], XA_CARDINAL, 0,
+                                  kIconPrefetch);
+}
+
+int ewmh_best_icon(const std::vector<EWMHIconSize>& icons, int target) {
+  int best = -1;
+  for (int i = 0; i < icons.size(); i++) {
+    const EWMHIconSize& icon = icons[i];
+    const bool big_enough = icon.width >= target && icon.height >= target;
+    if (best < 0) {
+      best = i;
+      continue;
+    }
+    const EWMHIconSize& b = icons[best];
+    const bool best_big_enough = b.width >= target && b.height >= target;
+    const long area = long(icon.width) * icon.height;
+    const long best_area = long(b.width) * b.height;
+    if (big_enough ? (!best_big_enough || area < best_area)
+                   : (!best_big_enough && area > best_area)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+// findIcons walks a _NET_WM_ICON property, given the reply to
+// ewmh_request_window_icon, reading only the width and height of each icon.
+// Headers in the part we already have are read from there; any beyond it are
+// fetched one at a time.
+static std::vector<EWMHIconSize> findIcons(Window w,
+                                           const xlib::async::Property& first) {
+  // We don't accept icons of more than a million or so pixels.
+  constexpr unsigned long kMaxIconSize = 1 << 20;
+  std::vector<EWMHIconSize> icons;
+  if (!first.Exists() || first.format != 32) {
+    return icons;
+  }
+  // The length of the whole property, in 32-bit units.
+  const unsigned long total = first.nitems + first.bytes_after / 4;
+  unsigned long offset = 0;
+  while (total - offset >= 2) {
+    unsigned long width, height;
+    if (offset + 2 <= first.nitems) {
+      width = first.As<unsigned long>()[offset];
+      height = first.As<unsigned long>()[offset + 1];
+    } else {
+      const xlib::async::Property header =
+          xlib::async::GetProperty(w, ewmh_atom[_NET_WM_ICON], XA_CARDINAL,
+                                   offset, 2)
+              .Get();
+      if (!header.Exists() || header.format != 32 || header.nitems != 2) {
+        break;
+      }
+      width = header.As<unsigned long>()[0];
+      height = header.As<unsigned long>()[1];
+    }
+    if (width == 0 || height == 0 || width > kMaxIconSize ||
+        height > kMaxIconSize / width) {
+      fprintf(stderr, "Invalid icon size %lux%lu\n", width, height);
+      break;
+    }
+    const unsigned long size = 2 + width * height;
+    if (size > total - offset) {
+      break;  // Truncated.
+    }
+    icons.push_back({long(offset), int(width), int(height)});
+    offset += size;
+  }
+  return icons;
+}
+
+void ewmh_parse_window_icon(Client* c, const xlib::async::Property& prop) {
+  const std::vector<EWMHIconSize> icons = findIcons(c->window, prop);
+  if (icons.empty()) {
+    return;
+  }
+  // Only use the pixels of the icon that's closest to the size we want,
+  // fetching them if they're beyond what we have already.
+  const EWMHIconSize& best =
+      icons[ewmh_best_icon(icons, xlib::targetImageIconSize())];
+  const unsigned long size = 2 + best.width * best.height;
+  xlib::async::Property fetched;
+  const unsigned long* data;
+  if (best.offset + size <= prop.nitems) {
+    data = prop.As<unsigned long>() + best.offset;
+  } else {
+    fetched = xlib::async::GetProperty(c->window, ewmh_atom[_NET_WM_ICON],
+                                       XA_CARDINAL, best.offset, size)
+                  .Get();
+    if (!fetched.Exists() || fetched.format != 32 || fetched.nitems != size) {
+      return;  // The property changed under us.
+    }
+    data = fetched.As<unsigned long>();
+  }
+  if (data[0] != best.width || data[1] != best.height) {
+    return;  // The property changed under us.
+  }
+  if (!IconDecoder::I) {
+    c->SetIcon(xlib::ImageIcon::CreateFromPixels(data, size));
+    return;
+  }
+  // Unless we've seen this icon before, it's made on another thread, and the
+  // title bar is redrawn when it's ready.
+  const Window w = c->window;
+  c->SetIcon(IconDecoder::I->Decode(
+      w, data, size, [w](xlib::ImageIcon* icon) {
+        Client* c = LScr::I->GetClient(w, false);
+        if (!c) {
+          delete icon;
+          return;
+        }
+        c->SetIcon(icon);
+        Deferred::I->Redraw(c);
+      }));
 }
 
 bool ewmh_hasframe(Client* c) {
@@ -238,27 +350,22 @@ bool ewmh_hasframe(Client* c) {
   }
 }
 
-void ewmh_get_state(Client* c) {
-  if (c == NULL) {
-    return;
-  }
-  Atom rt = 0;
-  Atom* state = nullptr;
-  int fmt = 0;
-  unsigned long n = 0;
-  unsigned long extra = 0;
-  int i = XGetWindowProperty(dpy, c->window, ewmh_atom[_NET_WM_STATE], 0, 100,
-                             false, XA_ATOM, &rt, &fmt, &n, &extra,
-                             (unsigned char**)&state);
-  if (i != Success || state == NULL) {
+xlib::async::Reply<xlib::async::Property> ewmh_request_state(Window w) {
+  return xlib::async::GetProperty(w, ewmh_atom[_NET_WM_STATE], XA_ATOM, 0,
+                                  100);
+}
+
+void ewmh_parse_state(Client* c, const xlib::async::Property& prop) {
+  if (!prop.Exists()) {
     return;
   }
+  const Atom* state = prop.As<Atom>();
   c->wstate.skip_taskbar = false;
   c->wstate.skip_pager = false;
   c->wstate.fullscreen = false;
   c->wstate.above = false;
   c->wstate.below = false;
-  for (; n; n--) {
+  for (unsigned long n = prop.nitems; n; n--) {
     if (state[n - 1] == ewmh_atom[_NET_WM_STATE_SKIP_TASKBAR]) {
       c->wstate.skip_taskbar = true;
     }
@@ -275,7 +382,13 @@ void ewmh_get_state(Client* c) {
       c->wstate.below = true;
     }
   }
-  XFree(state);
+}
+
+void ewmh_get_state(Client* c) {
+  if (c == NULL) {
+    return;
+  }
+  ewmh_parse_state(c, ewmh_request_state(c->window).Get());
 }
 
 bool new_state(unsigned long action, bool current) {
@@ -323,10 +436,10 @@ void ewmh_change_state(Client* c, unsigned long action, unsigned long atom) {
   if (*a == ewmh_atom[_NET_WM_STATE_BELOW]) {
     c->wstate.below = new_state(action, c->wstate.below);
   }
-  ewmh_set_state(c);
+  Deferred::I->WriteState(c);
 
   // may have to shuffle windows in the stack after a change of state
-  ewmh_set_client_list();
+  Deferred::I->Mark(Deferred::STACKING);
 }
 
 void ewmh_set_state(Client* c) {
@@ -439,81 +552,36 @@ void ewmh_set_strut() {
 // reserved areas. the EWMH spec isn't clear about what we should do
 // about hidden windows. It seems silly to reserve space for an invisible
 // window, but the spec allows it. Ho Hum...		jfc
-void ewmh_get_strut(Client* c) {
-  if (c == nullptr) {
-    return;
-  }
-  Atom rt = 0;
-  unsigned long* strut = nullptr;
-  int fmt = 0;
-  unsigned long n = 0;
-  unsigned long extra = 0;
-  int i = XGetWindowProperty(dpy, c->window, ewmh_atom[_NET_WM_STRUT], 0, 5,
-                             false, XA_CARDINAL, &rt, &fmt, &n, &extra,
-                             (unsigned char**)&strut);
-  if (i != Success || strut == nullptr || n < 4) {
-    if (strut) {
-      XFree(strut);
-    }
+xlib::async::Reply<xlib::async::Property> ewmh_request_strut(Window w) {
+  return xlib::async::GetProperty(w, ewmh_atom[_NET_WM_STRUT], XA_CARDINAL, 0,
+                                  5);
+}
+
+void ewmh_parse_strut(Client* c, const xlib::async::Property& prop) {
+  if (!prop.Exists() || prop.nitems < 4) {
     return;
   }
+  const unsigned long* strut = prop.As<unsigned long>();
   c->strut.left = (unsigned int)strut[0];
   c->strut.right = (unsigned int)strut[1];
   c->strut.top = (unsigned int)strut[2];
   c->strut.bottom = (unsigned int)strut[3];
-  XFree(strut);
-  ewmh_set_strut();
+  Deferred::I->Mark(Deferred::WORKAREA);
+}
+
+void ewmh_get_strut(Client* c) {
+  if (c == nullptr) {
+    return;
+  }
+  ewmh_parse_strut(c, ewmh_request_strut(c->window).Get());
 }
 
 // fix stack forces each window on the screen to be in the right place in
 // the window stack as indicated in the EWMH spec version 1.2 (section 7.10).
+// The layers themselves are worked out by Stacking::LayerOf. Only the windows
+// which are out of place are moved, so the desktop no longer flickers.
 void fix_stack() {
-  // this is pretty dumb. we should query the tree and only move
-  // those windows that require it. doing it regardless like this
-  // causes the desktop to flicker
-
-  // first lower clients with _NET_WM_STATE_BELOW
-  for (auto it : LScr::I->Clients()) {
-    Client* c = it.second;
-    if (!c->wstate.below) {
-      continue;
-    }
-    c->Lower();
-  }
-
-  // lower desktops - they are always the lowest
-  for (auto it : LScr::I->Clients()) {
-    Client* c = it.second;
-    if (c->wtype != WTypeDesktop) {
-      continue;
-    }
-    c->Lower();
-    break;  // only one desktop, surely
-  }
-
-  // raise clients with _NET_WM_STATE_ABOVE and docks
-  // (unless marked with _NET_WM_STATE_BELOW)
-  for (auto it : LScr::I->Clients()) {
-    Client* c = it.second;
-    if (!(c->wstate.above || (c->wtype == WTypeDock && !c->wstate.below))) {
-      continue;
-    }
-    c->Raise();
-  }
-
-  // raise fullscreens - they're always on top
-  // Misam Saki reports problems with this and believes fullscreens
-  // should not be automatically raised.
-  //
-  // However if the code below is removed then the panel is raised above
-  // fullscreens, which is not desirable.
-  for (auto it : LScr::I->Clients()) {
-    Client* c = it.second;
-    if (!c->wstate.fullscreen) {
-      continue;
-    }
-    c->Raise();
-  }
+  LScr::I->GetStacking()->Apply();
 }
 
 bool valid_for_client_list(Client* c) {
@@ -523,15 +591,11 @@ bool valid_for_client_list(Client* c) {
 // update_client_list updates the properties on the root window used by
 // task lists and pagers.
 //
-// it should be called whenever the window stack is modified, or when clients
-// are hidden or unhidden.
+// it needs redoing whenever the window stack is modified, or when clients
+// are hidden or unhidden. rather than calling it directly, event handlers
+// should mark Deferred::CLIENT_LIST (or Deferred::STACKING if the EWMH layers
+// may need enforcing too), so it's only done once per batch of events.
 void ewmh_set_client_list() {
-  static bool recursion_stop;
-  if (recursion_stop) {
-    return;
-  }
-  recursion_stop = true;
-  fix_stack();
   int no_clients = 0;
   for (auto it : LScr::I->Clients()) {
     Client* c = it.second;
@@ -557,10 +621,9 @@ void ewmh_set_client_list() {
 
     stacked_client_list = (Window*)malloc(sizeof(Window) * no_clients);
 
-    xlib::WindowTree wt = xlib::WindowTree::Query(dpy, LScr::I->Root());
     int ci = 0;
-    for (Window win : wt.children) {
-      Client* c = LScr::I->GetClient(win);
+    for (Window win : LScr::I->GetStacking()->Order()) {
+      Client* c = LScr::I->GetClient(win, false);
       if (!c) {
         continue;
       }
@@ -580,5 +643,4 @@ void ewmh_set_client_list() {
                   (unsigned char*)stacked_client_list, no_clients);
   free(client_list);
   free(stacked_client_list);
-  recursion_stop = false;
 }
@@ -0,0 +1,215 @@
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <iomanip>
+#include <set>
+#include <sstream>
+
+#include "handoff.h"
+#include "log.h"
+#include "lwm.h"
+#include "xlib.h"
+
+Handoff* Handoff::I;
+
+namespace {
+
+// The state starts with this, and the version. Change the version if the
+// format changes.
+constexpr char kHeader[] = "lwm-handoff";
+constexpr int kVersion = 1;
+
+void writeRect(std::ostream& out, const Rect& r) {
+  out << ' ' << r.xMin << ' ' << r.yMin << ' ' << r.xMax << ' ' << r.yMax;
+}
+
+std::istream& readRect(std::istream& in, Rect* r) {
+  return in >> r->xMin >> r->yMin >> r->xMax >> r->yMax;
+}
+
+// Lists are written with their lengths first, as names may contain newlines.
+void writeWindows(std::ostream& out,
+                  const char* kind,
+                  const std::vector<Window>& windows) {
+  out << kind << ' ' << windows.size();
+  for (const Window w : windows) {
+    out << ' ' << w;
+  }
+  out << '\n';
+}
+
+}  // namespace
+
+// static
+Handoff* Handoff::Capture() {
+  Handoff* h = new Handoff;
+  for (const auto& it : LScr::I->Clients()) {
+    h->clients.push_back(it.second->SaveState());
+  }
+  for (const Client* c : LScr::I->GetFocuser()->History()) {
+    h->focus_history.push_back(c->window);
+  }
+  for (const Window frame : LScr::I->GetHider()->Hidden()) {
+    if (const Client* c = LScr::I->GetClient(frame, false)) {
+      h->hidden.push_back(c->window);
+    }
+  }
+  return h;
+}
+
+int Handoff::Give() const {
+  const std::string text = Serialize();
+  // Not close-on-exec, as the new process is to inherit it.
+  const int fd = memfd_create("lwm-handoff", 0);
+  if (fd < 0) {
+    LOGE() << "Failed to create handoff memfd: " << Log::Errno(errno);
+    return -1;
+  }
+  if (write(fd, text.data(), text.size()) != ssize_t(text.size())) {
+    LOGE() << "Failed to write handoff: " << Log::Errno(errno);
+    close(fd);
+    return -1;
+  }
+  // Once we've disconnected, nothing will free whatever we leave behind until
+  // the server resets, and the new process only takes over the frames.
+  std::set<Window> frames;
+  for (const auto& it : LScr::I->Clients()) {
+    Client* c = it.second;
+    c->HandOver();
+    if (c->framed) {
+      frames.insert(c->parent);
+    }
+  }
+  xlib::ImageIcon::FreeUnused();
+  forgetAllDrawables();
+  LScr::I->HandOver();
+  // Xft frees the font's glyph sets when the display is closed, but only if
+  // nothing is using the font.
+  XftFontClose(dpy, g_font);
+  g_font = nullptr;
+  xlib::DestroyNamedWindows(frames);
+  XSetCloseDownMode(dpy, RetainPermanent);
+  ScopedIgnoreBadMatch ignorer;
+  XCloseDisplay(dpy);
+  LOGI() << "Handing over " << clients.size() << " windows";
+  return fd;
+}
+
+void Handoff::Abandon() const {
+  Display* d = XOpenDisplay(nullptr);
+  if (!d) {
+    LOGE() << "Can't reopen display to release windows";
+    return;
+  }
+  const Window root = DefaultRootWindow(d);
+  for (const HandoffClient& c : clients) {
+    if (!c.frame) {
+      continue;
+    }
+    // As Client::Release does.
+    XReparentWindow(d, c.window, root, c.content.xMin, c.content.yMin);
+    if (c.hidden) {
+      XMapWindow(d, c.window);
+      XLowerWindow(d, c.window);
+    }
+    XSetWindowBorderWidth(d, c.window, c.original_border_width);
+    XDestroyWindow(d, c.frame);
+  }
+  XCloseDisplay(d);
+}
+
+// static
+Handoff* Handoff::Take(int fd) {
+  std::string text;
+  char buf[4096];
+  off_t offset = 0;
+  ssize_t n;
+  while ((n = pread(fd, buf, sizeof(buf), offset)) > 0) {
+    text.append(buf, n);
+    offset += n;
+  }
+  if (n < 0) {
+    LOGE() << "Failed to read handoff: " << Log::Errno(errno);
+  }
+  close(fd);
+  Handoff* h = new Handoff;
+  if (n < 0 || !Parse(text, h)) {
+    LOGE() << "Ignoring unreadable handoff from previous LWM";
+    delete h;
+    return nullptr;
+  }
+  LOGI() << "Taking over " << h->clients.size() << " windows";
+  return h;
+}
+
+const HandoffClient* Handoff::Find(Window w) const {
+  for (const HandoffClient& c : clients) {
+    if (c.frame ? c.frame == w : c.window == w) {
+      return &c;
+    }
+  }
+  return nullptr;
+}
+
+std::string Handoff::Serialize() const {
+  std::ostringstream out;
+  out << kHeader << ' ' << kVersion << '\n';
+  for (const HandoffClient& c : clients) {
+    out << "client " << c.window << ' ' << c.frame << ' ' << c.hidden << ' '
+        << c.fullscreen;
+    writeRect(out, c.content);
+    writeRect(out, c.pre_full_screen);
+    out << ' ' << c.original_border_width << ' '
+        << std::quoted(c.visible_name) << '\n';
+  }
+  writeWindows(out, "focus", focus_history);
+  writeWindows(out, "hidden", hidden);
+  // So we can tell if it's been cut short.
+  out << "end\n";
+  return out.str();
+}
+
+// static
+bool Handoff::Parse(const std::string& text, Handoff* out) {
+  std::istringstream in(text);
+  std::string header;
+  int version = 0;
+  if (!(in >> header >> version) || header != kHeader ||
+      version != kVersion) {
+    return false;
+  }
+  std::string kind;
+  while (in >> kind) {
+    if (kind == "end") {
+      return (in >> std::ws).eof();
+    } else if (kind == "client") {
+      HandoffClient c;
+      in >> c.window >> c.frame >> c.hidden >> c.fullscreen;
+      readRect(in, &c.content);
+      readRect(in, &c.pre_full_screen);
+      in >> c.original_border_width >> std::quoted(c.visible_name);
+      if (!in) {
+        return false;
+      }
+      out->clients.push_back(c);
+    } else if (kind == "focus" || kind == "hidden") {
+      std::vector<Window>& windows =
+          kind == "focus" ? out->focus_history : out->hidden;
+      size_t len = 0;
+      if (!(in >> len)) {
+        return false;
+      }
+      for (size_t i = 0; i < len; i++) {
+        Window w = 0;
+        if (!(in >> w)) {
+          return false;
+        }
+        windows.push_back(w);
+      }
+    } else {
+      return false;
+    }
+  }
+  return false;
+}
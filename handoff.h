@@ -0,0 +1,76 @@
+#ifndef LWM_HANDOFF_H_included
+#define LWM_HANDOFF_H_included
+
+#include <X11/Xlib.h>
+
+#include <string>
+#include <vector>
+
+#include "geometry.h"
+
+// What a restarting LWM tells its successor about one client.
+struct HandoffClient {
+  Window window = 0;
+  // The frame, which the new LWM takes over as it is; or 0 if unframed.
+  Window frame = 0;
+  bool hidden = false;
+  bool fullscreen = false;
+  Rect content = {};
+  Rect pre_full_screen = {};
+  int original_border_width = 0;
+  std::string visible_name;
+};
+
+// Handoff carries LWM's state across a restart (on SIGHUP). Rather than
+// reparenting every window back to the root, and having the new process
+// frame them all again, the old process leaves its frames in place (by
+// setting its close-down mode to RetainPermanent), and passes a description
+// of them to the new process in a memfd, named on its command line by
+// -handoff=<fd>. The new process adopts the frames, so nothing moves or
+// flickers, and also gets back state the X server doesn't keep for us, such
+// as the focus history, and the order windows were hidden in.
+// Anything that's kept in window properties (names, struts, EWMH state) is
+// read again from those, as for any other window.
+class Handoff {
+ public:
+  std::vector<HandoffClient> clients;
+  // Client windows, most recently focused first.
+  std::vector<Window> focus_history;
+  // Client windows, most recently hidden first.
+  std::vector<Window> hidden;
+
+  // Records the state of LScr::I.
+  static Handoff* Capture();
+
+  // Writes the state to a memfd, then gets ready for exec: the server
+  // resources the new process won't know about are freed, and the display is
+  // closed, leaving the frames behind. Returns the memfd, which is to be
+  // inherited by the new process. On failure, returns -1 having done nothing
+  // to the display, so the caller can shut down the usual way.
+  int Give() const;
+
+  // Undoes Give, if the new process couldn't be started: the client windows
+  // are taken out of their frames, and the frames destroyed, on a new
+  // connection to the server.
+  void Abandon() const;
+
+  // Reads the state from the memfd given on the command line, and closes it.
+  // Returns null (having logged why) if it can't be read.
+  static Handoff* Take(int fd);
+
+  // Returns the record for a top-level window: either a frame, or an unframed
+  // client window. Returns null if there's none.
+  const HandoffClient* Find(Window w) const;
+
+  std::string Serialize() const;
+  // Returns false, leaving out in an unknown state, if text isn't something
+  // Serialize made.
+  static bool Parse(const std::string& text, Handoff* out);
+
+  // This is used as a static pointer to the state handed to us by the
+  // previous LWM, which is set in lwm.cc and only kept until start-up is
+  // finished. It's usually null.
+  static Handoff* I;
+};
+
+#endif  // LWM_HANDOFF_H_included
@@ -0,0 +1,61 @@
+#include <string.h>
+
+#include "histogram.h"
+
+// static
+int LatencyHistogram::BucketFor(uint64_t nanos) {
+  if (nanos < kSubBuckets) {
+    return int(nanos);
+  }
+  // The position of the top set bit picks the power of two, and the next
+  // kSubBucketBits bits below it pick the linear bucket within it.
+  const int msb = 63 - __builtin_clzll(nanos);
+  const int shift = msb - kSubBucketBits;
+  const int sub = int(nanos >> shift) & (kSubBuckets - 1);
+  return kSubBuckets * (shift + 1) + sub;
+}
+
+// static
+uint64_t LatencyHistogram::BucketUpperBound(int bucket) {
+  if (bucket < kSubBuckets) {
+    return uint64_t(bucket);
+  }
+  const int shift = bucket / kSubBuckets - 1;
+  const uint64_t sub = uint64_t(bucket % kSubBuckets);
+  const uint64_t lower = (kSubBuckets + sub) << shift;
+  return lower + ((uint64_t(1) << shift) - 1);
+}
+
+void LatencyHistogram::Record(uint64_t nanos) {
+  buckets_[BucketFor(nanos)]++;
+  count_++;
+  if (nanos > max_) {
+    max_ = nanos;
+  }
+}
+
+void LatencyHistogram::Reset() {
+  memset(buckets_, 0, sizeof(buckets_));
+  count_ = 0;
+  max_ = 0;
+}
+
+uint64_t LatencyHistogram::Percentile(double p) const {
+  if (!count_) {
+    return 0;
+  }
+  // The rank of the sample we're looking for, counting from 1.
+  uint64_t rank = uint64_t(p / 100 * count_ + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < kNumBuckets; i++) {
+    seen += buckets_[i];
+    if (seen >= rank) {
+      const uint64_t upper = BucketUpperBound(i);
+      return upper < max_ ? upper : max_;
+    }
+  }
+  return max_;
+}
@@ -0,0 +1,44 @@
+#ifndef LWM_HISTOGRAM_H_included
+#define LWM_HISTOGRAM_H_included
+
+#include <stdint.h>
+
+// LatencyHistogram counts durations (in nanoseconds) into logarithmic buckets,
+// so that percentiles can be estimated without keeping every sample. Each
+// power of two is split into kSubBuckets linear buckets, so an estimate is
+// never more than 1/kSubBuckets (12.5%) bigger than the true value. Values
+// smaller than kSubBuckets are counted exactly.
+// Recording a sample is a handful of arithmetic operations and one increment,
+// which makes it cheap enough to do for every X event we handle.
+class LatencyHistogram {
+ public:
+  void Record(uint64_t nanos);
+
+  // Forgets all recorded samples.
+  void Reset();
+
+  uint64_t Count() const { return count_; }
+  uint64_t Max() const { return max_; }
+
+  // Returns an estimate of the given percentile (0 < p <= 100) of the recorded
+  // samples: the upper bound of the bucket containing it, but never more than
+  // the maximum seen. Returns 0 if nothing has been recorded.
+  uint64_t Percentile(double p) const;
+
+  // Exposed for testing.
+  static int BucketFor(uint64_t nanos);
+  static uint64_t BucketUpperBound(int bucket);
+
+ private:
+  static constexpr int kSubBucketBits = 3;
+  static constexpr int kSubBuckets = 1 << kSubBucketBits;
+  // Values below kSubBuckets get a bucket each; every power of two above that
+  // up to 2^63 gets kSubBuckets of them.
+  static constexpr int kNumBuckets = kSubBuckets * (65 - kSubBucketBits);
+
+  uint64_t buckets_[kNumBuckets] = {};
+  uint64_t count_ = 0;
+  uint64_t max_ = 0;
+};
+
+#endif  // LWM_HISTOGRAM_H_included
@@ -0,0 +1,202 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "iconcache.h"
+#include "log.h"
+
+IconDiskCache* IconDiskCache::I;
+
+namespace {
+
+// The file starts with this, so we know it's ours, and in the format we
+// expect. Change the version if the format changes.
+constexpr char kMagic[8] = {'L', 'W', 'M', 'I', 'C', 'O', 'N', '2'};
+
+// The size on disk of num_pixels pixels, which are padded to keep the next
+// record 8-byte aligned.
+size_t paddedPixelBytes(size_t num_pixels) {
+  return (num_pixels * 4 + 7) & ~size_t(7);
+}
+
+}  // namespace
+
+// Each record is followed by its pixels, and padding to a multiple of 8
+// bytes. As the file is mapped and read in place, that keeps every record
+// 8-byte aligned, as its key needs.
+struct IconDiskCache::Record {
+  uint64_t key;
+  uint32_t width;
+  uint32_t height;
+  uint32_t num_pixels;
+  // A check on the other fields, in case a write was cut short.
+  uint32_t check;
+
+  uint32_t Check() const {
+    return uint32_t(key) ^ uint32_t(key >> 32) ^ width ^ (height << 12) ^
+           num_pixels ^ 0x4c574d31;
+  }
+};
+
+// static
+IconDiskCache* IconDiskCache::Open(const std::string& path, size_t max_bytes) {
+  // We only ever append, so O_APPEND keeps records whole even if two LWMs
+  // (for different displays) share the file.
+  int fd = open(path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+  if (fd >= 0) {
+    IconDiskCache* cache = new IconDiskCache(fd, max_bytes);
+    if (cache->load()) {
+      return cache;
+    }
+    delete cache;
+  }
+  // Missing, full, or not ours, so start again. Rather than truncate the old
+  // file, which another LWM may have mapped, we make a new one and rename it
+  // into place. The new file's name is unique, in case another LWM is doing
+  // the same.
+  LOGI() << "Starting new icon cache " << path;
+  std::string tmp = path + ".XXXXXX";
+  fd = mkostemp(&tmp[0], O_APPEND | O_CLOEXEC);
+  if (fd < 0 || write(fd, kMagic, sizeof(kMagic)) != sizeof(kMagic) ||
+      rename(tmp.c_str(), path.c_str())) {
+    LOGE() << "Failed to create icon cache " << path << ": "
+           << Log::Errno(errno);
+    if (fd >= 0) {
+      close(fd);
+      unlink(tmp.c_str());
+    }
+    return nullptr;
+  }
+  IconDiskCache* cache = new IconDiskCache(fd, max_bytes);
+  cache->file_size_ = sizeof(kMagic);
+  return cache;
+}
+
+// static
+std::string IconDiskCache::DefaultPath() {
+  std::string dir;
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  if (xdg && *xdg) {
+    dir = xdg;
+  } else if (home && *home) {
+    dir = std::string(home) + "/.cache";
+  } else {
+    return "";
+  }
+  mkdir(dir.c_str(), 0700);
+  dir += "/lwm";
+  if (mkdir(dir.c_str(), 0700) && errno != EEXIST) {
+    LOGE() << "Failed to create " << dir << ": " << Log::Errno(errno);
+    return "";
+  }
+  return dir + "/icons";
+}
+
+IconDiskCache::IconDiskCache(int fd, size_t max_bytes)
+    : fd_(fd), max_bytes_(max_bytes) {}
+
+IconDiskCache::~IconDiskCache() {
+  if (map_) {
+    munmap(const_cast<char*>(map_), map_size_);
+  }
+  close(fd_);
+}
+
+bool IconDiskCache::load() {
+  struct stat st = {};
+  if (fstat(fd_, &st)) {
+    LOGE() << "Failed to stat icon cache: " << Log::Errno(errno);
+    return false;
+  }
+  const size_t size = st.st_size;
+  if (size < sizeof(kMagic) || size >= max_bytes_) {
+    return false;
+  }
+  void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd_, 0);
+  if (map == MAP_FAILED) {
+    LOGE() << "Failed to map icon cache: " << Log::Errno(errno);
+    return false;
+  }
+  map_ = static_cast<const char*>(map);
+  map_size_ = size;
+  if (memcmp(map_, kMagic, sizeof(kMagic))) {
+    return false;
+  }
+  size_t offset = sizeof(kMagic);
+  while (size - offset >= sizeof(Record)) {
+    const Record* r = reinterpret_cast<const Record*>(map_ + offset);
+    const size_t bytes = sizeof(Record) + paddedPixelBytes(r->num_pixels);
+    if (r->check != r->Check() || bytes > size - offset) {
+      break;
+    }
+    index_[r->key] = r;
+    offset += bytes;
+  }
+  // If a write was cut short, anything we append would be unreadable, so
+  // it's time for a new file.
+  if (offset != size) {
+    return false;
+  }
+  file_size_ = size;
+  LOGI() << "Loaded " << index_.size() << " icons from cache";
+  return true;
+}
+
+const uint32_t* IconDiskCache::Find(uint64_t key,
+                                    int width,
+                                    int height,
+                                    size_t num_pixels) const {
+  const auto it = index_.find(key);
+  if (it == index_.end()) {
+    return nullptr;
+  }
+  const Record* r = it->second;
+  if (r->width != uint32_t(width) || r->height != uint32_t(height) ||
+      r->num_pixels != num_pixels) {
+    return nullptr;
+  }
+  return reinterpret_cast<const uint32_t*>(r + 1);
+}
+
+void IconDiskCache::Add(uint64_t key,
+                        int width,
+                        int height,
+                        const uint32_t* pixels,
+                        size_t num_pixels) {
+  if (index_.count(key) || added_.count(key)) {
+    return;
+  }
+  static_assert(sizeof(Record) % 8 == 0, "records must stay aligned");
+  const size_t bytes = sizeof(Record) + paddedPixelBytes(num_pixels);
+  if (file_size_ + bytes > max_bytes_) {
+    return;
+  }
+  Record r = {};
+  r.key = key;
+  r.width = width;
+  r.height = height;
+  r.num_pixels = num_pixels;
+  r.check = r.Check();
+  uint32_t padding = 0;
+  struct iovec parts[3] = {
+      {&r, sizeof(r)},
+      {const_cast<uint32_t*>(pixels), num_pixels * 4},
+      {&padding, paddedPixelBytes(num_pixels) - num_pixels * 4},
+  };
+  const ssize_t written = writev(fd_, parts, 3);
+  if (written != ssize_t(bytes)) {
+    LOGE() << "Failed to write to icon cache: " << Log::Errno(errno);
+    // Don't try again, lest we make things worse.
+    file_size_ = max_bytes_;
+    return;
+  }
+  file_size_ += bytes;
+  added_.insert(key);
+}
@@ -0,0 +1,78 @@
+#ifndef LWM_ICONCACHE_H_included
+#define LWM_ICONCACHE_H_included
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// IconDiskCache keeps the composited and scaled pixels of application icons
+// in a file, so that when LWM restarts (or the user logs in again) it can
+// give windows their icons without redoing the work.
+// The file is a header followed by records, each of which is appended as
+// icons are made. On start-up the whole file is mapped into memory, and
+// looked up from there. Nothing is ever removed; instead, once the file
+// reaches its maximum size we stop adding to it, and it's started afresh the
+// next time it's opened. Files which are damaged (eg by a crash part way
+// through a write) are started afresh too.
+// Keys are chosen by the caller, and must cover everything the pixels depend
+// on (the icon's contents, but also its size and background colours).
+class IconDiskCache {
+ public:
+  // Opens (or creates) the cache file at path. Returns null (having logged
+  // why) on failure.
+  static IconDiskCache* Open(const std::string& path, size_t max_bytes);
+
+  // The default location of the cache file: $XDG_CACHE_HOME/lwm/icons, or
+  // ~/.cache/lwm/icons. The directories are created if need be. Returns an
+  // empty string if there's nowhere suitable.
+  static std::string DefaultPath();
+
+  ~IconDiskCache();
+
+  // Returns the num_pixels pixels stored for key, if the file had them when
+  // it was opened. The pointer is valid for the lifetime of the cache.
+  const uint32_t* Find(uint64_t key,
+                       int width,
+                       int height,
+                       size_t num_pixels) const;
+
+  // Appends pixels to the file, unless they're there already, or the file is
+  // full.
+  void Add(uint64_t key,
+           int width,
+           int height,
+           const uint32_t* pixels,
+           size_t num_pixels);
+
+  // The number of icons found in the file when it was opened.
+  size_t Loaded() const { return index_.size(); }
+
+  // This is used as a static pointer to the global IconDiskCache instance,
+  // initialised on start-up in lwm.cc. It may be null.
+  static IconDiskCache* I;
+
+ private:
+  struct Record;
+
+  IconDiskCache(int fd, size_t max_bytes);
+
+  // Maps the file, and indexes the records in it. Returns false if the file
+  // isn't one of ours, is damaged, or is full.
+  bool load();
+
+  const int fd_;
+  const size_t max_bytes_;
+  const char* map_ = nullptr;
+  size_t map_size_ = 0;
+  size_t file_size_ = 0;
+  std::unordered_map<uint64_t, const Record*> index_;
+  // Keys appended since the file was opened, which aren't in index_.
+  std::unordered_set<uint64_t> added_;
+
+  IconDiskCache(const IconDiskCache&) = delete;
+  IconDiskCache& operator=(const IconDiskCache&) = delete;
+};
+
+#endif  // LWM_ICONCACHE_H_included
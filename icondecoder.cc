@@ -0,0 +1,105 @@
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <thread>
+
+#include "eventloop.h"
+#include "icondecoder.h"
+#include "log.h"
+
+IconDecoder* IconDecoder::I;
+
+IconDecoder::IconDecoder(int num_threads)
+    : event_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+  LOGF_IF(event_fd_ < 0) << "Failed to create eventfd: " << Log::Errno(errno);
+  EventLoop::I->AddSource("Icon decoder", event_fd_, [this] { collect(); });
+  for (int i = 0; i < num_threads; i++) {
+    std::thread(&IconDecoder::work, this).detach();
+  }
+}
+
+xlib::ImageIcon* IconDecoder::Decode(Window w,
+                                     const unsigned long* data,
+                                     unsigned long len,
+                                     Callback done) {
+  // Anything still in progress for w is now out of date.
+  latest_.erase(w);
+  auto job = std::make_unique<Job>(data, len);
+  if (!job->pixels.Valid()) {
+    return nullptr;
+  }
+  xlib::ImageIcon* icon = job->pixels.Cached();
+  if (icon) {
+    return icon;
+  }
+  const uint64_t id = next_id_++;
+  latest_[w] = id;
+  // Windows of the same application mostly have the same icon, and are
+  // often mapped together, such as at start-up. Only the first needs a job;
+  // the rest share its result.
+  std::vector<Waiter>& waiters = in_flight_[job->pixels.Key()];
+  const bool queued = !waiters.empty();
+  waiters.push_back(Waiter{id, w, std::move(done)});
+  if (queued) {
+    return nullptr;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    pending_.push_back(std::move(job));
+  }
+  work_ready_.notify_one();
+  return nullptr;
+}
+
+void IconDecoder::work() {
+  for (;;) {
+    std::unique_ptr<Job> job;
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      work_ready_.wait(lock, [this] { return !pending_.empty(); });
+      job = std::move(pending_.front());
+      pending_.pop_front();
+    }
+    job->pixels.Run();
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      finished_.push_back(std::move(job));
+    }
+    const uint64_t one = 1;
+    if (write(event_fd_, &one, sizeof(one)) != sizeof(one)) {
+      // Only fails if the counter would overflow, in which case the main
+      // thread has plenty to wake it up already.
+      LOGE() << "Failed to signal icon decoder: " << Log::Errno(errno);
+    }
+  }
+}
+
+void IconDecoder::collect() {
+  uint64_t count = 0;
+  if (read(event_fd_, &count, sizeof(count)) != sizeof(count)) {
+    return;
+  }
+  std::vector<std::unique_ptr<Job>> finished;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    finished.swap(finished_);
+  }
+  for (const auto& job : finished) {
+    const auto it = in_flight_.find(job->pixels.Key());
+    if (it == in_flight_.end()) {
+      continue;
+    }
+    const std::vector<Waiter> waiters = std::move(it->second);
+    in_flight_.erase(it);
+    for (const Waiter& waiter : waiters) {
+      const auto latest = latest_.find(waiter.window);
+      if (latest == latest_.end() || latest->second != waiter.id) {
+        continue;  // Cancelled, or superseded by a later request.
+      }
+      latest_.erase(latest);
+      // The first Finish makes the icon; the rest get copies from the cache.
+      waiter.done(job->pixels.Finish());
+    }
+  }
+}
@@ -0,0 +1,93 @@
+#ifndef LWM_ICONDECODER_H_included
+#define LWM_ICONDECODER_H_included
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "xlib.h"
+
+// IconDecoder turns _NET_WM_ICON data into ImageIcons on a small pool of
+// worker threads, so that manage() doesn't block the event loop while a
+// browser's 256x256 icon is composited and scaled. Windows are framed at
+// once, and get their icons a few milliseconds later.
+// The workers only do the pixel work, into client-side buffers. Each tells the
+// main thread it has finished through an eventfd, which is watched by the
+// EventLoop; the ImageIcon's pixmaps are then made, and the icon delivered,
+// on the main thread, as Xlib isn't ours to use from other threads.
+class IconDecoder {
+ public:
+  using Callback = std::function<void(xlib::ImageIcon*)>;
+
+  // Starts the worker threads, and registers with EventLoop::I. The threads
+  // live as long as LWM does, so there's no destructor.
+  explicit IconDecoder(int num_threads);
+
+  // Makes an icon for window w from data (as for
+  // xlib::ImageIcon::CreateFromPixels). If the icon is already in the cache,
+  // it's returned right away. Otherwise this returns null, and done is called
+  // with the icon later, on the main thread. It isn't called at all if the
+  // data isn't a valid icon, or if another icon is requested for the same
+  // window, or Cancel is called, before this one is finished.
+  xlib::ImageIcon* Decode(Window w,
+                          const unsigned long* data,
+                          unsigned long len,
+                          Callback done);
+
+  // Forgets about any outstanding icon for w, such as when the window's
+  // Client is destroyed.
+  void Cancel(Window w) { latest_.erase(w); }
+
+  // The number of icons still being worked on.
+  size_t Outstanding() const { return latest_.size(); }
+
+  // This is used as a static pointer to the global IconDecoder instance,
+  // initialised on start-up in lwm.cc. It may be null, in which case icons
+  // are made synchronously.
+  static IconDecoder* I;
+
+ private:
+  struct Job {
+    Job(const unsigned long* data, unsigned long len) : pixels(data, len) {}
+
+    xlib::ImageIcon::PixelJob pixels;
+  };
+
+  // A window waiting for a job's icon.
+  struct Waiter {
+    uint64_t id;
+    Window window;
+    Callback done;
+  };
+
+  // The worker threads' main loop.
+  void work();
+
+  // Called on the main thread when the eventfd is readable; delivers the
+  // finished icons.
+  void collect();
+
+  const int event_fd_;
+  uint64_t next_id_ = 1;
+  // The latest request for each window; only touched on the main thread.
+  std::map<Window, uint64_t> latest_;
+  // The windows waiting for each queued or running job, by PixelJob::Key.
+  // Also only touched on the main thread.
+  std::map<uint64_t, std::vector<Waiter>> in_flight_;
+
+  // mu_ guards the two queues.
+  std::mutex mu_;
+  std::condition_variable work_ready_;
+  std::deque<std::unique_ptr<Job>> pending_;
+  std::vector<std::unique_ptr<Job>> finished_;
+
+  IconDecoder(const IconDecoder&) = delete;
+  IconDecoder& operator=(const IconDecoder&) = delete;
+};
+
+#endif  // LWM_ICONDECODER_H_included
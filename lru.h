@@ -0,0 +1,183 @@
+#ifndef LWM_LRU_H_included
+#define LWM_LRU_H_included
+
+#include <stddef.h>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+// LRUCache maps keys to values, holding at most a fixed number of entries.
+// When it's full, adding an entry throws away the one which was least
+// recently added or looked up. Get and Put take constant time.
+template <typename K, typename V>
+class LRUCache {
+ public:
+  explicit LRUCache(size_t capacity) : capacity_(capacity) {}
+
+  // Returns the value for key, or null if it isn't cached. The pointer is
+  // valid until the next Put or Clear.
+  V* Get(const K& key) {
+    const auto it = index_.find(key);
+    if (it == index_.end()) {
+      misses_++;
+      return nullptr;
+    }
+    hits_++;
+    // Move the entry to the front, as the most recently used.
+    items_.splice(items_.begin(), items_, it->second);
+    return &it->second->second;
+  }
+
+  void Put(const K& key, V value) {
+    const auto it = index_.find(key);
+    if (it != index_.end()) {
+      it->second->second = std::move(value);
+      items_.splice(items_.begin(), items_, it->second);
+      return;
+    }
+    items_.emplace_front(key, std::move(value));
+    index_[key] = items_.begin();
+    if (items_.size() > capacity_) {
+      index_.erase(items_.back().first);
+      items_.pop_back();
+    }
+  }
+
+  void Clear() {
+    items_.clear();
+    index_.clear();
+  }
+
+  size_t Size() const { return items_.size(); }
+  size_t Capacity() const { return capacity_; }
+  unsigned long Hits() const { return hits_; }
+  unsigned long Misses() const { return misses_; }
+
+ private:
+  const size_t capacity_;
+  // Most recently used first.
+  std::list<std::pair<K, V>> items_;
+  std::unordered_map<K, typename std::list<std::pair<K, V>>::iterator> index_;
+  unsigned long hits_ = 0;
+  unsigned long misses_ = 0;
+
+  LRUCache(const LRUCache&) = delete;
+  LRUCache& operator=(const LRUCache&) = delete;
+};
+
+// SharedCache holds values which are shared by reference counting, each of
+// which has a cost (such as the memory it uses). Values which are in use are
+// never evicted. Once nothing refers to a value, it's kept in case it's wanted
+// again, until the total cost of everything in the cache exceeds the budget;
+// then the values released longest ago are evicted, until it's back within
+// budget or there's nothing left that can be evicted.
+template <typename K, typename V>
+class SharedCache {
+ public:
+  // evict is called on each value as it's thrown away, to free its resources.
+  SharedCache(size_t budget, std::function<void(V&)> evict)
+      : budget_(budget), evict_(std::move(evict)) {}
+
+  // Returns the value for key, having taken a reference to it, or null if it
+  // isn't cached. The pointer is valid until the reference is released.
+  V* Acquire(const K& key) {
+    const auto it = entries_.find(key);
+    if (it == entries_.end()) {
+      misses_++;
+      return nullptr;
+    }
+    hits_++;
+    Entry& e = it->second;
+    if (e.refs++ == 0) {
+      unused_.erase(e.unused);
+    }
+    return &e.value;
+  }
+
+  // Adds a value, with one reference, which the caller owns. If retain is
+  // false, the value is evicted as soon as it's released, rather than kept
+  // for reuse. The key must not already be in the cache.
+  void Insert(const K& key, V value, size_t cost, bool retain) {
+    Entry& e = entries_[key];
+    e.value = std::move(value);
+    e.cost = cost;
+    e.refs = 1;
+    e.retain = retain;
+    cost_ += cost;
+    trim();
+  }
+
+  // Releases a reference taken by Acquire or Insert.
+  void Release(const K& key) {
+    const auto it = entries_.find(key);
+    if (it == entries_.end() || --it->second.refs > 0) {
+      return;
+    }
+    if (!it->second.retain) {
+      evict(it);
+      return;
+    }
+    unused_.push_front(key);
+    it->second.unused = unused_.begin();
+    trim();
+  }
+
+  // Evicts every value which nothing refers to, whatever the budget.
+  void EvictUnused() {
+    while (!unused_.empty()) {
+      const auto it = entries_.find(unused_.back());
+      unused_.pop_back();
+      evict(it);
+    }
+  }
+
+  size_t Size() const { return entries_.size(); }
+  // The number of values which nothing refers to.
+  size_t Unused() const { return unused_.size(); }
+  size_t Cost() const { return cost_; }
+  size_t Budget() const { return budget_; }
+  unsigned long Hits() const { return hits_; }
+  unsigned long Misses() const { return misses_; }
+  unsigned long Evictions() const { return evictions_; }
+
+ private:
+  struct Entry {
+    V value;
+    size_t cost = 0;
+    int refs = 0;
+    bool retain = false;
+    // The entry's place in unused_, if refs is 0.
+    typename std::list<K>::iterator unused;
+  };
+
+  void evict(typename std::unordered_map<K, Entry>::iterator it) {
+    evict_(it->second.value);
+    cost_ -= it->second.cost;
+    entries_.erase(it);
+    evictions_++;
+  }
+
+  void trim() {
+    while (cost_ > budget_ && !unused_.empty()) {
+      const auto it = entries_.find(unused_.back());
+      unused_.pop_back();
+      evict(it);
+    }
+  }
+
+  const size_t budget_;
+  const std::function<void(V&)> evict_;
+  std::unordered_map<K, Entry> entries_;
+  // Keys of the values with no references, most recently released first.
+  std::list<K> unused_;
+  size_t cost_ = 0;
+  unsigned long hits_ = 0;
+  unsigned long misses_ = 0;
+  unsigned long evictions_ = 0;
+
+  SharedCache(const SharedCache&) = delete;
+  SharedCache& operator=(const SharedCache&) = delete;
+};
+
+#endif  // LWM_LRU_H_included
@@ -18,6 +18,7 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <locale.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,7 +30,15 @@
 
 #include <signal.h>
 
+#include <memory>
+
+#include "eventloop.h"
+#include "handoff.h"
+#include "iconcache.h"
+#include "icondecoder.h"
+#include "lru.h"
 #include "lwm.h"
+#include "trace.h"
 #include "xlib.h"
 
 bool is_initialising;
@@ -58,12 +67,63 @@ Atom _mozilla_url;
 // we're not going to link with motif, so we'll have to do it by hand
 Atom motif_wm_hints;
 
-bool forceRestart;
 char* argv0;
 
+// Set by the SIGHUP handler. The handler also writes to restart_pipe, which
+// the event loop watches, so that a SIGHUP which arrives just before we wait
+// still wakes us.
+static volatile sig_atomic_t forceRestart;
+static int restart_pipe[2] = {-1, -1};
+
+// Given by -readyfd=<fd>, for lwmbench: once start-up is over, we write the
+// number of X requests it took to this, and close it.
+static int ready_fd = -1;
+
 void rrScreenChangeNotify(XEvent* ev);
 void setScreenAreasFromXRandR();
 
+// Dispatches all the events that are waiting on the X connection.
+void processXEvents(int rr_event_base) {
+  while (XPending(dpy)) {
+    XEvent ev;
+    XNextEvent(dpy, &ev);
+    if (Trace::I) {
+      Trace::I->Event(ev);
+    }
+    // xrandr notifications have arbitrary numbers, so check for them
+    // before trying the static selection.
+    if (ev.type == rr_event_base + RRScreenChangeNotify) {
+      rrScreenChangeNotify(&ev);
+    } else {
+      DispatchXEvent(&ev);
+    }
+  }
+}
+
+// Tells whoever gave us -readyfd that start-up is over: every window has
+// been managed, its icon drawn, and the server has done everything we've
+// asked for.
+static void signalReady() {
+  XSync(dpy, false);
+  const std::string line = std::to_string(NextRequest(dpy) - 1) + "\n";
+  if (write(ready_fd, line.data(), line.size()) != ssize_t(line.size())) {
+    LOGE() << "Failed to write to -readyfd: " << Log::Errno(errno);
+  }
+  close(ready_fd);
+  ready_fd = -1;
+}
+
+// main() restarts us once the event loop notices, as that's no job for a
+// signal handler.
+static void restartSignalled(int) {
+  const int saved_errno = errno;
+  forceRestart = true;
+  if (write(restart_pipe[1], "", 1) < 0) {
+    // The pipe is full, so the event loop will wake anyway.
+  }
+  errno = saved_errno;
+}
+
 std::vector<std::string> Split(const std::string& in,
                                const std::string& split) {
   std::vector<std::string> res;
@@ -91,6 +151,20 @@ extern int main(int argc, char* argv[]) {
         // Argument is a sequence of commands, separated by ;.
         debug_init_commands = Split(std::string(argv[i] + 10), ";");
       }
+    } else if (!strncmp(argv[i], "-handoff=", 9)) {
+      // Passed by a restarting LWM, so we can take over its windows.
+      Handoff::I = Handoff::Take(atoi(argv[i] + 9));
+    } else if (!strncmp(argv[i], "-readyfd=", 9)) {
+      ready_fd = atoi(argv[i] + 9);
+    } else if (!strncmp(argv[i], "-trace=", 7)) {
+      if (!Trace::Open(argv[i] + 7, false)) {
+        return 1;
+      }
+    } else if (!strncmp(argv[i], "-trace-append=", 14)) {
+      // Passed by a restarting LWM, so the trace covers both processes.
+      if (!Trace::Open(argv[i] + 14, true)) {
+        return 1;
+      }
     } else if (!strcmp(argv[i], "-test")) {
       LOGI() << "Run in self-test mode; will run all tests, then exit";
       return RunAllTests() ? 0 : 1;
@@ -112,14 +186,34 @@ extern int main(int argc, char* argv[]) {
             ScreenCount(dpy));
   }
   Resources::Init();
+  EventLoop::I = new EventLoop;
+  Deferred::I = new Deferred;
+  if (Resources::I->ProcessAppIcons()) {
+    // Two threads are plenty: icons only need making when windows appear.
+    IconDecoder::I = new IconDecoder(2);
+    // Icons made before a restart are kept on disk. 8MiB holds about a
+    // thousand icons at the usual title bar size.
+    const std::string icon_cache = IconDiskCache::DefaultPath();
+    if (!icon_cache.empty()) {
+      IconDiskCache::I = IconDiskCache::Open(icon_cache, 8 << 20);
+    }
+  }
 
   // Set up an error handler.
   XSetErrorHandler(errorHandler);
 
   // Set up signal handlers.
+  if (pipe2(restart_pipe, O_NONBLOCK | O_CLOEXEC)) {
+    panic("can't create restart pipe.");
+  }
+  EventLoop::I->AddSource("Restart signal", restart_pipe[0], [] {
+    char buf[16];
+    while (read(restart_pipe[0], buf, sizeof(buf)) > 0) {
+    }
+  });
   signal(SIGTERM, Terminate);
   signal(SIGINT, Terminate);
-  signal(SIGHUP, Terminate);
+  signal(SIGHUP, restartSignalled);
 
   // Ignore SIGCHLD.
   struct sigaction sa;
@@ -170,12 +264,14 @@ extern int main(int argc, char* argv[]) {
   LScr::I = new LScr(dpy);
   LScr::I->Init();
   session_init(argc, argv);
+  delete Handoff::I;
+  Handoff::I = nullptr;
 
   // Initialisation is finished; from now on, errors are not going to be fatal.
   is_initialising = false;
 
   // Do we need to support XRandR?
-  int rr_event_base, rr_error_base;
+  int rr_event_base = 0, rr_error_base = 0;
   bool have_rr = XRRQueryExtension(dpy, &rr_event_base, &rr_error_base);
   if (have_rr) {
     XRRSelectInput(dpy, LScr::I->Root(), RRScreenChangeNotifyMask);
@@ -185,16 +281,10 @@ extern int main(int argc, char* argv[]) {
   // See if the server has the Shape Window extension.
   shape = serverSupportsShapes();
 
-  // The main event loop.
-  int dpy_fd = ConnectionNumber(dpy);
-  int max_fd = dpy_fd + 1;
-  int delayed_focus_fd = LScr::I->GetFocuser()->GetTimerFD();
-  if (ice_fd >= max_fd) {
-    max_fd = ice_fd + 1;
-  }
-  if (delayed_focus_fd >= max_fd) {
-    max_fd = delayed_focus_fd + 1;
-  }
+  // The X connection is our own event source; everything else registers
+  // itself with the event loop as it's initialised.
+  EventLoop::I->AddSource("X connection", ConnectionNumber(dpy),
+                          [rr_event_base] { processXEvents(rr_event_base); });
 
   // Just before we start the loop, execute any commands we've been told to
   // run on start-up.
@@ -202,57 +292,67 @@ extern int main(int argc, char* argv[]) {
     debugCLI->Init(debug_init_commands);
   }
 
+  // The main event loop.
   while (!forceRestart) {
-    fd_set readfds;
-
-    FD_ZERO(&readfds);
-    FD_SET(dpy_fd, &readfds);
-    FD_SET(delayed_focus_fd, &readfds);
-    if (ice_fd > 0) {
-      FD_SET(ice_fd, &readfds);
+    // Any callback which waits for a reply from the X server (eg the focus
+    // timer's XSync, or an xlib::async Get) may have caused Xlib or XCB to
+    // read events into its queue. The X connection won't be readable any
+    // more, so we'd not notice them until something else happened; dispatch
+    // them now instead. XQLength would only count Xlib's queue, whereas
+    // XPending also takes in whatever XCB has queued.
+    if (XPending(dpy)) {
+      processXEvents(rr_event_base);
+      continue;
     }
-    if (debugCLI) {
-      FD_SET(STDIN_FILENO, &readfds);
-    }
-    if (select(max_fd, &readfds, NULL, NULL, NULL) > -1) {
-      if (FD_ISSET(dpy_fd, &readfds)) {
-        while (XPending(dpy)) {
-          XEvent ev;
-          XNextEvent(dpy, &ev);
-          // xrandr notifications have arbitrary numbers, so check for them
-          // before trying the static selection.
-          if (ev.type == rr_event_base + RRScreenChangeNotify) {
-            rrScreenChangeNotify(&ev);
-          } else {
-            DispatchXEvent(&ev);
-          }
-        }
-      }
-      if (ice_fd > 0 && FD_ISSET(ice_fd, &readfds)) {
-        session_process();
-      }
-      if (FD_ISSET(delayed_focus_fd, &readfds)) {
-        LScr::I->GetFocuser()->TimerFDTriggered();
-        // My best guess as to why we need this is that, because the event we
-        // received didn't come off the Xlib connection (but rather our own
-        // timer file descriptor), messages to the X server don't get flushed
-        // automatically. The effect of this is that the delayed focus granting
-        // sort of happens, but doesn't look like it did until the user does
-        // something that triggers any event in LWM (like moving the mouse by
-        // a pixel).
-        // So call XSync so that we're sure all outstanding messages to, for
-        // example, tell the client it has input focus, and redraw its frame,
-        // get through.
-        XSync(dpy, false);
-      }
-      if (debugCLI && FD_ISSET(STDIN_FILENO, &readfds)) {
-        debugCLI->Read();
-      }
+    // The batch is over; do the work it left behind, then make sure the
+    // server has everything we've asked for before we sleep.
+    Deferred::I->Run();
+    XFlush(dpy);
+    // Start-up isn't over until the icons being made for the windows we
+    // found have been drawn.
+    if (ready_fd >= 0 &&
+        (!IconDecoder::I || IconDecoder::I->Outstanding() == 0)) {
+      signalReady();
     }
+    EventLoop::I->RunOnce();
   }
   // Someone hit us with a SIGHUP: better exec ourselves to force a config
-  // reload and cope with changing screen sizes.
-  execvp(argv0, argv);
+  // reload and cope with changing screen sizes. The new process takes over
+  // our windows as they are, if it can.
+  // The trace needs the display to look up atom names.
+  if (Trace::I) {
+    Trace::I->Flush();
+  }
+  std::unique_ptr<Handoff> handoff(Handoff::Capture());
+  const int handoff_fd = handoff->Give();
+  if (handoff_fd < 0) {
+    ReleaseDisplay();
+  }
+  session_end();
+  std::vector<char*> args;
+  std::string trace_arg;
+  for (int i = 0; i < argc; i++) {
+    if (!strncmp(argv[i], "-trace=", 7)) {
+      // The new process adds to our trace, rather than overwriting it.
+      trace_arg = std::string("-trace-append=") + (argv[i] + 7);
+      args.push_back(&trace_arg[0]);
+    } else if (strncmp(argv[i], "-handoff=", 9) &&
+               strncmp(argv[i], "-readyfd=", 9)) {
+      // The fd named by -readyfd has been closed, and may have been reused.
+      args.push_back(argv[i]);
+    }
+  }
+  std::string handoff_arg = "-handoff=" + std::to_string(handoff_fd);
+  if (handoff_fd >= 0) {
+    args.push_back(&handoff_arg[0]);
+  }
+  args.push_back(nullptr);
+  execvp(argv0, args.data());
+  LOGE() << "Failed to restart " << argv0 << ": " << Log::Errno(errno);
+  if (handoff_fd >= 0) {
+    handoff->Abandon();
+  }
+  return 1;
 }
 
 void rrScreenChangeNotify(XEvent* ev) {
@@ -282,6 +382,29 @@ void rrScreenChangeNotify(XEvent* ev) {
   setScreenAreasFromXRandR();
 }
 
+// Returns the refresh rate, in Hz, of the given mode, or zero if it's not one
+// of the modes in res.
+double refreshRateOf(const XRRScreenResources* res, RRMode mode) {
+  for (int i = 0; i < res->nmode; i++) {
+    const XRRModeInfo& info = res->modes[i];
+    if (info.id != mode) {
+      continue;
+    }
+    double v_total = info.vTotal;
+    if (info.modeFlags & RR_DoubleScan) {
+      v_total *= 2;
+    }
+    if (info.modeFlags & RR_Interlace) {
+      v_total /= 2;
+    }
+    if (!info.hTotal || !v_total) {
+      return 0;
+    }
+    return double(info.dotClock) / (double(info.hTotal) * v_total);
+  }
+  return 0;
+}
+
 void setScreenAreasFromXRandR() {
   XRRScreenResources* res = XRRGetScreenResourcesCurrent(dpy, LScr::I->Root());
   if (!res) {
@@ -301,22 +424,29 @@ void setScreenAreasFromXRandR() {
   // the CRT info already gets the correct sizes and locations (including
   // mode=0 for those that are disabled).
   std::vector<Rect> visible;
+  std::vector<std::pair<Rect, double>> rates;
   for (int i = 0; i < res->ncrtc; i++) {
     const RRCrtc crt = res->crtcs[i];
     LOGI() << "Looking up CRT " << i << ": " << crt;
     XRRCrtcInfo* crtInfo = XRRGetCrtcInfo(dpy, res, crt);
+    if (!crtInfo) {
+      continue;
+    }
+    const double rate = refreshRateOf(res, crtInfo->mode);
     LOGI() << "  CRT size " << crtInfo->width << "x" << crtInfo->height
            << ", offset " << crtInfo->x << "," << crtInfo->y
-           << " (mode=" << crtInfo->mode << ")";
-    if (!crtInfo->mode) {
-      continue;
+           << " (mode=" << crtInfo->mode << ", " << rate << "Hz)";
+    if (crtInfo->mode) {
+      const int xMin = crtInfo->x;
+      const int yMin = crtInfo->y;
+      const int xMax = xMin + crtInfo->width;
+      const int yMax = yMin + crtInfo->height;
+      visible.push_back(Rect{xMin, yMin, xMax, yMax});
+      rates.push_back(std::make_pair(visible.back(), rate));
     }
-    const int xMin = crtInfo->x;
-    const int yMin = crtInfo->y;
-    const int xMax = xMin + crtInfo->width;
-    const int yMax = yMin + crtInfo->height;
-    visible.push_back(Rect{xMin, yMin, xMax, yMax});
+    XRRFreeCrtcInfo(crtInfo);
   }
+  LScr::I->SetRefreshRates(rates);
   LScr::I->SetVisibleAreas(visible);
 }
 
@@ -364,23 +494,53 @@ extern int textHeight() {
   return g_font->height;
 }
 
-extern void drawString(Window w,
+// The XftDraws for everything we've drawn text on, so we needn't create and
+// destroy one for every string.
+static std::map<Drawable, XftDraw*> xft_draws;
+
+extern void drawString(Drawable d,
                        int x,
                        int y,
                        const std::string& s,
                        XftColor* c) {
-  int screenID = DefaultScreen(dpy);
-  XftDraw* draw = XftDrawCreate(dpy, w, DefaultVisual(dpy, screenID),
-                                DefaultColormap(dpy, screenID));
+  XftDraw*& draw = xft_draws[d];
+  if (!draw) {
+    int screenID = DefaultScreen(dpy);
+    draw = XftDrawCreate(dpy, d, DefaultVisual(dpy, screenID),
+                         DefaultColormap(dpy, screenID));
+  }
   XftDrawStringUtf8(draw, c, g_font, x, y,
                     reinterpret_cast<const FcChar8*>(s.c_str()), s.size());
-  XftDrawDestroy(draw);
 }
 
+extern void forgetDrawable(Drawable d) {
+  const auto it = xft_draws.find(d);
+  if (it != xft_draws.end()) {
+    XftDrawDestroy(it->second);
+    xft_draws.erase(it);
+  }
+}
+
+extern void forgetAllDrawables() {
+  for (const auto& it : xft_draws) {
+    XftDrawDestroy(it.second);
+  }
+  xft_draws.clear();
+}
+
+// The widths of strings we've measured. The same few strings (window titles
+// and the unhide menu's entries) are measured over and over, so this needn't
+// be very big.
+static LRUCache<std::string, int> text_widths(512);
+
 // Returns the width of the given string in pixels, rendered in the LWM font.
 extern int textWidth(const std::string& s) {
+  if (const int* width = text_widths.Get(s)) {
+    return *width;
+  }
   XGlyphInfo extents;
   XftTextExtentsUtf8(dpy, g_font, reinterpret_cast<const FcChar8*>(s.c_str()),
                      s.size(), &extents);
+  text_widths.Put(s, extents.xOff);
   return extents.xOff;
 }
@@ -22,10 +22,12 @@
 #include <stdint.h>
 #include <list>
 #include <map>
+#include <set>
 #include <string>
 
 #include "geometry.h"
 #include "log.h"
+#include "xasync.h"
 #include "xlib.h"
 
 /* --- Administrator-configurable defaults. --- */
@@ -111,6 +113,19 @@ struct EWMHStrut {
   unsigned int bottom;
 };
 
+/**
+ * One of the icons in a _NET_WM_ICON property, which may hold several sizes
+ * of the same icon one after another. The offset is in 32-bit units, and is
+ * that of the icon's width, which is followed by its height and pixels.
+ */
+struct EWMHIconSize {
+  long offset;
+  int width;
+  int height;
+};
+
+struct HandoffClient;  // See handoff.h.
+
 class Client {
  public:
   Client(Window w,
@@ -118,12 +133,19 @@ class Client {
          const DimensionLimiter& x_limiter,
          const DimensionLimiter& y_limiter);
 
-  ~Client() { delete icon_; }
+  ~Client();
 
   // Called on LWM shutdown to reparent the client window and give it back its
   // border.
   void Release();
 
+  // For restarts (see handoff.h): SaveState records what the new LWM needs
+  // to know about us, and HandOver frees what it won't be able to. The new
+  // LWM calls RestoreState on the new Client before it's managed.
+  HandoffClient SaveState() const;
+  void HandOver();
+  void RestoreState(const HandoffClient& s);
+
   void SetName(const std::string& n) { name_ = n; }
   void SetVisibleName(const std::string& n) { visible_name_ = n; }
   const std::string& Name() const {
@@ -154,6 +176,8 @@ class Client {
   bool IsHidden() const { return state_ == IconicState; }
   bool IsWithdrawn() const { return state_ == WithdrawnState; }
   bool IsNormal() const { return state_ == NormalState; }
+  // The border width the window had before we framed it.
+  int OriginalBorderWidth() const { return original_border_width_; }
 
   bool HasFocus() const;
   static Client* FocusedClient();
@@ -181,7 +205,14 @@ class Client {
   void Remove();
 
   // Draws the contents of the furniture window.
-  void DrawBorder();
+  // If damage is given, only the parts of the furniture (close icon, title
+  // strip) which intersect it are redrawn. This is intended for responding to
+  // Expose events, for which the server has already cleared the damaged area
+  // to the frame's background.
+  // With cached title rendering (the default), the title bar is kept in a
+  // pixmap for each focus state, only redrawn when something shown in it
+  // changes, and copied to the frame in one go.
+  void DrawBorder(Region damage = nullptr);
 
   bool HasStruts() const {
     return strut.top || strut.bottom || strut.left || strut.right;
@@ -250,13 +281,18 @@ class Client {
   EWMHWindowState wstate = {};
   EWMHStrut strut = {};  // reserved areas
 
-  // SetIcon sets the window's title bar icon. If called with null, it will do
-  // nothing (and leave any previously-set icon in place).
+  // SetIcon sets the window's title bar icon, replacing (and deleting) any
+  // previous one. If called with null, it will do nothing (and leave any
+  // previously-set icon in place).
   void SetIcon(xlib::ImageIcon* icon);
   xlib::ImageIcon* Icon() { return icon_; }
 
  private:
   Rect EdgeBounds(Edge e) const;
+  void drawCloseIcon(Drawable d, bool active);
+  void drawTitle(Drawable d, bool active);
+  void drawCachedBorder(Region damage, bool active, unsigned long background);
+  void freeTitlePixmaps();
 
   // name_ is the frame title as specified by the client.
   std::string name_;
@@ -267,6 +303,28 @@ class Client {
   // Google's "Hangouts Chat" tends to do at a rate of
   std::string visible_name_;
   xlib::ImageIcon* icon_ = nullptr;
+  // Counts SetIcon's changes. A new icon may be allocated where the one it
+  // replaced was, so the address doesn't tell us the icon has changed.
+  uint64_t icon_generation_ = 0;
+
+  // The background colour we last set on the frame window, so we know whether
+  // the server will clear exposed areas to the right colour.
+  unsigned long frame_background_ = ~0UL;
+
+  // The cached title bars, and what they were drawn with, so we know when they
+  // need drawing again. There's one for each focus state, indexed by whether
+  // the window has focus, so that a focus change is just a copy.
+  struct TitleKey {
+    std::string name;
+    uint64_t icon_generation;
+    int width;
+    bool operator==(const TitleKey& o) const {
+      return name == o.name && icon_generation == o.icon_generation &&
+             width == o.width;
+    }
+  };
+  Pixmap title_pm_[2] = {None, None};
+  TitleKey title_key_[2] = {};
 
   Client(const Client&) = delete;
   Client& operator=(const Client&) = delete;
@@ -301,6 +359,10 @@ class CursorMap {
   // Returns the same as Root() if there's no specific cursor for some edge.
   Cursor ForEdge(Edge e) const;
 
+  // Frees the cursors on the server. Windows which use them keep them until
+  // they're given another cursor.
+  void Free(Display* dpy);
+
  private:
   Cursor root_;
   std::map<Edge, Cursor> edges_;
@@ -315,13 +377,21 @@ class Hider {
   void Hide(Client* c);
   void Unhide(Client* c);
 
+  // The frames of the hidden windows, most recently hidden first.
+  const std::list<Window>& Hidden() const { return hidden_; }
+  // Puts the given frames first in the hidden list, in the order given, such
+  // as after a restart.
+  void Reorder(const std::vector<Window>& frames);
+
   void OpenMenu(XButtonEvent* ev);
-  void Paint();
+  // Repaints the menu rows which intersect the damage region.
+  void Paint(Region damage);
   void MouseMotion(XEvent* ev);
   void MouseRelease(XEvent* ev);
 
  private:
   int itemAt(int x, int y) const;
+  void paintItem(int itemIndex);
   void drawHighlight(int itemIndex);
   void showHighlightBox(int itemIndex);
   void hideHighlightBox();
@@ -379,19 +449,15 @@ class Hider {
 // slightly for the A->B->C case and avoiding the race condition.
 class Focuser {
  public:
+  // The Focuser registers its timer file descriptor with the EventLoop on
+  // construction, so EventLoop::I must already exist.
   Focuser();
 
-  // Get hold of the file descriptor we're using to notify the main switch
-  // thread that we should trigger delayed focus events. This should be called
-  // by lwm.cc, when it's collecting the set of file descriptors it should
-  // be switching on.
-  int GetTimerFD() { return timer_fd_; }
-
   // Notification that the mouse pointer has entered a window. This may or
   // may not result in a change of input focus.
   void EnterWindow(Window w);
 
-  // Called by the switch loop in lwm.cc, in response to the timer fd going off.
+  // Called by the event loop, in response to the timer fd going off.
   void TimerFDTriggered();
 
   // Forces the focuser to forget the given client (either because the
@@ -406,6 +472,12 @@ class Focuser {
 
   Client* GetFocusedClient();
 
+  // The clients which have had focus, most recent first.
+  const std::list<Client*>& History() const { return focus_history_; }
+  // Replaces the history, such as after a restart, and gives focus to the
+  // first client in it.
+  void RestoreHistory(const std::vector<Client*>& history);
+
  private:
   int timer_fd_ = -1;
   uint64_t last_entry_time_millis_ = 0;
@@ -415,7 +487,7 @@ class Focuser {
   void RemoveFromHistory(Client* c);
 
   // Focuses the pending window. This is called either from EnterWindow, or
-  // from the main switch loop in lwm.cc, in case of a delayed focus-giving.
+  // from TimerFDTriggered, in case of a delayed focus-giving.
   void FocusPending();
 
   // Does the actual work of FocusClient, except without the safety-check
@@ -435,6 +507,148 @@ class Focuser {
   std::list<Client*> focus_history_;
 };
 
+// Deferred collects work which only needs doing once per batch of events,
+// however many of the events in the batch asked for it. For example, each
+// raise or lower of a window invalidates the _NET_CLIENT_LIST_STACKING
+// property, but if 50 windows are raised in response to one burst of events,
+// we only want to rewrite it (and check the EWMH stacking rules) once.
+// Event handlers mark work as needed; the main loop calls Run once it has
+// drained the X event queue, just before flushing the connection.
+class Deferred {
+ public:
+  // Global (rather than per-client) items, which may be OR'd together.
+  enum {
+    STACKING = 1,     // Enforce the EWMH layers, then rewrite the lists.
+    CLIENT_LIST = 2,  // Rewrite _NET_CLIENT_LIST(_STACKING).
+    WORKAREA = 4,     // Recalculate the struts and _NET_WORKAREA.
+  };
+
+  void Mark(unsigned items);
+
+  // Marks the client's frame as needing a full redraw.
+  void Redraw(Client* c);
+
+  // Marks the client's WM_STATE and _NET_WM_STATE properties as needing to be
+  // written to match its current state.
+  void WriteState(Client* c);
+
+  // Drops any pending work for c, which is about to be deleted.
+  void Forget(Client* c);
+
+  // Does all the pending work.
+  void Run();
+
+  // The number of times work was marked, and the number of Runs which found
+  // there was something to do.
+  uint64_t Marks() const { return marks_; }
+  uint64_t Runs() const { return runs_; }
+
+  // The global instance, created on start-up in lwm.cc.
+  static Deferred* I;
+
+ private:
+  unsigned items_ = 0;
+  std::set<Client*> redraws_;
+  std::set<Client*> states_;
+  uint64_t marks_ = 0;
+  uint64_t runs_ = 0;
+};
+
+// ShadowTree is our own record of which window is the parent of which, so
+// that finding the client a sub-window belongs to needn't cost an XQueryTree
+// per level. It's kept up to date from the CreateNotify, ReparentNotify and
+// DestroyNotify events we get for the children of the root and of our frames,
+// plus the start-up scan.
+// We aren't told about windows deeper inside a client's own hierarchy, so the
+// first time we're asked about one of those we query the server, and remember
+// the answer until the window (or one of its ancestors) is destroyed.
+class ShadowTree {
+ public:
+  void Created(Window w, Window parent);
+  void Reparented(Window w, Window parent);
+  // Forgets w and everything we know to be below it.
+  void Destroyed(Window w);
+
+  // Returns w's parent, asking the X server if we don't know it already.
+  // Returns None for the root, or if the window doesn't exist.
+  Window ParentOf(Window w);
+
+  // Compares everything we know against the X server, returning a line for
+  // each difference. This is slow, and only for debugging.
+  std::vector<std::string> Check() const;
+
+  // When verifying is on, every answer ParentOf gives from the model is
+  // checked against the server, and any mismatch is logged.
+  void SetVerify(bool verify) { verify_ = verify; }
+  bool Verify() const { return verify_; }
+
+  size_t Size() const { return parents_.size(); }
+  // How many ParentOf calls we could answer ourselves, and how many we had to
+  // ask the server about.
+  uint64_t Hits() const { return hits_; }
+  uint64_t Misses() const { return misses_; }
+
+ private:
+  void unlink(Window w);
+
+  std::map<Window, Window> parents_;
+  std::map<Window, std::set<Window>> children_;
+  bool verify_ = false;
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+};
+
+// Stacking is our model of the stacking order of the clients' top-level
+// windows (their frames, or the client windows themselves if unframed).
+// Raising and lowering clients only changes the model; Apply then works out
+// where each window should be according to the EWMH layers, and sends the
+// server requests to move just the windows which aren't there already.
+class Stacking {
+ public:
+  // The EWMH layers, from bottom to top.
+  enum Layer { DESKTOP, BELOW, NORMAL, ABOVE, FULLSCREEN };
+
+  // One restacking request: w goes directly above (or below) sibling, or to
+  // the very top (or bottom) if sibling is None. mode is Above or Below.
+  struct Move {
+    Window w;
+    Window sibling;
+    int mode;
+  };
+
+  // Adds a new window at the top. If the caller doesn't know that the window
+  // really is at the top, it's placed explicitly the next time we Apply.
+  void Add(Window w, bool known_on_top);
+  void Remove(Window w);
+  // Tells us where the server has the windows, bottom to top, such as from
+  // XQueryTree. Windows we aren't stacking are ignored.
+  void Seed(const std::vector<Window>& actual);
+
+  void Raise(Window w);
+  void Lower(Window w);
+
+  // Sorts the model into layers, and restacks whatever needs it to match.
+  void Apply();
+
+  // The windows from bottom to top, as of the last Apply.
+  const std::vector<Window>& Order() const { return order_; }
+
+  // The requests needed to restack windows in the current order (bottom to
+  // top) into the target order. Windows which aren't in current are placed
+  // explicitly. Only windows which are out of order relative to the others
+  // are moved.
+  static std::vector<Move> Plan(const std::vector<Window>& current,
+                                const std::vector<Window>& target);
+
+  static Layer LayerOf(const Client* c);
+
+ private:
+  // Where we want the windows, bottom to top.
+  std::vector<Window> order_;
+  // Where the server has them, as far as we know.
+  std::vector<Window> applied_;
+};
+
 // Screen information.
 class LScr {
  public:
@@ -444,6 +658,10 @@ class LScr {
   // has been assigned to this instance.
   void Init();
 
+  // For restarts (see handoff.h): frees the GCs and cursors, which would
+  // otherwise outlive us, as our resources are retained after we exit.
+  void HandOver();
+
   Display* Dpy() const { return dpy_; }
   Window Root() const { return root_; }
   Window Popup() const { return popup_; }
@@ -460,6 +678,10 @@ class LScr {
   GC GetCloseIconGC(bool active) { return active ? gc_ : inactive_gc_; }
   GC GetMenuGC() { return menu_gc_; }
   GC GetTitleGC() { return title_gc_; }
+  GC GetBorderGC(bool active) {
+    return active ? border_gc_ : inactive_border_gc_;
+  }
+  GC GetCopyGC() { return copy_gc_; }
 
   // Sets the screen areas which are visible.
   // For one-monitor systems, this will be a single rectangle.
@@ -484,6 +706,16 @@ class LScr {
   // specific order, and will abut *or overlap*.
   std::vector<Rect> VisibleAreas(bool withStruts) const;
 
+  // Records the refresh rate, in Hz, of each monitor, as reported by XRandR.
+  // Each entry pairs the area a monitor displays with its rate.
+  void SetRefreshRates(const std::vector<std::pair<Rect, double>>& rates) {
+    refresh_rates_ = rates;
+  }
+
+  // Returns the refresh rate, in Hz, of the monitor showing most of r, or zero
+  // if we don't know it.
+  double RefreshRateFor(const Rect& r) const;
+
   // Expose the utf8 string atom. This is used by ewmh.cc. Not sure why it can't
   // go in the main enumerated set of atoms, and indeed this whole atom support
   // looks like it needs refactoring. For now, though, ugly hack here:
@@ -508,11 +740,15 @@ class LScr {
   Client* GetOrAddClient(Window w, bool is_startup_scan);
 
   void Furnish(Client* c);
+  // Takes over the frame a previous LWM made for c (see handoff.h).
+  void Adopt(Client* c, Window frame);
 
   void Remove(Client* client);
 
   Hider* GetHider() { return &hider_; }
   Focuser* GetFocuser() { return &focuser_; }
+  ShadowTree* Tree() { return &tree_; }
+  Stacking* GetStacking() { return &stacking_; }
 
   // Clients() returns the map of all clients, for iteration.
   const std::map<Window, Client*>& Clients() const { return clients_; }
@@ -527,6 +763,19 @@ class LScr {
   void InitEWMH();
   void ScanWindowTree();
   Client* AddClient(Window w, bool is_startup_scan);
+  // Makes a Client for w, given the answers to the queries AddClient makes,
+  // or returns null if it isn't a window we should manage. If adopt is given,
+  // the window was managed by a previous LWM.
+  Client* newClient(Window w,
+                    const XWindowAttributes& attr,
+                    const xlib::async::Property& size_hints,
+                    bool is_startup_scan,
+                    const HandoffClient* adopt);
+  // Registers c's newly made or adopted frame.
+  void addFrame(Client* c);
+  // Takes client out of a frame left by an LWM that died without handing it
+  // over, and destroys the frame. Returns the client, or 0 if it has gone.
+  Window unwrapFrame(Window frame, Window client, int border_width);
   unsigned long black() const { return BlackPixel(dpy_, kOnlyScreenIndex); }
   unsigned long white() const { return WhitePixel(dpy_, kOnlyScreenIndex); }
 
@@ -535,10 +784,14 @@ class LScr {
   int width_ = 0;
   int height_ = 0;
   std::vector<Rect> visible_areas_;
+  std::vector<std::pair<Rect, double>> refresh_rates_;
   CursorMap* cursor_map_;
 
   Hider hider_;
   Focuser focuser_;
+  // This is mutable, as GetClient has to fill it in as it goes.
+  mutable ShadowTree tree_;
+  Stacking stacking_;
 
   // The clients_ map is keyed by the top-level client Window ID. The values
   // are owned.
@@ -550,6 +803,8 @@ class LScr {
   std::map<Window, Client*> parents_;
 
   Atom utf8_string_atom_;
+  // Marks our frames, so that a later LWM can recognise them.
+  Atom lwm_frame_atom_;
 
   Window popup_ = 0;
   Window menu_ = 0;
@@ -561,6 +816,9 @@ class LScr {
   GC inactive_gc_;
   GC menu_gc_;
   GC title_gc_;
+  GC border_gc_;
+  GC inactive_border_gc_;
+  GC copy_gc_;
 
   // Extra colours.
   unsigned long inactive_border_ = 0;
@@ -603,11 +861,16 @@ extern XftColor g_font_popup_colour;
 // Functions for dealing with new pretty fonts:
 extern int textHeight();
 extern int textWidth(const std::string& s);
-extern void drawString(Window w,
+extern void drawString(Drawable d,
                        int x,
                        int y,
                        const std::string& s,
                        XftColor* c);
+// Releases what drawString keeps for d. This must be called before a window
+// or pixmap which has been drawn on is destroyed.
+extern void forgetDrawable(Drawable d);
+// Releases what drawString keeps for all drawables.
+extern void forgetAllDrawables();
 
 extern Atom _mozilla_url;
 extern Atom motif_wm_hints;
@@ -620,14 +883,14 @@ extern Atom compound_text;
 extern bool shape;
 extern int shape_event;
 extern char* argv0;
-extern bool forceRestart;
 extern void shell(int button);
 
 // Runs <command> in a child process.
 extern void RunCommand(const std::string& command);
 
 /* client.cc */
-extern void Client_SizeFeedback();
+struct MousePos;  // See mouse.cc, below.
+extern void Client_SizeFeedback(const MousePos& mp);
 extern void size_expose();
 extern void Client_FreeAll();
 extern void Client_ResetAllCursors();
@@ -635,6 +898,15 @@ extern int titleBarHeight();
 
 /* disp.cc */
 extern void DispatchXEvent(XEvent*);
+// Returns the number of MotionNotify events dropped during drags because a
+// newer one was already queued.
+extern uint64_t DroppedMotionEvents();
+// Returns the time spent in each Ev* handler, for those which have run since
+// start-up or the last reset.
+class LatencyHistogram;  // See histogram.h.
+extern std::vector<std::pair<std::string, const LatencyHistogram*>>
+DispatchLatencies();
+extern void ResetDispatchLatencies();
 
 /* error.cc */
 // Create one of these in a scope to temporary switch off reporting of
@@ -666,10 +938,19 @@ extern void panic(const char*);
 /* manage.cc */
 extern void getWindowName(Client*);
 extern void getVisibleWindowName(Client*);
-extern void manage(Client*);
+// If frame is given, it's one a previous LWM made, which the window is
+// already in (see handoff.h).
+extern void manage(Client*, Window frame = 0);
+// Manages several clients at once (as at start-up), asking the X server about
+// all of them before looking at any of the answers. frames[i] is as for
+// manage(), for clients[i].
+extern void manageAll(const std::vector<Client*>& clients,
+                      const std::vector<Window>& frames);
 extern void withdraw(Client*);
 extern void getTransientFor(Client*);
 extern void Terminate(int);
+// Releases all the clients, and closes the display.
+extern void ReleaseDisplay();
 
 /* mouse.cc */
 struct MousePos {
@@ -680,7 +961,14 @@ struct MousePos {
   unsigned int modMask;
 };
 
+// getMousePosition asks the X server where the pointer is, which is a round
+// trip. Where there's an event to hand, use mousePositionFromEvent instead,
+// which takes the root coordinates and button/modifier state from the event
+// itself (falling back to getMousePosition for events which don't carry them).
+// Note that the state reflects the buttons and modifiers as they were just
+// *before* the event, so a ButtonRelease's state includes the released button.
 extern MousePos getMousePosition();
+extern MousePos mousePositionFromEvent(const XEvent* ev);
 extern int menuItemHeight();
 
 /* shape.cc */
@@ -717,6 +1005,7 @@ class Resources {
     POPUP_BACKGROUND_COLOUR,
     FOCUS_MODE,
     APP_ICON,
+    TITLE_RENDERING,
     S_END,  // This must be the last.
   };
 
@@ -726,18 +1015,29 @@ class Resources {
     BORDER_WIDTH,
     TOP_BORDER_WIDTH,
     FOCUS_DELAY_MILLIS,
+    MAX_DRAG_RATE,
+    ICON_CACHE_KB,
     I_END,  // This must be the last.
   };
 
   // Retrieve a string resource.
   const std::string& Get(SR r);
 
-  // Retrieve a string resource as a colour.
+  // Retrieve a string resource as a colour. Each colour is only looked up
+  // once; on TrueColor displays, "#rrggbb" colours don't need the server at
+  // all.
   unsigned long GetColour(SR r);
 
   // Retrieve a string resource as an XRenderColor (used for Xft fonts).
   XRenderColor GetXRenderColor(SR r);
 
+  // Works out the pixel value of a colour for a TrueColor visual with the
+  // given masks. Exposed for testing.
+  static unsigned long TrueColorPixel(unsigned long red_mask,
+                                      unsigned long green_mask,
+                                      unsigned long blue_mask,
+                                      const XColor& colour);
+
   // Retrieve an int resource.
   int GetInt(IR r);
 
@@ -762,6 +1062,11 @@ class Resources {
     std::string ai = Get(APP_ICON);
     return !strcmp(ai.c_str(), "both") || !strcmp(ai.c_str(), "menu");
   }
+  // Whether title bars are drawn via a cached pixmap, rather than directly.
+  bool CachedTitles() {
+    std::string tr = Get(TITLE_RENDERING);
+    return strcmp(tr.c_str(), "direct");
+  }
 
  private:
   Resources();
@@ -776,8 +1081,16 @@ class Resources {
            const char* cls,
            int dflt);
 
+  struct Colour {
+    bool resolved = false;
+    unsigned long pixel = 0;
+    XRenderColor render = {};
+  };
+  const Colour& resolveColour(SR sr);
+
   std::vector<std::string> strings_;
   std::vector<int> ints_;
+  Colour colours_[S_END];
 };
 
 // Implements the built-in debug CLI. This is only available if -debugcli is
@@ -837,19 +1150,47 @@ extern void session_end();
 /* ewmh.cc */
 extern Atom ewmh_atom[];
 extern void ewmh_init();
+// The ewmh_get_ functions fetch a property and apply it, at the cost of a
+// round trip each. Where several are needed at once, it's quicker to make all
+// the ewmh_request_ calls first, then pass the replies to ewmh_parse_.
 extern EWMHWindowType ewmh_get_window_type(Window w);
+extern xlib::async::Reply<xlib::async::Property> ewmh_request_window_type(
+    Window w);
+extern EWMHWindowType ewmh_parse_window_type(
+    const xlib::async::Property& prop);
+struct WindowNameReplies {
+  xlib::async::Reply<xlib::async::Property> net_wm_name;
+  xlib::async::Reply<xlib::async::Property> wm_name;
+};
 extern bool ewmh_get_window_name(Client* c);
+extern WindowNameReplies ewmh_request_window_name(Window w);
+extern bool ewmh_parse_window_name(Client* c, WindowNameReplies* replies);
 extern bool ewmh_get_visible_window_name(Client* c);
-extern xlib::ImageIcon* ewmh_get_window_icon(Client* c);
+extern xlib::async::Reply<xlib::async::Property>
+ewmh_request_visible_window_name(Window w);
+extern bool ewmh_parse_visible_window_name(Client* c,
+                                           const xlib::async::Property& prop);
+extern xlib::async::Reply<xlib::async::Property> ewmh_request_window_icon(
+    Window w);
+extern void ewmh_parse_window_icon(Client* c,
+                                   const xlib::async::Property& prop);
+// Returns the index of the icon we'd best use to make an icon of size target:
+// the smallest which is at least that size, or else the largest.
+extern int ewmh_best_icon(const std::vector<EWMHIconSize>& icons, int target);
 extern bool ewmh_hasframe(Client* c);
 extern void ewmh_set_state(Client* c);
 extern void ewmh_get_state(Client* c);
+extern xlib::async::Reply<xlib::async::Property> ewmh_request_state(Window w);
+extern void ewmh_parse_state(Client* c, const xlib::async::Property& prop);
 extern void ewmh_change_state(Client* c,
                               unsigned long action,
                               unsigned long atom);
 extern void ewmh_set_allowed(Client* c);
 extern void ewmh_set_client_list();
+extern void fix_stack();
 extern void ewmh_get_strut(Client* c);
+extern xlib::async::Reply<xlib::async::Property> ewmh_request_strut(Window w);
+extern void ewmh_parse_strut(Client* c, const xlib::async::Property& prop);
 extern void ewmh_set_strut();
 
 // geometry.cc
@@ -18,6 +18,7 @@
  */
 
 #include <signal.h>
+#include <memory>
 #include <optional>
 
 // These are Motif definitions from Xm/MwmUtil.h, but Motif isn't available
@@ -35,11 +36,13 @@
 #define MWM_DECOR_MAXIMIZE (1L << 6)
 
 #include "lwm.h"
+#include "trace.h"
 
-int getProperty(Window, Atom, Atom, long, unsigned char**);
-int getWindowState(Window, int*);
 // void applyGravity(Client*);
 
+using xlib::async::Property;
+using xlib::async::Reply;
+
 static Point NextAutoPosition(const Area& client_area) {
   // These are static so that the windows aren't all opened at exactly
   // the same place, but rather the opening position advances down and to
@@ -87,27 +90,139 @@ static Point NextAutoPosition(const Area& client_area) {
   return res;
 }
 
-std::optional<bool> motifWouldDecorate(Client* c) {
-  unsigned long* p = 0;
-  if (getProperty(c->window, motif_wm_hints, motif_wm_hints, 5L,
-                  (unsigned char**)&p) <= 0) {
+std::optional<bool> motifWouldDecorate(const Property& prop) {
+  if (!prop.Exists() || prop.nitems < 3) {
     return {};
   }
+  const unsigned long* p = prop.As<unsigned long>();
   if ((p[0] & MWM_HINTS_DECORATIONS) &&
       !(p[2] & (MWM_DECOR_BORDER | MWM_DECOR_ALL))) {
     return false;
   }
-  XFree(p);
   return true;
 }
 
+// The number of 32-bit items in a full WM_HINTS property (ICCCM 4.1.2.4).
+// Xlib's own name for this, NumPropWMHintsElements, is in a private header.
+constexpr long kWMHintsElements = 9;
+
+// The equivalent of XGetWMHints, for a WM_HINTS property we've already got.
+static std::optional<XWMHints> parseWMHints(const Property& prop) {
+  // Old clients may leave off the window group.
+  if (prop.type != XA_WM_HINTS || prop.format != 32 ||
+      prop.nitems < kWMHintsElements - 1) {
+    return {};
+  }
+  const unsigned long* p = prop.As<unsigned long>();
+  XWMHints hints = {};
+  hints.flags = p[0];
+  hints.input = p[1] ? True : False;
+  hints.initial_state = p[2];
+  hints.icon_pixmap = p[3];
+  hints.icon_window = p[4];
+  hints.icon_x = p[5];
+  hints.icon_y = p[6];
+  hints.icon_mask = p[7];
+  if (prop.nitems >= kWMHintsElements) {
+    hints.window_group = p[8];
+  } else {
+    hints.window_group = 0;
+  }
+  return hints;
+}
+
+static void parseProtocols(Client* c, const Property& prop) {
+  if (prop.type != XA_ATOM || prop.format != 32) {
+    return;
+  }
+  const Atom* protocols = prop.As<Atom>();
+  for (unsigned long p = 0; p < prop.nitems; p++) {
+    if (protocols[p] == wm_delete) {
+      c->proto |= Pdelete;
+    } else if (protocols[p] == wm_take_focus) {
+      c->proto |= Ptakefocus;
+    }
+  }
+}
+
+static void parseTransientFor(Client* c, const Property& prop) {
+  // It is vitally important to set c->trans to None if there's no
+  // WM_TRANSIENT_FOR (or we fail to get it).
+  // If this is not done, it causes a really annoying bug in Terminator, such
+  // that if you open a window from another, then open a modal dialog from the
+  // second, then the first window will now start considering the second
+  // terminal to be its 'trans' window. This is caused by the wacky way in
+  // which Java implements modal dialogs.
+  // Anyway, you have been warned: do not remove the setting of c->trans to
+  // None on failure!
+  if (prop.type == XA_WINDOW && prop.format == 32 && prop.nitems > 0) {
+    const Window trans = prop.As<unsigned long>()[0];
+    LOGD(c) << "Transient for window " << WinID(trans);
+    c->trans = trans;
+  } else {
+    c->trans = None;
+  }
+}
+
+static Reply<Property> requestTransientFor(Window w) {
+  return xlib::async::GetProperty(w, XA_WM_TRANSIENT_FOR, XA_WINDOW, 0, 1);
+}
+
+static std::optional<int> parseWindowState(const Property& prop) {
+  if (!prop.Exists() || prop.nitems < 1) {
+    return {};
+  }
+  return int(prop.As<long>()[0]);
+}
+
+// Everything manage() needs to ask the X server about a new window. All the
+// requests are made when this is constructed, so the answers come back in
+// about one round trip, rather than one round trip each.
+struct ManageQueries {
+  explicit ManageQueries(Window w)
+      : window_type(ewmh_request_window_type(w)),
+        state(ewmh_request_state(w)),
+        motif_hints(xlib::async::GetProperty(w, motif_wm_hints, motif_wm_hints,
+                                             0, 5)),
+        shaped(xlib::async::IsShaped(w)),
+        strut(ewmh_request_strut(w)),
+        hints(xlib::async::GetProperty(w, XA_WM_HINTS, XA_WM_HINTS, 0,
+                                       kWMHintsElements)),
+        name(ewmh_request_window_name(w)),
+        visible_name(ewmh_request_visible_window_name(w)),
+        protocols(xlib::async::GetProperty(w, wm_protocols, XA_ATOM, 0,
+                                           1000000)),
+        transient_for(requestTransientFor(w)),
+        window_state(xlib::async::GetProperty(w, wm_state, wm_state, 0, 2)),
+        attr(xlib::async::GetWindowAttributes(w)) {
+    if (Resources::I->ProcessAppIcons()) {
+      icon.emplace(ewmh_request_window_icon(w));
+    }
+  }
+
+  Reply<Property> window_type;
+  Reply<Property> state;
+  Reply<Property> motif_hints;
+  Reply<bool> shaped;
+  Reply<Property> strut;
+  Reply<Property> hints;
+  std::optional<Reply<Property>> icon;
+  WindowNameReplies name;
+  Reply<Property> visible_name;
+  Reply<Property> protocols;
+  Reply<Property> transient_for;
+  Reply<Property> window_state;
+  // This includes the geometry.
+  Reply<XWindowAttributes> attr;
+};
+
 /*ARGSUSED*/
-void manage(Client* c) {
+static void manageWith(Client* c, ManageQueries& q, Window frame) {
   LOGD(c) << ">>> manage";
   // get the EWMH window type, as this might overrule some hints
-  c->wtype = ewmh_get_window_type(c->window);
+  c->wtype = ewmh_parse_window_type(q.window_type.Get());
   // get in the initial EWMH state
-  ewmh_get_state(c);
+  ewmh_parse_state(c, q.state.Get());
   // set EWMH allowable actions, now we intend to manage this window
   ewmh_set_allowed(c);
   // is this window to have a frame?
@@ -121,74 +236,69 @@ void manage(Client* c) {
   // Changed on 2021-02-14 to make Evergreen's auto-completion popup be
   // correctly drawn without borders. Hopefully this won't have any negative
   // side-effects.
-  if (auto motif_decor = motifWouldDecorate(c); motif_decor) {
+  if (auto motif_decor = motifWouldDecorate(q.motif_hints.Get());
+      motif_decor) {
     c->framed = *motif_decor;
   }
-  if (isShaped(c->window)) {
+  if (q.shaped.Get()) {
     c->framed = false;
   }
 
   // get the EWMH strut - if there is one
-  ewmh_get_strut(c);
+  ewmh_parse_strut(c, q.strut.Get());
 
   // Get the hints, window name, and normal hints (see ICCCM section 4.1.2.3).
-  XWMHints* hints = XGetWMHints(dpy, c->window);
-  if (Resources::I->ProcessAppIcons()) {
+  const std::optional<XWMHints> hints = parseWMHints(q.hints.Get());
+  if (q.icon) {
     if (hints) {
       c->SetIcon(xlib::ImageIcon::Create(hints->icon_pixmap, hints->icon_mask));
     }
-    c->SetIcon(ewmh_get_window_icon(c));
+    ewmh_parse_window_icon(c, q.icon->Get());
   }
 
-  getWindowName(c);
-  getVisibleWindowName(c);
+  ewmh_parse_window_name(c, &q.name);
+  ewmh_parse_visible_window_name(c, q.visible_name.Get());
 
   // Scan the list of atoms on WM_PROTOCOLS to see which of the
   // protocols that we understand the client is prepared to
   // participate in. (See ICCCM section 4.1.2.7.)
-  Atom* protocols;
-  int num_protocols;
-  if (XGetWMProtocols(dpy, c->window, &protocols, &num_protocols) != 0) {
-    for (int p = 0; p < num_protocols; p++) {
-      if (protocols[p] == wm_delete) {
-        c->proto |= Pdelete;
-      } else if (protocols[p] == wm_take_focus) {
-        c->proto |= Ptakefocus;
-      }
-    }
-    XFree(protocols);
-  }
+  parseProtocols(c, q.protocols.Get());
 
   // Get the WM_TRANSIENT_FOR property (see ICCCM section 4.1.2.6).
-  getTransientFor(c);
+  parseTransientFor(c, q.transient_for.Get());
 
   // Work out details for the Client structure from the hints.
   if (hints && (hints->flags & InputHint)) {
     c->accepts_focus = hints->input;
   }
 
-  int state;
-  if (!getWindowState(c->window, &state)) {
-    state = hints ? hints->initial_state : NormalState;
-  }
+  const int state = parseWindowState(q.window_state.Get())
+                        .value_or(hints ? hints->initial_state : NormalState);
 
   // Sort out the window's position.
-  xlib::WindowGeometry geom = xlib::XGetGeometry(c->window);
-  if (!geom.ok) {
+  const XWindowAttributes& current_attr = q.attr.Get();
+  if (current_attr.root == None) {
     LOGE() << "Failed to get geometry for " << WinID(c->window);
     return;
   }
+  if (frame && !c->framed) {
+    // Framed by a previous LWM, but not wanting a frame any more.
+    const Rect cr = c->ContentRect();
+    xlib::XReparentWindow(c->window, LScr::I->Root(), cr.xMin, cr.yMin);
+    XDestroyWindow(dpy, frame);
+    frame = 0;
+  }
   // OpenGL programs (according to an old comment in here) can apparently
   // appear with 0 size, while their minimum sizes are larger than this.
   // Therefore, use the client's size limitations to ensure the original
   // size is sane.
-  Rect rect = c->LimitResize(geom.rect);
+  Rect rect = c->LimitResize(Rect::From(current_attr));
 
   // If the position is zero, we assume there's none specified and we have
   // to invent a good position ourselves. However, we only do this for framed
   // windows, as it's perfectly reasonable for a launcher (eg gummiband) to
   // want to place itself at the origin of the screen.
-  if (c->framed && rect.xMin == 0 && rect.yMin == 0) {
+  if (c->framed && !frame && rect.xMin == 0 && rect.yMin == 0) {
     Point p = NextAutoPosition(rect.area());
     rect = Rect::Translate(rect, p);
   }
@@ -196,20 +306,23 @@ void manage(Client* c) {
   // -specified position, or is_initialising was set. Apparently this is
   // in accordance with section 4.1.2.3 of the ICCCM.
 
-  if (hints) {
-    XFree(hints);
-  }
-
-  if (c->framed) {
+  if (frame) {
+    // The window is already where it should be, inside its frame.
+    LScr::I->Adopt(c, frame);
+  } else if (c->framed) {
     c->FurnishAt(rect);
   }
+  // A new frame is created on top of its siblings, but an adopted frame or an
+  // unframed window could be anywhere.
+  LScr::I->GetStacking()->Add(c->framed ? c->parent : c->window,
+                              c->framed && !frame);
+  Deferred::I->Mark(Deferred::STACKING);
 
   // Stupid X11 doesn't let us change border width in the above
   // call. It's a window attribute, but it's somehow second-class.
   //
   // As pointed out by Adrian Colley, we can't change the window
   // border width at all for InputOnly windows.
-  const XWindowAttributes current_attr = xlib::XGetWindowAttributes(c->window);
   if (current_attr.c_class != InputOnly) {
     XSetWindowBorderWidth(dpy, c->window, 0);
   }
@@ -222,7 +335,7 @@ void manage(Client* c) {
   xlib::XChangeWindowAttributes(
       c->window, CWEventMask | CWWinGravity | CWDontPropagate, &attr);
 
-  if (c->framed) {
+  if (c->framed && !frame) {
     xlib::XReparentWindow(c->window, c->parent, borderWidth(),
                           borderWidth() + textHeight());
   }
@@ -250,28 +363,27 @@ void manage(Client* c) {
   LOGD(c) << "<<< manage";
 }
 
-void getTransientFor(Client* c) {
-  Window trans = None;
-  // XGetTransientForHint returns a Status indicating success or failure.
-  // It is important to realise, however, that a zero status does not
-  // necessarily indicate an error, but also occurs when there is no transient
-  // window.
-  // It is therefore vitally important to, on failure, set c->trans to None.
-  // If this is not done, it causes a really annoying bug in Terminator, such
-  // that if you open a window from another, then open a modal dialog from the
-  // second, then the first window will now start considering the second
-  // terminal to be its 'trans' window. This is caused by the wacky way in
-  // which Java implements modal dialogs.
-  // Anyway, you have been warned: do not remove the setting of c->trans to
-  // None on failure!
-  if (XGetTransientForHint(dpy, c->window, &trans)) {
-    LOGD(c) << "Transient for window " << WinID(trans);
-    c->trans = trans;
-  } else {
-    c->trans = None;
+void manage(Client* c, Window frame) {
+  ManageQueries q(c->window);
+  manageWith(c, q, frame);
+}
+
+void manageAll(const std::vector<Client*>& clients,
+               const std::vector<Window>& frames) {
+  std::vector<std::unique_ptr<ManageQueries>> queries;
+  for (Client* c : clients) {
+    queries.push_back(std::make_unique<ManageQueries>(c->window));
+  }
+  for (size_t i = 0; i < clients.size(); i++) {
+    manageWith(clients[i], *queries[i], frames[i]);
+    queries[i].reset();
   }
 }
 
+void getTransientFor(Client* c) {
+  parseTransientFor(c, requestTransientFor(c->window).Get());
+}
+
 void withdraw(Client* c) {
   if (c->parent != LScr::I->Root()) {
     xlib::XUnmapWindow(c->parent);
@@ -294,6 +406,20 @@ void withdraw(Client* c) {
 
 /*ARGSUSED*/
 void Terminate(int signal) {
+  // The trace needs the display to look up atom names.
+  if (Trace::I) {
+    Trace::I->Flush();
+  }
+  ReleaseDisplay();
+  session_end();
+  if (signal) {
+    exit(EXIT_FAILURE);
+  } else {
+    exit(EXIT_SUCCESS);
+  }
+}
+
+void ReleaseDisplay() {
   // Set all clients free.
   Client_FreeAll();
 
@@ -304,34 +430,6 @@ void Terminate(int signal) {
   // inform the error handler that it should ignore them.
   ScopedIgnoreBadMatch ignorer;
   XCloseDisplay(dpy);
-  session_end();
-
-  if (signal == SIGHUP) {
-    forceRestart = true;
-  } else if (signal) {
-    exit(EXIT_FAILURE);
-  } else {
-    exit(EXIT_SUCCESS);
-  }
-}
-
-int getProperty(Window w, Atom a, Atom type, long len, unsigned char** p) {
-  Atom real_type = 0;
-  int format = 0;
-  unsigned long n = 0;
-  unsigned long extra = 0;
-
-  // len is in 32-bit multiples.
-  int status = XGetWindowProperty(dpy, w, a, 0L, len, false, type, &real_type,
-                                  &format, &n, &extra, p);
-  if (status != Success || *p == 0) {
-    return -1;
-  }
-  if (n == 0 && p) {
-    XFree(*p);
-  }
-  // could check real_type, format, extra here...
-  return n;
 }
 
 void getWindowName(Client* c) {
@@ -341,7 +439,7 @@ void getWindowName(Client* c) {
   const std::string old_name = c->Name();
   ewmh_get_window_name(c);
   if (old_name != c->Name()) {
-    c->DrawBorder();
+    Deferred::I->Redraw(c);
   }
 }
 
@@ -352,17 +450,6 @@ void getVisibleWindowName(Client* c) {
   const std::string old_name = c->Name();
   ewmh_get_visible_window_name(c);
   if (old_name != c->Name()) {
-    c->DrawBorder();
-  }
-}
-
-int getWindowState(Window w, int* state) {
-  long* p = 0;
-
-  if (getProperty(w, wm_state, wm_state, 2L, (unsigned char**)&p) <= 0) {
-    return 0;
+    Deferred::I->Redraw(c);
   }
-  *state = (int)*p;
-  XFree(p);
-  return 1;
 }
@@ -17,11 +17,13 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  */
 
+#include <algorithm>
 #include <iostream>
 #include <set>
 
 #include "ewmh.h"
 #include "lwm.h"
+#include "trace.h"
 
 #define MENU_Y_PADDING 6
 
@@ -30,11 +32,38 @@ MousePos getMousePosition() {
   MousePos res;
   memset(&res, 0, sizeof(res));
   int t1, t2;
-  XQueryPointer(dpy, LScr::I->Root(), &root, &child, &res.x, &res.y, &t1, &t2,
-                &res.modMask);
+  const Bool ok = XQueryPointer(dpy, LScr::I->Root(), &root, &child, &res.x,
+                                &res.y, &t1, &t2, &res.modMask);
+  if (Trace::I) {
+    TraceWindowQuery q = {};
+    q.window = LScr::I->Root();
+    q.ok = ok;
+    q.other = child;
+    q.x = res.x;
+    q.y = res.y;
+    q.mask = res.modMask;
+    Trace::I->WindowQuery(TraceQueryPointer, q);
+  }
   return res;
 }
 
+MousePos mousePositionFromEvent(const XEvent* ev) {
+  switch (ev->type) {
+    case ButtonPress:
+    case ButtonRelease:
+      return MousePos{ev->xbutton.x_root, ev->xbutton.y_root,
+                      ev->xbutton.state};
+    case MotionNotify:
+      return MousePos{ev->xmotion.x_root, ev->xmotion.y_root,
+                      ev->xmotion.state};
+    case EnterNotify:
+    case LeaveNotify:
+      return MousePos{ev->xcrossing.x_root, ev->xcrossing.y_root,
+                      ev->xcrossing.state};
+  }
+  return getMousePosition();
+}
+
 // hiddenIDFor returns the parent Window ID for the given client. We have a
 // specially-named function for this so that we don't get confused about which
 // Window ID we're using, as this is used in both Hide and OpenMenu.
@@ -121,6 +150,18 @@ void Hider::Unhide(Client* c) {
   LScr::I->GetFocuser()->FocusClient(c);
 }
 
+void Hider::Reorder(const std::vector<Window>& frames) {
+  std::list<Window> hidden;
+  for (const Window w : frames) {
+    const auto it = std::find(hidden_.begin(), hidden_.end(), w);
+    if (it != hidden_.end()) {
+      hidden.push_back(w);
+      hidden_.erase(it);
+    }
+  }
+  hidden_.splice(hidden_.begin(), hidden);
+}
+
 int menuItemHeight() {
   return textHeight() + MENU_Y_PADDING;
 }
@@ -275,34 +316,47 @@ int Hider::itemAt(int x, int y) const {
   return y / menuItemHeight();
 }
 
-void Hider::Paint() {
-  // We have to repaint from scratch. While this can cause a little flickering,
-  // it's necessary to first blank the window background, so that we don't
-  // corrupt our display when the red highlight box windows open and close over
-  // the top of the menu.
-  XClearWindow(dpy, LScr::I->Menu());
+void Hider::Paint(Region damage) {
+  // Repaint each damaged row from scratch. We can't rely on the server having
+  // cleared the damaged area to the background, as the highlight is drawn
+  // with XOR: drawing it over an already-highlighted row would remove it.
+  // Clearing first also means we don't corrupt our display when the red
+  // highlight box windows open and close over the top of the menu.
   const int itemHeight = menuItemHeight();
-  const auto popup = LScr::I->Menu();
-  const auto gc = LScr::I->GetMenuGC();
   for (int i = 0; i < open_content_.size(); i++) {
     const int y = i * itemHeight;
-    const int textY = y + g_font->ascent + MENU_Y_PADDING / 2;
-    drawString(popup, menuLMargin(), textY, open_content_[i].name,
-               &g_font_popup_colour);
-    // Show a dotted line to separate the last hidden window from the first
-    // non-hidden one.
-    if (!open_content_[i].hidden && (i == 0 || open_content_[i - 1].hidden)) {
-      XSetLineAttributes(dpy, gc, 1, LineOnOffDash, CapButt, JoinMiter);
-      XDrawLine(dpy, popup, gc, 0, y, width_, y);
+    if (XRectInRegion(damage, 0, y, width_, itemHeight) == RectangleOut) {
+      continue;
     }
-
-    Client* c = LScr::I->GetClient(open_content_[i].w);
-    if (c && c->Icon() && Resources::I->AppIconInUnhideMenu()) {
-      c->Icon()->PaintMenu(popup, menuIconXPad(), y + menuIconYPad(),
-                           menuIconSize(), menuIconSize());
+    XClearArea(dpy, LScr::I->Menu(), 0, y, width_, itemHeight, false);
+    paintItem(i);
+    if (i == current_item_) {
+      drawHighlight(i);
     }
   }
-  drawHighlight(current_item_);
+}
+
+void Hider::paintItem(int itemIndex) {
+  const int itemHeight = menuItemHeight();
+  const auto popup = LScr::I->Menu();
+  const auto gc = LScr::I->GetMenuGC();
+  const int i = itemIndex;
+  const int y = i * itemHeight;
+  const int textY = y + g_font->ascent + MENU_Y_PADDING / 2;
+  drawString(popup, menuLMargin(), textY, open_content_[i].name,
+             &g_font_popup_colour);
+  // Show a dotted line to separate the last hidden window from the first
+  // non-hidden one.
+  if (!open_content_[i].hidden && (i == 0 || open_content_[i - 1].hidden)) {
+    XSetLineAttributes(dpy, gc, 1, LineOnOffDash, CapButt, JoinMiter);
+    XDrawLine(dpy, popup, gc, 0, y, width_, y);
+  }
+
+  Client* c = LScr::I->GetClient(open_content_[i].w);
+  if (c && c->Icon() && Resources::I->AppIconInUnhideMenu()) {
+    c->Icon()->PaintMenu(popup, menuIconXPad(), y + menuIconYPad(),
+                         menuIconSize(), menuIconSize());
+  }
 }
 
 void Hider::drawHighlight(int itemIndex) {
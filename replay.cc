@@ -0,0 +1,758 @@
+// lwmreplay replays an X event trace recorded by 'lwm -trace=<file>' (see
+// trace.h) against a fresh LWM, running on a private Xvfb server, and reports
+// how long LWM took to deal with it.
+//
+// Usage:
+//   lwmreplay [-fast] [-v] [-lwm=<path>] [-geometry=<W>x<H>] <trace file>
+//
+// -fast replays the events as quickly as possible, rather than at the speed
+// they were recorded. -v lets LWM's log messages through to stderr. -lwm gives
+// the LWM binary to run (default: ./lwm), and -geometry the size of the Xvfb
+// screen (default: 1920x1080).
+//
+// We can't make the X server repeat exactly what happened, so we act as all
+// of the clients instead, and do whatever they must have done to cause the
+// events LWM saw:
+// - Client windows (those LWM framed or was asked to map) are created with the
+//   geometry and initial properties recorded when LWM first looked at them.
+//   Those which LWM found on start-up are created and mapped before it starts.
+// - MapRequest, ConfigureRequest, CirculateRequest, DestroyNotify and
+//   UnmapNotify are replayed by making the same request on the client window,
+//   and PropertyNotify by setting the property to the value LWM read next.
+// - ClientMessages to the root window are sent again, as clients do.
+// - Pointer, crossing and Expose events are sent with XSendEvent, to whichever
+//   of the client, its frame or the root window they were reported on.
+// Everything else (FocusIn, ReparentNotify, MapNotify and so on) is a
+// consequence of what LWM itself does, so it will happen by itself.
+//
+// Once everything is replayed, we wait for LWM to stop sending requests, then
+// report the wall time, CPU time used by LWM, the number of X requests it sent,
+// and its per-handler latency histograms, which we get from its debug CLI.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#include "log.h"
+#include "trace.h"
+#include "xvfb.h"
+
+namespace {
+
+uint64_t monotonicNanos() {
+  struct timespec spec = {};
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return uint64_t(spec.tv_sec) * 1000000000 + uint64_t(spec.tv_nsec);
+}
+
+void sleepNanos(uint64_t nanos) {
+  struct timespec spec = {time_t(nanos / 1000000000),
+                          long(nanos % 1000000000)};
+  while (nanosleep(&spec, &spec) && errno == EINTR) {
+  }
+}
+
+// Windows come and go during a replay, so errors about them are expected. We
+// just count them.
+int x_errors;
+
+int errorHandler(Display*, XErrorEvent*) {
+  x_errors++;
+  return 0;
+}
+
+// Reads the trace file, returning false (having logged why) on failure.
+bool readTrace(const char* path, std::vector<TraceRecord>* records) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    LOGE() << "Failed to open " << path << ": " << Log::Errno(errno);
+    return false;
+  }
+  TraceHeader hdr = {};
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr.magic, kTraceMagic, sizeof(hdr.magic))) {
+    LOGE() << path << " is not an LWM trace";
+    fclose(f);
+    return false;
+  }
+  if (hdr.version != kTraceVersion || hdr.record_size < sizeof(TraceRecord)) {
+    LOGE() << path << " is a version " << hdr.version << " trace with "
+           << hdr.record_size << "-byte records; we only understand version "
+           << kTraceVersion;
+    fclose(f);
+    return false;
+  }
+  std::vector<unsigned char> buf(hdr.record_size);
+  while (fread(buf.data(), buf.size(), 1, f) == 1) {
+    TraceRecord rec;
+    memcpy(&rec, buf.data(), sizeof(rec));
+    records->push_back(rec);
+  }
+  fclose(f);
+  return true;
+}
+
+template <typename T>
+const T& payload(const TraceRecord& rec) {
+  return *reinterpret_cast<const T*>(rec.payload);
+}
+
+// LWM, running as a child process with its debug CLI on a pair of pipes.
+class LWMProcess {
+ public:
+  // Starts LWM, and waits for it to finish starting up. Returns null on
+  // failure.
+  static LWMProcess* Start(const std::string& path,
+                           const std::string& display,
+                           bool verbose) {
+    int in[2], out[2];
+    if (pipe(in) || pipe(out)) {
+      LOGE() << "Failed to create pipes for LWM: " << Log::Errno(errno);
+      return nullptr;
+    }
+    const pid_t pid = fork();
+    if (pid < 0) {
+      LOGE() << "Failed to fork for LWM: " << Log::Errno(errno);
+      return nullptr;
+    }
+    if (pid == 0) {
+      dup2(in[0], STDIN_FILENO);
+      dup2(out[1], STDOUT_FILENO);
+      if (!verbose) {
+        const int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDERR_FILENO);
+      }
+      close(in[0]);
+      close(in[1]);
+      close(out[0]);
+      close(out[1]);
+      setenv("DISPLAY", display.c_str(), 1);
+      execl(path.c_str(), path.c_str(), "-debugcli", nullptr);
+      LOGE() << "Failed to run " << path << ": " << Log::Errno(errno);
+      _exit(EXIT_FAILURE);
+    }
+    close(in[0]);
+    close(out[1]);
+    LWMProcess* res = new LWMProcess(pid, in[1], out[0]);
+    // The debug CLI only prints its first prompt once LWM has started up and
+    // is about to enter its main loop.
+    if (!res->readUntilPrompt(nullptr)) {
+      LOGE() << "LWM exited during start-up";
+      delete res;
+      return nullptr;
+    }
+    return res;
+  }
+
+  ~LWMProcess() {
+    close(in_fd_);
+    close(out_fd_);
+    if (pid_) {
+      kill(pid_, SIGKILL);
+      waitpid(pid_, nullptr, 0);
+    }
+  }
+
+  // Runs a debug CLI command, returning its output.
+  std::string Command(const std::string& cmd) {
+    const std::string line = cmd + "\n";
+    if (write(in_fd_, line.data(), line.size()) != ssize_t(line.size())) {
+      LOGE() << "Failed to send '" << cmd << "' to LWM: " << Log::Errno(errno);
+      return "";
+    }
+    std::string res;
+    readUntilPrompt(&res);
+    return res;
+  }
+
+  // Returns the number of X requests LWM has sent, according to its debug
+  // CLI's 'loop' command.
+  uint64_t Requests() {
+    const std::string out = Command("loop");
+    const size_t end = out.find(" X requests sent");
+    if (end == std::string::npos) {
+      return 0;
+    }
+    const size_t start = out.rfind('\n', end);
+    return strtoull(out.c_str() + (start == std::string::npos ? 0 : start + 1),
+                    nullptr, 10);
+  }
+
+  // Asks LWM to exit, and returns its resource usage over its lifetime.
+  struct rusage Stop() {
+    struct rusage ru = {};
+    kill(pid_, SIGTERM);
+    wait4(pid_, nullptr, 0, &ru);
+    pid_ = 0;
+    return ru;
+  }
+
+ private:
+  LWMProcess(pid_t pid, int in_fd, int out_fd)
+      : pid_(pid), in_fd_(in_fd), out_fd_(out_fd) {}
+
+  // Reads LWM's stdout until its "> " prompt appears. Returns false if LWM
+  // goes away first.
+  bool readUntilPrompt(std::string* out) {
+    std::string buf;
+    while (buf.size() < 2 || buf.compare(buf.size() - 2, 2, "> ")) {
+      char tmp[4096];
+      const ssize_t n = read(out_fd_, tmp, sizeof(tmp));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      buf.append(tmp, n);
+    }
+    if (out) {
+      *out = buf.substr(0, buf.size() - 2);
+    }
+    return true;
+  }
+
+  pid_t pid_;
+  const int in_fd_;
+  const int out_fd_;
+};
+
+// Replayer holds the mapping between the windows and atoms in the trace and
+// those on our X server, and replays the trace's events.
+class Replayer {
+ public:
+  Replayer(Display* dpy, const std::vector<TraceRecord>& records)
+      : dpy_(dpy),
+        root_(DefaultRootWindow(dpy)),
+        net_wm_state_(XInternAtom(dpy, "_NET_WM_STATE", false)),
+        records_(records) {}
+
+  // Scans the trace to find the client windows, their initial state, and
+  // the atom names. Returns the clients which already existed when the trace
+  // started.
+  std::vector<uint32_t> Scan();
+
+  // Creates and maps a client window which existed before LWM started.
+  void CreateExisting(uint32_t w) { XMapWindow(dpy_, clientWindow(w)); }
+
+  // Replays the events. If fast is false, the original timing is kept.
+  void Replay(bool fast);
+
+  int Replayed() const { return replayed_; }
+  int Skipped() const { return skipped_; }
+
+ private:
+  struct InitialState {
+    int x = 0, y = 0;
+    unsigned width = 200, height = 200;
+    // Indices of the first successful property read for each property.
+    std::map<uint32_t, size_t> properties;
+  };
+
+  // Replays the event in records_[i]. Returns false if it's not something we
+  // can (or need to) replay.
+  bool replayEvent(size_t i);
+
+  // Sets a property as recorded in the given TracePropertyQuery.
+  void setProperty(Window w, const TracePropertyQuery& q);
+
+  // Translates a window from the trace, returning 0 if it's not one we know.
+  // Client windows are created if necessary; frames are looked up as the
+  // parent of the client window.
+  Window window(uint32_t w);
+  Window clientWindow(uint32_t w);
+  Atom atom(uint32_t a);
+
+  Display* const dpy_;
+  const Window root_;
+  const Atom net_wm_state_;
+  const std::vector<TraceRecord>& records_;
+
+  uint32_t trace_root_ = 0;
+  std::map<uint32_t, InitialState> clients_;
+  std::map<uint32_t, uint32_t> frames_;  // Trace frame -> trace client.
+  std::map<uint32_t, std::string> atom_names_;
+  std::map<uint32_t, Atom> atoms_;
+  std::map<uint32_t, Window> windows_;  // Trace client -> our window.
+  int replayed_ = 0;
+  int skipped_ = 0;
+};
+
+std::vector<uint32_t> Replayer::Scan() {
+  std::set<uint32_t> map_requested;
+  std::vector<uint32_t> existing;
+  for (size_t i = 0; i < records_.size(); i++) {
+    const TraceRecord& rec = records_[i];
+    switch (rec.kind) {
+      case TraceXEvent: {
+        const XEvent& ev = payload<XEvent>(rec);
+        if (ev.type == MapRequest) {
+          map_requested.insert(ev.xmaprequest.window);
+          clients_[ev.xmaprequest.window];
+          trace_root_ = ev.xmaprequest.parent;
+        }
+        break;
+      }
+      case TraceFrame: {
+        const TraceWindowQuery& q = payload<TraceWindowQuery>(rec);
+        frames_[q.other] = q.window;
+        if (!map_requested.count(q.window) && !clients_.count(q.window)) {
+          existing.push_back(q.window);
+        }
+        clients_[q.window];
+        break;
+      }
+      case TraceAtomName: {
+        const TraceAtom& ta = payload<TraceAtom>(rec);
+        atom_names_[ta.atom] = std::string(ta.name, ta.len);
+        break;
+      }
+      case TraceQueryTree: {
+        const TraceTreeQuery& q = payload<TraceTreeQuery>(rec);
+        if (!trace_root_) {
+          trace_root_ = q.root;
+        }
+        break;
+      }
+    }
+  }
+  // Now we know which windows are clients, pick up their initial state from
+  // the first time LWM looked at them.
+  std::set<uint32_t> have_geometry;
+  for (size_t i = 0; i < records_.size(); i++) {
+    const TraceRecord& rec = records_[i];
+    if (rec.kind == TraceAttributes || rec.kind == TraceGeometry) {
+      const TraceWindowQuery& q = payload<TraceWindowQuery>(rec);
+      auto it = clients_.find(q.window);
+      if (q.ok && it != clients_.end() && !have_geometry.count(q.window)) {
+        have_geometry.insert(q.window);
+        it->second.x = q.x;
+        it->second.y = q.y;
+        it->second.width = q.width ? q.width : 1;
+        it->second.height = q.height ? q.height : 1;
+      }
+    } else if (rec.kind == TraceProperty) {
+      const TracePropertyQuery& q = payload<TracePropertyQuery>(rec);
+      auto it = clients_.find(q.window);
+      if (q.status == Success && q.type != None && it != clients_.end()) {
+        it->second.properties.insert(std::make_pair(q.property, i));
+      }
+    }
+  }
+  return existing;
+}
+
+Atom Replayer::atom(uint32_t a) {
+  if (a <= XA_LAST_PREDEFINED) {
+    return a;
+  }
+  auto it = atoms_.find(a);
+  if (it != atoms_.end()) {
+    return it->second;
+  }
+  Atom res = None;
+  auto name = atom_names_.find(a);
+  if (name != atom_names_.end()) {
+    res = XInternAtom(dpy_, name->second.c_str(), false);
+  }
+  atoms_[a] = res;
+  return res;
+}
+
+Window Replayer::clientWindow(uint32_t w) {
+  auto it = windows_.find(w);
+  if (it != windows_.end()) {
+    return it->second;
+  }
+  const InitialState& st = clients_[w];
+  XSetWindowAttributes attr = {};
+  attr.background_pixel = WhitePixel(dpy_, DefaultScreen(dpy_));
+  const Window res = XCreateWindow(
+      dpy_, root_, st.x, st.y, st.width, st.height, 0, CopyFromParent,
+      InputOutput, CopyFromParent, CWBackPixel, &attr);
+  windows_[w] = res;
+  for (const auto& prop : st.properties) {
+    setProperty(res, payload<TracePropertyQuery>(records_[prop.second]));
+  }
+  return res;
+}
+
+Window Replayer::window(uint32_t w) {
+  if (w == 0) {
+    return 0;
+  }
+  if (w == trace_root_) {
+    return root_;
+  }
+  if (clients_.count(w)) {
+    return clientWindow(w);
+  }
+  auto frame = frames_.find(w);
+  if (frame == frames_.end() || !windows_.count(frame->second)) {
+    return 0;
+  }
+  Window root = 0, parent = 0;
+  Window* children = nullptr;
+  unsigned int num_children = 0;
+  if (!XQueryTree(dpy_, windows_[frame->second], &root, &parent, &children,
+                  &num_children)) {
+    return 0;
+  }
+  if (children) {
+    XFree(children);
+  }
+  return parent == root_ ? 0 : parent;
+}
+
+void Replayer::setProperty(Window w, const TracePropertyQuery& q) {
+  const Atom prop = atom(q.property);
+  const Atom type = atom(q.type);
+  if (!prop || !type) {
+    return;
+  }
+  // Only part of the value may have been recorded; set what we have.
+  const size_t item_size = q.format == 32   ? sizeof(long)
+                           : q.format == 16 ? sizeof(short)
+                                            : 1;
+  std::vector<unsigned char> data(q.data, q.data + q.data_len);
+  const int n = q.data_len / item_size;
+  if (q.format == 32 && (type == XA_ATOM || type == XA_WINDOW)) {
+    long* items = reinterpret_cast<long*>(data.data());
+    for (int i = 0; i < n; i++) {
+      items[i] = (type == XA_ATOM) ? atom(items[i]) : window(items[i]);
+    }
+  }
+  XChangeProperty(dpy_, w, prop, type, q.format, PropModeReplace, data.data(),
+                  n);
+}
+
+bool Replayer::replayEvent(size_t i) {
+  XEvent ev = payload<XEvent>(records_[i]);
+  ev.xany.display = dpy_;
+  ev.xany.send_event = true;
+  switch (ev.type) {
+    case MapRequest:
+      XMapWindow(dpy_, clientWindow(ev.xmaprequest.window));
+      return true;
+
+    case ConfigureRequest: {
+      const XConfigureRequestEvent& e = ev.xconfigurerequest;
+      if (!clients_.count(e.window)) {
+        return false;
+      }
+      XWindowChanges wc = {};
+      wc.x = e.x;
+      wc.y = e.y;
+      wc.width = e.width;
+      wc.height = e.height;
+      wc.border_width = e.border_width;
+      wc.sibling = window(e.above);
+      wc.stack_mode = e.detail;
+      unsigned long mask = e.value_mask;
+      if (!wc.sibling) {
+        mask &= ~CWSibling;
+      }
+      XConfigureWindow(dpy_, clientWindow(e.window), mask, &wc);
+      return true;
+    }
+
+    case CirculateRequest: {
+      const XCirculateRequestEvent& e = ev.xcirculaterequest;
+      if (!clients_.count(e.window)) {
+        return false;
+      }
+      if (e.place == PlaceOnTop) {
+        XRaiseWindow(dpy_, clientWindow(e.window));
+      } else {
+        XLowerWindow(dpy_, clientWindow(e.window));
+      }
+      return true;
+    }
+
+    case DestroyNotify: {
+      auto it = windows_.find(ev.xdestroywindow.window);
+      if (it == windows_.end()) {
+        return false;
+      }
+      XDestroyWindow(dpy_, it->second);
+      windows_.erase(it);
+      return true;
+    }
+
+    case UnmapNotify: {
+      // As in LWM, unmaps reported to the root are from reparenting.
+      const XUnmapEvent& e = ev.xunmap;
+      auto it = windows_.find(e.window);
+      if (it == windows_.end() || e.event == trace_root_) {
+        return false;
+      }
+      XUnmapWindow(dpy_, it->second);
+      return true;
+    }
+
+    case PropertyNotify: {
+      const XPropertyEvent& e = ev.xproperty;
+      if (!clients_.count(e.window)) {
+        return false;
+      }
+      const Window w = clientWindow(e.window);
+      if (e.state == PropertyDelete) {
+        XDeleteProperty(dpy_, w, atom(e.atom));
+        return true;
+      }
+      // LWM will normally read the new value straight away, so we can find
+      // out what it was.
+      for (size_t j = i + 1; j < records_.size(); j++) {
+        const TraceRecord& rec = records_[j];
+        if (rec.kind == TraceXEvent) {
+          break;
+        }
+        if (rec.kind != TraceProperty) {
+          continue;
+        }
+        const TracePropertyQuery& q = payload<TracePropertyQuery>(rec);
+        if (q.window == e.window && q.property == e.atom &&
+            q.status == Success && q.type != None) {
+          setProperty(w, q);
+          return true;
+        }
+      }
+      // Otherwise, just poke the property so that the event happens. Appending
+      // nothing only works if we use the property's existing type.
+      const Atom prop = atom(e.atom);
+      Atom type = None;
+      int format = 0;
+      unsigned long n = 0, extra = 0;
+      unsigned char* data = nullptr;
+      XGetWindowProperty(dpy_, w, prop, 0, 0, false, AnyPropertyType, &type,
+                         &format, &n, &extra, &data);
+      if (data) {
+        XFree(data);
+      }
+      if (type == None) {
+        type = XA_CARDINAL;
+        format = 32;
+      }
+      XChangeProperty(dpy_, w, prop, type, format, PropModeAppend, nullptr, 0);
+      return true;
+    }
+
+    case ClientMessage: {
+      XClientMessageEvent& e = ev.xclient;
+      e.window = window(e.window);
+      e.message_type = atom(e.message_type);
+      if (!e.window || !e.message_type) {
+        return false;
+      }
+      if (e.format == 32 && e.message_type == net_wm_state_) {
+        e.data.l[1] = atom(e.data.l[1]);
+        e.data.l[2] = atom(e.data.l[2]);
+      }
+      XSendEvent(dpy_, root_, false,
+                 SubstructureRedirectMask | SubstructureNotifyMask, &ev);
+      return true;
+    }
+
+    case ButtonPress:
+    case ButtonRelease:
+    case MotionNotify:
+    case EnterNotify:
+    case LeaveNotify: {
+      // The pointer events all start with the same fields, so we can treat
+      // them all as button events.
+      XButtonEvent& e = ev.xbutton;
+      const Window w = window(e.window);
+      if (!w) {
+        return false;
+      }
+      e.window = w;
+      e.root = root_;
+      e.subwindow = window(e.subwindow);
+      long mask = 0;
+      switch (ev.type) {
+        case ButtonPress:
+          mask = ButtonPressMask;
+          break;
+        case ButtonRelease:
+          mask = ButtonReleaseMask;
+          break;
+        case MotionNotify:
+          mask = PointerMotionMask | ButtonMotionMask;
+          break;
+        case EnterNotify:
+          mask = EnterWindowMask;
+          break;
+        case LeaveNotify:
+          mask = LeaveWindowMask;
+          break;
+      }
+      XSendEvent(dpy_, w, false, mask, &ev);
+      return true;
+    }
+
+    case Expose: {
+      const Window w = window(ev.xexpose.window);
+      if (!w) {
+        return false;
+      }
+      ev.xexpose.window = w;
+      XSendEvent(dpy_, w, false, ExposureMask, &ev);
+      return true;
+    }
+  }
+  return false;
+}
+
+void Replayer::Replay(bool fast) {
+  const uint64_t start = monotonicNanos();
+  uint64_t first = 0;
+  bool have_first = false;
+  for (size_t i = 0; i < records_.size(); i++) {
+    const TraceRecord& rec = records_[i];
+    if (rec.kind != TraceXEvent) {
+      continue;
+    }
+    if (!fast) {
+      if (!have_first) {
+        first = rec.nanos;
+        have_first = true;
+      }
+      const uint64_t due = start + (rec.nanos - first);
+      const uint64_t now = monotonicNanos();
+      if (due > now) {
+        XFlush(dpy_);
+        sleepNanos(due - now);
+      }
+    }
+    if (replayEvent(i)) {
+      replayed_++;
+    } else {
+      skipped_++;
+    }
+  }
+  XSync(dpy_, false);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  bool fast = false;
+  bool verbose = false;
+  std::string lwm = "./lwm";
+  int width = 1920, height = 1080;
+  const char* trace = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-fast")) {
+      fast = true;
+    } else if (!strcmp(argv[i], "-v")) {
+      verbose = true;
+    } else if (!strncmp(argv[i], "-lwm=", 5)) {
+      lwm = argv[i] + 5;
+    } else if (!strncmp(argv[i], "-geometry=", 10)) {
+      if (sscanf(argv[i] + 10, "%dx%d", &width, &height) != 2) {
+        LOGF() << "Bad geometry " << argv[i] + 10;
+      }
+    } else if (argv[i][0] != '-' && !trace) {
+      trace = argv[i];
+    } else {
+      LOGF() << "Usage: " << argv[0]
+             << " [-fast] [-v] [-lwm=<path>] [-geometry=<W>x<H>] <trace>";
+    }
+  }
+  if (!trace) {
+    LOGF() << "No trace file given";
+  }
+  // Don't die if LWM does, while we're writing to its debug CLI.
+  signal(SIGPIPE, SIG_IGN);
+  std::vector<TraceRecord> records;
+  if (!readTrace(trace, &records)) {
+    return EXIT_FAILURE;
+  }
+
+  Xvfb* xvfb = Xvfb::Start(width, height);
+  if (!xvfb) {
+    return EXIT_FAILURE;
+  }
+  Display* dpy = XOpenDisplay(xvfb->DisplayName().c_str());
+  if (!dpy) {
+    LOGE() << "Can't open Xvfb display " << xvfb->DisplayName();
+    delete xvfb;
+    return EXIT_FAILURE;
+  }
+  XSetErrorHandler(errorHandler);
+
+  Replayer replayer(dpy, records);
+  for (uint32_t w : replayer.Scan()) {
+    replayer.CreateExisting(w);
+  }
+  XSync(dpy, false);
+
+  LWMProcess* proc = LWMProcess::Start(lwm, xvfb->DisplayName(), verbose);
+  if (!proc) {
+    delete xvfb;
+    return EXIT_FAILURE;
+  }
+  proc->Command("latency reset");
+  const uint64_t requests_before = proc->Requests();
+  const uint64_t start = monotonicNanos();
+
+  replayer.Replay(fast);
+
+  // Wait for LWM to catch up: once it has stopped sending requests for a
+  // while, it has dealt with everything. The wall time runs until we last
+  // saw it send one, not until we gave up waiting for more.
+  constexpr uint64_t kPollNanos = 10 * 1000000;
+  constexpr uint64_t kQuietNanos = 50 * 1000000;
+  uint64_t requests = proc->Requests();
+  uint64_t last_change = monotonicNanos();
+  for (;;) {
+    sleepNanos(kPollNanos);
+    const uint64_t now = proc->Requests();
+    const uint64_t t = monotonicNanos();
+    if (now != requests) {
+      requests = now;
+      last_change = t;
+    } else if (t - last_change >= kQuietNanos) {
+      break;
+    }
+  }
+  const uint64_t wall = last_change - start;
+  const std::string latency = proc->Command("latency");
+  const struct rusage ru = proc->Stop();
+  delete proc;
+  XCloseDisplay(dpy);
+  delete xvfb;
+
+  std::cout << "events replayed: " << replayer.Replayed() << " ("
+            << replayer.Skipped() << " not replayable)\n";
+  std::cout << "X errors (expected for vanishing windows): " << x_errors
+            << "\n";
+  std::cout << "wall time: " << wall / 1000000 << "ms"
+            << (fast ? "" : " (at recorded speed)") << "\n";
+  std::cout << "lwm CPU time (whole run): user "
+            << ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000
+            << "ms, system "
+            << ru.ru_stime.tv_sec * 1000 + ru.ru_stime.tv_usec / 1000
+            << "ms\n";
+  std::cout << "lwm X requests: " << requests - requests_before << "\n";
+  std::cout << latency;
+  return EXIT_SUCCESS;
+}
@@ -81,6 +81,10 @@ Resources::Resources() {
   // Valid values are "none", "title" (title bars of windows), "menu" (the
   // unhide menu) or "both" (both title bars and unhide menu).
   Set(APP_ICON, db, "appIcon", "String", "both");
+  // How title bars are drawn: "cached" keeps each one in a pixmap per focus
+  // state, only redrawn when the title, icon or width changes; "direct" draws
+  // straight into the frame every time.
+  Set(TITLE_RENDERING, db, "titleRendering", "String", "cached");
 
   // The width of the border LWM adds to each window to allow resizing.
   Set(BORDER_WIDTH, db, "border", "Border", 6);
@@ -99,6 +103,18 @@ Resources::Resources() {
   // and you may get annoyingly long delays between when you expect to see
   // focus change, and when it does.
   Set(FOCUS_DELAY_MILLIS, db, "focusDelayMillis", "Border", 50);
+
+  // The maximum number of times per second a window being interactively moved
+  // or resized will be updated. We never update more often than the refresh
+  // rate of the monitor the window is on, as there's no point; this allows the
+  // rate to be limited further (eg for clients which are slow to redraw).
+  // Zero means no limit other than the monitor's refresh rate.
+  Set(MAX_DRAG_RATE, db, "maxDragRate", "Rate", 0);
+
+  // How much X server memory, in KiB, the pixmaps of cached application icons
+  // may use. Icons in use are always kept; others are thrown away, least
+  // recently used first, once the cache grows beyond this.
+  Set(ICON_CACHE_KB, db, "iconCacheKB", "Size", 1024);
 }
 
 const std::string& Resources::Get(SR sr) {
@@ -112,25 +128,61 @@ const std::string& Resources::Get(SR sr) {
   return strings_[sr];
 }
 
-unsigned long Resources::GetColour(SR sr) {
+// static
+unsigned long Resources::TrueColorPixel(unsigned long red_mask,
+                                        unsigned long green_mask,
+                                        unsigned long blue_mask,
+                                        const XColor& colour) {
+  // Take as many of the top bits of each 16-bit component as the mask has,
+  // and shift them to where the mask is.
+  const auto component = [](unsigned short value, unsigned long mask) {
+    if (!mask) {
+      return 0UL;
+    }
+    const int shift = __builtin_ctzl(mask);
+    const int bits = __builtin_popcountl(mask);
+    return ((unsigned long)(value >> (16 - bits)) << shift) & mask;
+  };
+  return component(colour.red, red_mask) | component(colour.green, green_mask) |
+         component(colour.blue, blue_mask);
+}
+
+const Resources::Colour& Resources::resolveColour(SR sr) {
+  if (sr < S_BEGIN || sr >= S_END) {
+    sr = S_BEGIN;  // As for Get, this will resolve the empty string.
+  }
+  Colour& res = colours_[sr];
+  if (res.resolved) {
+    return res;
+  }
+  res.resolved = true;
   const std::string name = Get(sr);
-  XColor colour, exact;
-  XAllocNamedColor(dpy, DefaultColormap(dpy, LScr::kOnlyScreenIndex),
-                   name.c_str(), &colour, &exact);
-  return colour.pixel;
+  const Colormap cmap = DefaultColormap(dpy, LScr::kOnlyScreenIndex);
+  const Visual* visual = DefaultVisual(dpy, LScr::kOnlyScreenIndex);
+  XColor colour = {};
+  if (visual->c_class == TrueColor) {
+    // The pixel value follows directly from the colour, so there's no need to
+    // ask the server to allocate it. "#rrggbb" colours are parsed without a
+    // round trip; names have to be looked up in the server's database.
+    if (XParseColor(dpy, cmap, name.c_str(), &colour)) {
+      colour.pixel = TrueColorPixel(visual->red_mask, visual->green_mask,
+                                    visual->blue_mask, colour);
+    }
+  } else {
+    XColor exact;
+    XAllocNamedColor(dpy, cmap, name.c_str(), &colour, &exact);
+  }
+  res.pixel = colour.pixel;
+  res.render = XRenderColor{colour.red, colour.green, colour.blue, 0xffff};
+  return res;
 }
 
-// Returns a short comprising two copies of the lowest byte in c.
-// This converts an 8-bit r, g or b component into a 16-bit value as required
-// by XRenderColor.
-unsigned short extend(unsigned long c) {
-  unsigned short result = c & 0xff;
-  return result | (result << 8);
+unsigned long Resources::GetColour(SR sr) {
+  return resolveColour(sr).pixel;
 }
 
 XRenderColor Resources::GetXRenderColor(SR sr) {
-  const unsigned long rgb = GetColour(sr);
-  return XRenderColor{extend(rgb >> 16), extend(rgb >> 8), extend(rgb), 0xffff};
+  return resolveColour(sr).render;
 }
 
 // Retrieve an int resource.
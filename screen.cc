@@ -1,10 +1,61 @@
+#include <optional>
+#include <vector>
+
 #include "ewmh.h"
+#include "handoff.h"
 #include "lwm.h"
+#include "trace.h"
 #include "xlib.h"
 
+using xlib::async::Property;
+using xlib::async::Reply;
+
 // The static LScr instance.
 LScr* LScr::I;
 
+// WM_NORMAL_HINTS is 18 longs; ICCCM 1 clients only write the first 15.
+constexpr long kNormalHintsElements = 18;
+constexpr long kOldNormalHintsElements = 15;
+
+// The equivalent of XGetWMNormalHints, split so that the request can be made
+// before the answer is needed.
+static Reply<Property> requestNormalHints(Window w) {
+  return xlib::async::GetProperty(w, XA_WM_NORMAL_HINTS, XA_WM_SIZE_HINTS, 0,
+                                  kNormalHintsElements);
+}
+
+static std::optional<XSizeHints> parseNormalHints(const Property& prop) {
+  if (prop.type != XA_WM_SIZE_HINTS || prop.format != 32 ||
+      prop.nitems < kOldNormalHintsElements) {
+    return {};
+  }
+  const long* p = prop.As<long>();
+  XSizeHints hints = {};
+  hints.flags = p[0];
+  hints.x = p[1];
+  hints.y = p[2];
+  hints.width = p[3];
+  hints.height = p[4];
+  hints.min_width = p[5];
+  hints.min_height = p[6];
+  hints.max_width = p[7];
+  hints.max_height = p[8];
+  hints.width_inc = p[9];
+  hints.height_inc = p[10];
+  hints.min_aspect.x = p[11];
+  hints.min_aspect.y = p[12];
+  hints.max_aspect.x = p[13];
+  hints.max_aspect.y = p[14];
+  if (prop.nitems >= kNormalHintsElements) {
+    hints.base_width = p[15];
+    hints.base_height = p[16];
+    hints.win_gravity = p[17];
+  } else {
+    hints.flags &= ~(PBaseSize | PWinGravity);
+  }
+  return hints;
+}
+
 LScr::LScr(Display* dpy)
     : dpy_(dpy),
       root_(RootWindow(dpy, kOnlyScreenIndex)),
@@ -12,10 +63,19 @@ LScr::LScr(Display* dpy)
       height_(DisplayHeight(dpy, kOnlyScreenIndex)),
       cursor_map_(new CursorMap(dpy)),
       utf8_string_atom_(XInternAtom(dpy, "UTF8_STRING", false)),
+      lwm_frame_atom_(XInternAtom(dpy, "_LWM_FRAME", false)),
       strut_{0, 0, 0, 0} {
   visible_areas_ = std::vector<Rect>(1, Rect{0, 0, width_, height_});
 }
 
+void LScr::HandOver() {
+  for (GC gc : {gc_, inactive_gc_, menu_gc_, title_gc_, border_gc_,
+                inactive_border_gc_, copy_gc_}) {
+    XFreeGC(dpy_, gc);
+  }
+  cursor_map_->Free(dpy_);
+}
+
 void LScr::Init() {
   active_border_ = Resources::I->GetColour(Resources::BORDER_COLOUR);
   inactive_border_ = Resources::I->GetColour(Resources::INACTIVE_BORDER_COLOUR);
@@ -50,6 +110,19 @@ void LScr::Init() {
   gv.foreground = Resources::I->GetColour(Resources::TITLE_BG_COLOUR);
   title_gc_ = XCreateGC(dpy_, root_, gv_mask, &gv);
 
+  // Plain fills in the border colours, for backgrounds drawn off-screen.
+  gv.foreground = active_border_;
+  border_gc_ = XCreateGC(dpy_, root_, GCForeground, &gv);
+  gv.foreground = inactive_border_;
+  inactive_border_gc_ = XCreateGC(dpy_, root_, GCForeground, &gv);
+
+  // For copying icons and cached furniture from pixmaps. The sources are
+  // always our own pixmaps, which can't be obscured, so we never need to hear
+  // about GraphicsExposes (or be sent a NoExpose after every copy).
+  gv.function = GXcopy;
+  gv.graphics_exposures = false;
+  copy_gc_ = XCreateGC(dpy_, root_, GCFunction | GCGraphicsExposures, &gv);
+
   // Create the popup window, to be used for the resize feedback window,
   // and the menu window.
   XSetWindowAttributes attr;
@@ -119,19 +192,83 @@ void LScr::InitEWMH() {
 
 void LScr::ScanWindowTree() {
   xlib::WindowTree wt = xlib::WindowTree::Query(dpy_, root_);
+  std::vector<Window> top;
+  std::vector<Reply<Property>> frame_props;
   for (const Window w : wt.children) {
-    if (!xlib::IsLWMWindow(w)) {
-      AddClient(w, true);
+    tree_.Created(w, root_);
+    if (xlib::IsLWMWindow(w)) {
+      continue;
+    }
+    top.push_back(w);
+    frame_props.push_back(
+        xlib::async::GetProperty(w, lwm_frame_atom_, XA_CARDINAL, 0, 2));
+  }
+  std::vector<Window> windows;
+  std::vector<const HandoffClient*> adopts;
+  for (size_t i = 0; i < top.size(); i++) {
+    Window w = top[i];
+    const Property frame = frame_props[i].Get();
+    // After a restart, the top-level windows are mostly the old LWM's frames.
+    const HandoffClient* adopt = Handoff::I ? Handoff::I->Find(w) : nullptr;
+    if (adopt) {
+      w = adopt->window;
+    } else if (frame.type == XA_CARDINAL && frame.format == 32 &&
+               frame.nitems == 2) {
+      // A frame nobody handed over to us. Frames made by an LWM we took over
+      // from belong to its connection, not the one that died, so the server
+      // didn't put the client back on the root for us.
+      w = unwrapFrame(w, frame.As<long>()[0], frame.As<long>()[1]);
+      if (!w) {
+        continue;
+      }
+    }
+    windows.push_back(w);
+    adopts.push_back(adopt);
+  }
+  // Ask about all the windows before looking at any of the answers, both
+  // here and in manageAll, so that taking over a few hundred windows (say
+  // after another window manager has crashed) costs a handful of round trips,
+  // rather than several per window.
+  std::vector<Reply<XWindowAttributes>> attrs;
+  std::vector<Reply<Property>> size_hints;
+  for (const Window w : windows) {
+    attrs.push_back(xlib::async::GetWindowAttributes(w));
+    size_hints.push_back(requestNormalHints(w));
+  }
+  std::vector<Client*> clients;
+  std::vector<Window> frames;
+  for (size_t i = 0; i < windows.size(); i++) {
+    Client* c = newClient(windows[i], attrs[i].Get(), size_hints[i].Get(),
+                          true, adopts[i]);
+    if (c) {
+      clients_[c->window] = c;
+      clients.push_back(c);
+      frames.push_back(adopts[i] ? adopts[i]->frame : 0);
     }
   }
-  // Tell all the clients they don't have input focus. This has two effects:
-  // 1: the client will respond by drawing its border (always)
-  // 2: if we're in click-to-focus mode, the client will grab input events, so
-  //    that it can detect clicks within the window being managed.
-  // We do that now, after we've scanned the window tree, so everything is in
-  // its final state.
-  for (auto it : clients_) {
-    it.second->FocusLost();
+  // manage() tells each client it doesn't have input focus, which makes it
+  // draw its border, and in click-to-focus mode, grab clicks on its window.
+  manageAll(clients, frames);
+  // Adopted frames and unframed windows are where we found them, and new
+  // frames are above them in the order they were made, which manage() can't
+  // tell Stacking by itself. One more round trip finds out what we've done.
+  stacking_.Seed(xlib::WindowTree::Query(dpy_, root_).children);
+  if (Handoff::I) {
+    std::vector<Window> hidden;
+    for (const Window w : Handoff::I->hidden) {
+      if (const Client* c = GetClient(w, false)) {
+        hidden.push_back(c->parent);
+      }
+    }
+    hider_.Reorder(hidden);
+    std::vector<Client*> history;
+    for (const Window w : Handoff::I->focus_history) {
+      Client* c = GetClient(w, false);
+      if (c && !c->hidden) {
+        history.push_back(c);
+      }
+    }
+    focuser_.RestoreHistory(history);
   }
 }
 
@@ -149,39 +286,58 @@ Client* LScr::GetOrAddClient(Window w, bool is_startup_scan) {
 }
 
 Client* LScr::AddClient(Window w, bool is_startup_scan) {
-  const XWindowAttributes attr = xlib::XGetWindowAttributes(w);
+  auto attr = xlib::async::GetWindowAttributes(w);
+  auto size_hints = requestNormalHints(w);
+  Client* c =
+      newClient(w, attr.Get(), size_hints.Get(), is_startup_scan, nullptr);
+  if (!c) {
+    return nullptr;
+  }
+  // Call manage if we know the window is already mapped (scanned at start-up).
+  if (is_startup_scan) {
+    manage(c);
+  }
+  clients_[w] = c;
+  return c;
+}
+
+Client* LScr::newClient(Window w,
+                        const XWindowAttributes& attr,
+                        const Property& size_hints,
+                        bool is_startup_scan,
+                        const HandoffClient* adopt) {
+  const Window frame = adopt ? adopt->frame : 0;
+  if (frame && attr.root == None) {
+    // The window went while we were restarting, leaving its frame behind.
+    XDestroyWindow(dpy_, frame);
+    return nullptr;
+  }
   if (attr.override_redirect) {
     return nullptr;
   }
   // The following check prevents us from making random stuff visible, like the
   // currently-not-visible menu window of gummiband, or the icon-containing
-  // windows of Java apps.
-  if (is_startup_scan && attr.map_state != IsViewable) {
+  // windows of Java apps. Windows in adopted frames are different: they aren't
+  // viewable if they were hidden.
+  if (is_startup_scan && !frame && attr.map_state != IsViewable) {
     return nullptr;
   }
-  XSizeHints size;
-  long msize;
   DimensionLimiter xdl;
   DimensionLimiter ydl;
-  if (XGetWMNormalHints(dpy_, w, &size, &msize)) {
-    xdl = DimensionLimiter(size.flags & PMinSize ? size.min_width : 0,
-                           size.flags & PMaxSize ? size.max_width : 0,
-                           size.flags & PBaseSize ? size.base_width : 0,
-                           size.flags & PResizeInc ? size.width_inc : 1);
-    ydl = DimensionLimiter(size.flags & PMinSize ? size.min_height : 0,
-                           size.flags & PMaxSize ? size.max_height : 0,
-                           size.flags & PBaseSize ? size.base_height : 0,
-                           size.flags & PResizeInc ? size.height_inc : 1);
+  if (const std::optional<XSizeHints> size = parseNormalHints(size_hints)) {
+    xdl = DimensionLimiter(size->flags & PMinSize ? size->min_width : 0,
+                           size->flags & PMaxSize ? size->max_width : 0,
+                           size->flags & PBaseSize ? size->base_width : 0,
+                           size->flags & PResizeInc ? size->width_inc : 1);
+    ydl = DimensionLimiter(size->flags & PMinSize ? size->min_height : 0,
+                           size->flags & PMaxSize ? size->max_height : 0,
+                           size->flags & PBaseSize ? size->base_height : 0,
+                           size->flags & PResizeInc ? size->height_inc : 1);
   }
   Client* c = new Client(w, attr, xdl, ydl);
-  // LOGI() << "New client " << attr.width << "x" << attr.height << "+" <<
-  // attr.x
-  //       << "+" << attr.y << ", g = " << attr.win_gravity;
-  // Call manage if we know the window is already mapped (scanned at start-up).
-  if (is_startup_scan) {
-    manage(c);
+  if (adopt) {
+    c->RestoreState(*adopt);
   }
-  clients_[w] = c;
   return c;
 }
 
@@ -191,6 +347,19 @@ void LScr::Furnish(Client* c) {
   LOGD(c) << "Creating frame for client, at " << c->FrameRect();
   c->parent =
       xlib::CreateNamedWindow(name.str(), c->FrameRect(), 1, black(), white());
+  addFrame(c);
+}
+
+void LScr::Adopt(Client* c, Window frame) {
+  LOGD(c) << "Adopting frame " << WinID(frame) << " at " << c->FrameRect();
+  c->parent = frame;
+  xlib::AdoptNamedWindow(frame);
+  addFrame(c);
+  // We'd usually find this out from the ReparentNotify.
+  tree_.Created(c->window, frame);
+}
+
+void LScr::addFrame(Client* c) {
   XSetWindowAttributes attr;
   // DO NOT SET PointerMotionHintMask! Doing so allows X to send just one
   // notification to the window until the key or button state changes. This
@@ -201,6 +370,53 @@ void LScr::Furnish(Client* c) {
                     SubstructureNotifyMask | PointerMotionMask;
   XChangeWindowAttributes(dpy_, c->parent, CWEventMask, &attr);
   parents_[c->parent] = c;
+  tree_.Created(c->parent, root_);
+  // If we die after handing over, nothing will take the client out of this
+  // frame, so leave enough behind for the next LWM to do it.
+  const long frame_data[2] = {static_cast<long>(c->window),
+                              c->OriginalBorderWidth()};
+  XChangeProperty(dpy_, c->parent, lwm_frame_atom_, XA_CARDINAL, 32,
+                  PropModeReplace, (const unsigned char*)frame_data, 2);
+  if (Trace::I) {
+    // Record the frame, so that a replay can tell which of the events are
+    // about our own windows.
+    TraceWindowQuery q = {};
+    q.window = c->window;
+    q.ok = true;
+    q.other = c->parent;
+    Trace::I->WindowQuery(TraceFrame, q);
+  }
+}
+
+Window LScr::unwrapFrame(Window frame, Window client, int border_width) {
+  auto frame_attr = xlib::async::GetWindowAttributes(frame);
+  auto client_tree = xlib::async::QueryTree(client);
+  auto client_geom = xlib::async::GetGeometry(client);
+  const XWindowAttributes fa = frame_attr.Get();
+  const xlib::WindowTree wt = client_tree.Get();
+  const xlib::WindowGeometry g = client_geom.Get();
+  if (wt.parent != frame || !g.ok) {
+    LOGI() << "Destroying empty frame " << WinID(frame);
+    XDestroyWindow(dpy_, frame);
+    tree_.Destroyed(frame);
+    return 0;
+  }
+  LOGI() << "Taking " << WinID(client) << " out of abandoned frame "
+         << WinID(frame);
+  xlib::XReparentWindow(client, root_, fa.x + fa.border_width + g.rect.xMin,
+                        fa.y + fa.border_width + g.rect.yMin);
+  tree_.Reparented(client, root_);
+  if (fa.map_state != IsViewable) {
+    // The window was hidden. As in Client::Release, map it, but lower it.
+    xlib::XMapWindow(client);
+    xlib::XLowerWindow(client);
+  }
+  XWindowChanges wc{};
+  wc.border_width = border_width;
+  xlib::XConfigureWindow(client, CWBorderWidth, &wc);
+  XDestroyWindow(dpy_, frame);
+  tree_.Destroyed(frame);
+  return client;
 }
 
 Client* LScr::GetClient(Window w, bool scan_parents) const {
@@ -211,11 +427,15 @@ Client* LScr::GetClient(Window w, bool scan_parents) const {
   if (it != parents_.end()) {
     return it->second;
   }
-  while (w) {
+  while (w && w != Root()) {
     const auto it = clients_.find(w);
     if (it != clients_.end()) {
       return it->second;
     }
+    const auto pit = parents_.find(w);
+    if (pit != parents_.end()) {
+      return pit->second;
+    }
     // scan_parents must be disabled when we're responding to a DestroyNotify
     // event. We'll get a notification of the 'c->window' window as well, but
     // we should just silently ignore the destruction of all its subwindows.
@@ -224,7 +444,7 @@ Client* LScr::GetClient(Window w, bool scan_parents) const {
     if (!scan_parents) {
       return nullptr;
     }
-    w = xlib::WindowTree::ParentOf(w);
+    w = tree_.ParentOf(w);
   }
   return nullptr;
 }
@@ -236,7 +456,10 @@ void LScr::Remove(Client* c) {
     return;
   }
   parents_.erase(it->second->parent);
+  stacking_.Remove(c->parent);
+  stacking_.Remove(c->window);
   clients_.erase(it);
+  Deferred::I->Forget(c);
   DebugCLI::NotifyClientRemove(c);
   delete c;
 }
@@ -299,6 +522,19 @@ struct moveData {
   Rect r;
 };
 
+double LScr::RefreshRateFor(const Rect& r) const {
+  double res = 0;
+  int best_area = -1;
+  for (const auto& rate : refresh_rates_) {
+    const int area = Rect::Intersect(r, rate.first).area().num_pixels();
+    if (area > best_area) {
+      best_area = area;
+      res = rate.second;
+    }
+  }
+  return res;
+}
+
 int quantise(int dimension, int increment) {
   if (increment < 2) {
     return dimension;
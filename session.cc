@@ -21,6 +21,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "eventloop.h"
 #include "lwm.h"
 
 struct SmProperty {
@@ -169,6 +170,10 @@ void session_init(int argc, char* argv[]) {
         i++;
         previd = argv[i];
       }
+    } else if (strncmp(argv[i], "-handoff=", 9) == 0) {
+      // Only means anything to a restart; see handoff.h.
+    } else if (strncmp(argv[i], "-readyfd=", 9) == 0) {
+      // Only means anything to lwmbench.
     } else {
       session_argv[session_argc] = argv[i];
       session_argc++;
@@ -205,6 +210,7 @@ void session_init(int argc, char* argv[]) {
   IceSetIOErrorHandler(ice_error);
   ice_conn = SmcGetIceConnection(smc_conn);
   ice_fd = IceConnectionNumber(ice_conn);
+  EventLoop::I->AddSource("ICE", ice_fd, session_process);
 }
 
 void session_process() {
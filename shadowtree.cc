@@ -0,0 +1,93 @@
+#include <sstream>
+
+#include "lwm.h"
+
+void ShadowTree::Created(Window w, Window parent) {
+  unlink(w);
+  parents_[w] = parent;
+  children_[parent].insert(w);
+}
+
+void ShadowTree::Reparented(Window w, Window parent) {
+  // Reparenting moves the whole subtree, so anything we know about w's
+  // descendants is still true.
+  Created(w, parent);
+}
+
+void ShadowTree::Destroyed(Window w) {
+  unlink(w);
+  // X destroys the children before the parent, so we've normally heard about
+  // them already, but not if they were windows we learned about by asking.
+  std::vector<Window> doomed = {w};
+  while (!doomed.empty()) {
+    const Window d = doomed.back();
+    doomed.pop_back();
+    const auto it = children_.find(d);
+    if (it == children_.end()) {
+      continue;
+    }
+    for (const Window child : it->second) {
+      parents_.erase(child);
+      doomed.push_back(child);
+    }
+    children_.erase(it);
+  }
+}
+
+Window ShadowTree::ParentOf(Window w) {
+  if (w == LScr::I->Root()) {
+    return None;
+  }
+  const auto it = parents_.find(w);
+  if (it != parents_.end()) {
+    hits_++;
+    if (verify_) {
+      const Window actual = xlib::WindowTree::Query(dpy, w).parent;
+      LOGE_IF(actual != it->second)
+          << "Shadow tree has " << WinID(it->second) << " as the parent of "
+          << WinID(w) << ", but the server says " << WinID(actual);
+    }
+    return it->second;
+  }
+  misses_++;
+  const Window parent = xlib::WindowTree::Query(dpy, w).parent;
+  if (parent) {
+    Created(w, parent);
+  }
+  return parent;
+}
+
+std::vector<std::string> ShadowTree::Check() const {
+  std::vector<std::string> res;
+  for (const auto& it : parents_) {
+    const xlib::WindowTree wt = xlib::WindowTree::Query(dpy, it.first);
+    if (wt.parent == it.second) {
+      continue;
+    }
+    std::ostringstream os;
+    os << WinID(it.first) << ": parent is " << WinID(it.second)
+       << ", but the server says ";
+    if (wt.parent) {
+      os << WinID(wt.parent);
+    } else {
+      os << "it doesn't exist";
+    }
+    res.push_back(os.str());
+  }
+  return res;
+}
+
+void ShadowTree::unlink(Window w) {
+  const auto it = parents_.find(w);
+  if (it == parents_.end()) {
+    return;
+  }
+  const auto siblings = children_.find(it->second);
+  if (siblings != children_.end()) {
+    siblings->second.erase(w);
+    if (siblings->second.empty()) {
+      children_.erase(siblings);
+    }
+  }
+  parents_.erase(it);
+}
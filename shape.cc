@@ -68,15 +68,7 @@ extern int shapeEvent(XEvent* ev) {
 
 /*ARGSUSED*/
 extern int isShaped(Window w) {
-#ifdef SHAPE
-  int n;
-  int order;
-  XFree(XShapeGetRectangles(dpy, w, ShapeBounding, &n, &order));
-  return (n > 1);
-#else
-  w = w;
-  return 0;
-#endif
+  return xlib::async::IsShaped(w).Get();
 }
 
 extern int serverSupportsShapes() {
@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <set>
+
+#include "ewmh.h"
+#include "lwm.h"
+
+namespace {
+
+void erase(std::vector<Window>* v, Window w) {
+  v->erase(std::remove(v->begin(), v->end(), w), v->end());
+}
+
+// Returns a flag for each position in seq, set if that element is part of a
+// longest strictly increasing subsequence.
+std::vector<bool> longestIncreasing(const std::vector<int>& seq) {
+  // tails[k] is the index in seq of the smallest value which ends an
+  // increasing run of length k + 1; prev links each element to the one before
+  // it in its run.
+  std::vector<int> tails;
+  std::vector<int> prev(seq.size(), -1);
+  for (int i = 0; i < (int)seq.size(); i++) {
+    const auto it = std::lower_bound(
+        tails.begin(), tails.end(), seq[i],
+        [&seq](int idx, int value) { return seq[idx] < value; });
+    if (it != tails.begin()) {
+      prev[i] = *(it - 1);
+    }
+    if (it == tails.end()) {
+      tails.push_back(i);
+    } else {
+      *it = i;
+    }
+  }
+  std::vector<bool> res(seq.size(), false);
+  for (int i = tails.empty() ? -1 : tails.back(); i >= 0; i = prev[i]) {
+    res[i] = true;
+  }
+  return res;
+}
+
+}  // namespace
+
+void Stacking::Add(Window w, bool known_on_top) {
+  Remove(w);
+  order_.push_back(w);
+  if (known_on_top) {
+    applied_.push_back(w);
+  }
+}
+
+void Stacking::Remove(Window w) {
+  erase(&order_, w);
+  erase(&applied_, w);
+}
+
+void Stacking::Seed(const std::vector<Window>& actual) {
+  const std::set<Window> known(order_.begin(), order_.end());
+  applied_.clear();
+  for (const Window w : actual) {
+    if (known.count(w)) {
+      applied_.push_back(w);
+    }
+  }
+}
+
+void Stacking::Raise(Window w) {
+  if (std::find(order_.begin(), order_.end(), w) == order_.end()) {
+    return;
+  }
+  erase(&order_, w);
+  order_.push_back(w);
+}
+
+void Stacking::Lower(Window w) {
+  if (std::find(order_.begin(), order_.end(), w) == order_.end()) {
+    return;
+  }
+  erase(&order_, w);
+  order_.insert(order_.begin(), w);
+}
+
+// static
+Stacking::Layer Stacking::LayerOf(const Client* c) {
+  // Fullscreen windows go over everything, even docks. A window which asks to
+  // be below the others takes precedence over it being a dock, but not over it
+  // asking to be above.
+  if (c->wstate.fullscreen) {
+    return FULLSCREEN;
+  }
+  if (c->wstate.above || (c->wtype == WTypeDock && !c->wstate.below)) {
+    return ABOVE;
+  }
+  if (c->wtype == WTypeDesktop) {
+    return DESKTOP;
+  }
+  if (c->wstate.below) {
+    return BELOW;
+  }
+  return NORMAL;
+}
+
+void Stacking::Apply() {
+  std::stable_sort(order_.begin(), order_.end(), [](Window a, Window b) {
+    const Client* ca = LScr::I->GetClient(a, false);
+    const Client* cb = LScr::I->GetClient(b, false);
+    return (ca ? LayerOf(ca) : NORMAL) < (cb ? LayerOf(cb) : NORMAL);
+  });
+  for (const Move& m : Plan(applied_, order_)) {
+    XWindowChanges wc{};
+    wc.sibling = m.sibling;
+    wc.stack_mode = m.mode;
+    xlib::XConfigureWindow(m.w, CWStackMode | (m.sibling ? CWSibling : 0),
+                           &wc);
+  }
+  applied_ = order_;
+}
+
+// static
+std::vector<Stacking::Move> Stacking::Plan(const std::vector<Window>& current,
+                                           const std::vector<Window>& target) {
+  // The windows which can stay put are the largest set which are already in
+  // the right order relative to each other: a longest increasing subsequence
+  // of their current positions, taken in target order.
+  std::map<Window, int> pos;
+  for (int i = 0; i < (int)current.size(); i++) {
+    pos[current[i]] = i;
+  }
+  std::vector<int> seq;
+  for (const Window w : target) {
+    const auto it = pos.find(w);
+    if (it != pos.end()) {
+      seq.push_back(it->second);
+    }
+  }
+  const std::vector<bool> in_place = longestIncreasing(seq);
+
+  // Everything else goes directly above the window which should be below it.
+  // Working upwards, that window is always in its final place already.
+  std::vector<Move> res;
+  const int n = target.size();
+  int si = 0;
+  for (int i = 0; i < n; i++) {
+    const Window w = target[i];
+    if (pos.count(w) && in_place[si++]) {
+      continue;
+    }
+    if (i == n - 1) {
+      res.push_back({w, None, Above});
+    } else if (i == 0) {
+      res.push_back({w, None, Below});
+    } else {
+      res.push_back({w, target[i - 1], Above});
+    }
+  }
+  return res;
+}
@@ -10,7 +10,17 @@
 // don't protect themselves against being used in if() statements without {}.
 // For this reason, always use {}, not one-line if statements.
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "argb.h"
 #include "ewmh.h"
+#include "handoff.h"
+#include "histogram.h"
+#include "iconcache.h"
+#include "lru.h"
 #include "lwm.h"
 #include "xlib.h"
 
@@ -119,9 +129,515 @@ static void runMapToNewAreasTests() {
   }
 }
 
+static void runLatencyHistogramTests() {
+#define FAIL()    \
+  failure = true; \
+  LOGE() << "FAIL: histogram: "
+
+  LOGI() << "Test case: histogram buckets";
+  // Every value must land in a bucket whose upper bound is at least the value,
+  // and no more than 12.5% bigger.
+  for (uint64_t v : {0ULL, 1ULL, 7ULL, 8ULL, 9ULL, 15ULL, 16ULL, 1000ULL,
+                     123456789ULL, ~0ULL}) {
+    const uint64_t upper =
+        LatencyHistogram::BucketUpperBound(LatencyHistogram::BucketFor(v));
+    if (upper < v || upper - v > v / 8) {
+      FAIL() << "value " << v << " has bucket upper bound " << upper;
+    }
+  }
+
+  LOGI() << "Test case: histogram empty";
+  LatencyHistogram h;
+  if (h.Count() != 0 || h.Max() != 0 || h.Percentile(50) != 0) {
+    FAIL() << "empty histogram reports non-zero";
+  }
+
+  LOGI() << "Test case: histogram percentiles";
+  for (uint64_t v = 1; v <= 1000; v++) {
+    h.Record(v * 1000);
+  }
+  if (h.Count() != 1000 || h.Max() != 1000000) {
+    FAIL() << "got count " << h.Count() << ", max " << h.Max();
+  }
+  const uint64_t p50 = h.Percentile(50);
+  if (p50 < 500000 || p50 > 500000 + 500000 / 8) {
+    FAIL() << "p50 " << p50 << ", want about 500000";
+  }
+  const uint64_t p99 = h.Percentile(99);
+  if (p99 < 990000 || p99 > 1000000) {
+    FAIL() << "p99 " << p99 << ", want about 990000";
+  }
+  if (h.Percentile(100) != 1000000) {
+    FAIL() << "p100 " << h.Percentile(100) << ", want max";
+  }
+
+  LOGI() << "Test case: histogram reset";
+  h.Reset();
+  if (h.Count() != 0 || h.Max() != 0 || h.Percentile(99) != 0) {
+    FAIL() << "reset histogram reports non-zero";
+  }
+#undef FAIL
+}
+
+static void runShadowTreeTests() {
+#define FAIL()    \
+  failure = true; \
+  LOGE() << "FAIL: shadow tree: "
+
+  // Windows 2 and 4 are children of 1, and 3 is a child of 2.
+  LOGI() << "Test case: shadow tree destroy";
+  ShadowTree tree;
+  tree.Created(2, 1);
+  tree.Created(3, 2);
+  tree.Created(4, 1);
+  tree.Destroyed(2);
+  if (tree.Size() != 1) {
+    FAIL() << "destroying 2 left " << tree.Size() << " windows, want 1";
+  }
+
+  LOGI() << "Test case: shadow tree reparent";
+  tree.Created(2, 1);
+  tree.Created(3, 2);
+  tree.Reparented(3, 4);
+  tree.Destroyed(2);
+  if (tree.Size() != 2) {
+    FAIL() << "destroying 2 left " << tree.Size() << " windows, want 2";
+  }
+  tree.Destroyed(4);
+  if (tree.Size() != 0) {
+    FAIL() << "destroying 4 left " << tree.Size() << " windows, want 0";
+  }
+#undef FAIL
+}
+
+// Applies the moves to a stack of windows, bottom to top, as the X server
+// would.
+static std::vector<Window> applyStackMoves(
+    std::vector<Window> stack,
+    const std::vector<Stacking::Move>& moves) {
+  for (const Stacking::Move& m : moves) {
+    stack.erase(std::remove(stack.begin(), stack.end(), m.w), stack.end());
+    auto it = stack.end();
+    if (m.sibling) {
+      it = std::find(stack.begin(), stack.end(), m.sibling);
+      if (m.mode == Above && it != stack.end()) {
+        ++it;
+      }
+    } else if (m.mode == Below) {
+      it = stack.begin();
+    }
+    stack.insert(it, m.w);
+  }
+  return stack;
+}
+
+struct stackPlanCase {
+  char const* const name;
+  std::vector<Window> current;
+  std::vector<Window> target;
+  size_t max_moves;
+};
+
+static void runStackingTests() {
+#define FAIL()    \
+  failure = true; \
+  LOGE() << "FAIL: stacking: " << tc.name << ": "
+
+  const stackPlanCase cases[] = {
+      {"unchanged", {1, 2, 3, 4}, {1, 2, 3, 4}, 0},
+      {"raise bottom", {1, 2, 3, 4}, {2, 3, 4, 1}, 1},
+      {"raise middle", {1, 2, 3, 4}, {1, 3, 4, 2}, 1},
+      {"lower top", {1, 2, 3, 4}, {4, 1, 2, 3}, 1},
+      {"swap", {1, 2, 3, 4}, {1, 3, 2, 4}, 1},
+      {"reverse", {1, 2, 3, 4}, {4, 3, 2, 1}, 3},
+      {"new window", {1, 2, 3}, {1, 4, 2, 3}, 1},
+      {"new window on top", {1, 2}, {1, 2, 3}, 1},
+      {"removed window", {1, 2, 3, 4}, {1, 3, 4}, 0},
+      {"only new", {}, {1}, 1},
+  };
+  for (const stackPlanCase& tc : cases) {
+    LOGI() << "Test case: stacking " << tc.name;
+    const std::vector<Stacking::Move> moves =
+        Stacking::Plan(tc.current, tc.target);
+    if (moves.size() > tc.max_moves) {
+      FAIL() << moves.size() << " moves, want at most " << tc.max_moves;
+    }
+    // Windows which are in current but not in target aren't ours any more,
+    // so they're left wherever they end up.
+    std::vector<Window> got = applyStackMoves(tc.current, moves);
+    got.erase(std::remove_if(got.begin(), got.end(),
+                             [&tc](Window w) {
+                               return std::find(tc.target.begin(),
+                                                tc.target.end(),
+                                                w) == tc.target.end();
+                             }),
+              got.end());
+    if (got != tc.target) {
+      FAIL() << "moves don't give the target order";
+    }
+  }
+#undef FAIL
+}
+
+static void runLRUCacheTests() {
+#define FAIL()    \
+  failure = true; \
+  LOGE() << "FAIL: LRU cache: "
+
+  LOGI() << "Test case: LRU cache eviction";
+  LRUCache<std::string, int> cache(2);
+  cache.Put("a", 1);
+  cache.Put("b", 2);
+  // Looking up "a" makes "b" the least recently used, so it goes next.
+  if (!cache.Get("a") || *cache.Get("a") != 1) {
+    FAIL() << "a not cached";
+  }
+  cache.Put("c", 3);
+  if (cache.Get("b")) {
+    FAIL() << "b still cached";
+  }
+  if (!cache.Get("a") || !cache.Get("c") || cache.Size() != 2) {
+    FAIL() << "a or c not cached, or size " << cache.Size() << " isn't 2";
+  }
+
+  LOGI() << "Test case: LRU cache replace";
+  cache.Put("c", 4);
+  if (!cache.Get("c") || *cache.Get("c") != 4 || cache.Size() != 2) {
+    FAIL() << "replacing c didn't work";
+  }
+  cache.Clear();
+  if (cache.Get("a") || cache.Size() != 0) {
+    FAIL() << "clear didn't work";
+  }
+#undef FAIL
+}
+
+static void runTrueColorPixelTests() {
+#define FAIL()    \
+  failure = true; \
+  LOGE() << "FAIL: TrueColor pixel: "
+
+  LOGI() << "Test case: TrueColor pixel, 24 bit";
+  XColor sienna = {};
+  sienna.red = 0xa0a0;
+  sienna.green = 0x5252;
+  sienna.blue = 0x2d2d;
+  unsigned long got =
+      Resources::TrueColorPixel(0xff0000, 0x00ff00, 0x0000ff, sienna);
+  if (got != 0xa0522d) {
+    FAIL() << std::hex << got << ", want a0522d";
+  }
+
+  LOGI() << "Test case: TrueColor pixel, 16 bit";
+  // 5 bits of red, 6 of green and 5 of blue.
+  got = Resources::TrueColorPixel(0xf800, 0x07e0, 0x001f, sienna);
+  const unsigned long want = (0xa0 >> 3) << 11 | (0x52 >> 2) << 5 | 0x2d >> 3;
+  if (got != want) {
+    FAIL() << std::hex << got << ", want " << want;
+  }
+#undef FAIL
+}
+
+static void runArgbImageTests() {
+#define FAIL()    \
+  failure = true; \
+  LOGE() << "FAIL: ARGB image: "
+
+  LOGI() << "Test case: ARGB image, divide by 255";
+  for (uint32_t c = 0; c <= 0xff; c++) {
+    for (uint32_t a = 0; a <= 0xff; a++) {
+      const uint32_t want = (c * a * 2 + 0xff) / (2 * 0xff);
+      if (ArgbImage::Div255(c * a) != want) {
+        FAIL() << c << " * " << a << " / 255 gave "
+               << ArgbImage::Div255(c * a) << ", want " << want;
+      }
+    }
+  }
+
+  LOGI() << "Test case: ARGB image, premultiply";
+  const unsigned long pixels[] = {0x80ff0000, 0xff00ff00, 0x000000ff,
+                                  0x40ffffff};
+  ArgbImage img = ArgbImage::FromPixels(pixels, 2, 2);
+  const uint32_t want_premultiplied[] = {0x80800000, 0xff00ff00, 0, 0x40404040};
+  for (int i = 0; i < 4; i++) {
+    const uint32_t got = img.Row(i / 2)[i % 2];
+    if (got != want_premultiplied[i]) {
+      FAIL() << "pixel " << i << " is " << std::hex << got << ", want "
+             << want_premultiplied[i];
+    }
+  }
+
+  LOGI() << "Test case: ARGB image, downscale";
+  // Each 2x2 block of the source becomes one destination pixel.
+  ArgbImage big(4, 2);
+  const uint32_t big_pixels[] = {0xff000000, 0xff0000ff, 0x10101010, 0,
+                                 0xff0000ff, 0xff000000, 0x10101010, 0};
+  for (int i = 0; i < 8; i++) {
+    big.Row(i / 4)[i % 4] = big_pixels[i];
+  }
+  const ArgbImage small = big.Downscale(2, 1);
+  if (small.Width() != 2 || small.Height() != 1 ||
+      small.Row(0)[0] != 0xff000080 || small.Row(0)[1] != 0x08080808) {
+    FAIL() << "got " << std::hex << small.Row(0)[0] << " " << small.Row(0)[1]
+           << ", want ff000080 8080808";
+  }
+
+  LOGI() << "Test case: ARGB image, composite";
+  // Half-transparent red, opaque green, transparent and a quarter-opaque
+  // white, onto a blue background, and onto a two-tone one.
+  const ArgbImage::Background backgrounds[] = {
+      ArgbImage::Background(0x0000ff),
+      ArgbImage::Background(0xffffff, 0, 0x000000),
+  };
+  uint32_t out0[4];
+  uint32_t out1[4];
+  uint32_t* const out[] = {out0, out1};
+  img.Composite(backgrounds, out, 2);
+  const uint32_t want0[] = {0xff80007f, 0xff00ff00, 0xff0000ff, 0xff4040ff};
+  const uint32_t want1[] = {0xffff7f7f, 0xff00ff00, 0xff000000, 0xff404040};
+  for (int i = 0; i < 4; i++) {
+    if (out0[i] != want0[i] || out1[i] != want1[i]) {
+      FAIL() << "pixel " << i << " is " << std::hex << out0[i] << " and "
+             << out1[i] << ", want " << want0[i] << " and " << want1[i];
+    }
+  }
+#undef FAIL
+}
+
+static void runBestIconTests() {
+#define FAIL()    \
+  failure = true; \
+  LOGE() << "FAIL: best icon: "
+
+  struct TestCase {
+    std::string name;
+    std::vector<EWMHIconSize> icons;
+    int target;
+    int want;
+  };
+  const std::vector<TestCase> tests = {
+      {"only one", {{0, 16, 16}}, 32, 0},
+      {"smallest big enough",
+       {{0, 16, 16}, {258, 256, 256}, {65796, 48, 48}, {68102, 32, 32}},
+       24,
+       3},
+      {"exact size", {{0, 64, 64}, {4098, 32, 32}}, 32, 1},
+      {"all too small", {{0, 16, 16}, {258, 24, 24}, {836, 22, 22}}, 32, 1},
+      {"too narrow", {{0, 48, 16}, {770, 40, 40}}, 32, 1},
+  };
+  for (const auto& test : tests) {
+    LOGI() << "Test case: best icon, " << test.name;
+    const int got = ewmh_best_icon(test.icons, test.target);
+    if (got != test.want) {
+      FAIL() << test.name << ": got " << got << ", want " << test.want;
+    }
+  }
+#undef FAIL
+}
+
+static void runSharedCacheTests() {
+#define FAIL()    \
+  failure = true; \
+  LOGE() << "FAIL: shared cache: "
+
+  LOGI() << "Test case: shared cache keeps values in use";
+  std::vector<int> evicted;
+  SharedCache<int, int> cache(10, [&evicted](int& v) { evicted.push_back(v); });
+  cache.Insert(1, 100, 6, true);
+  cache.Insert(2, 200, 6, true);
+  // Over budget, but both are in use.
+  if (!evicted.empty() || cache.Cost() != 12) {
+    FAIL() << "evicted " << evicted.size() << ", cost " << cache.Cost();
+  }
+
+  LOGI() << "Test case: shared cache evicts least recently released";
+  cache.Release(1);
+  // Releasing 1 puts us over budget with 1 unused, so it goes.
+  if (evicted != std::vector<int>{100} || cache.Size() != 1) {
+    FAIL() << "evicted " << evicted.size() << ", size " << cache.Size();
+  }
+  cache.Insert(3, 300, 2, true);
+  cache.Release(3);
+  cache.Release(2);
+  // 2 and 3 fit in the budget, and 3 can be taken again.
+  if (evicted.size() != 1 || !cache.Acquire(3) || *cache.Acquire(3) != 300) {
+    FAIL() << "3 not kept";
+  }
+  cache.Release(3);
+  cache.Release(3);
+  cache.Insert(4, 400, 4, true);
+  // 2 was released before 3, so goes first.
+  if (evicted != std::vector<int>{100, 200} || cache.Acquire(2)) {
+    FAIL() << "2 not evicted first; evicted " << evicted.size();
+  }
+
+  LOGI() << "Test case: shared cache drops unretained values on release";
+  cache.Insert(5, 500, 1, false);
+  cache.Release(5);
+  if (evicted.back() != 500 || cache.Acquire(5)) {
+    FAIL() << "5 not evicted";
+  }
+
+  LOGI() << "Test case: shared cache evicts all unused values on request";
+  cache.Insert(6, 600, 1, true);
+  cache.Release(4);
+  cache.EvictUnused();
+  if (evicted.back() != 400 || cache.Size() != 1 || !cache.Acquire(6)) {
+    FAIL() << "expected only 6 left; size " << cache.Size();
+  }
+#undef FAIL
+}
+
+static void runIconDiskCacheTests() {
+#define FAIL()    \
+  failure = true; \
+  LOGE() << "FAIL: icon disk cache: "
+
+  char dir[] = "/tmp/lwm-test-XXXXXX";
+  if (!mkdtemp(dir)) {
+    FAIL() << "can't make temporary directory";
+    return;
+  }
+  const std::string path = std::string(dir) + "/icons";
+  const uint32_t pixels[] = {1, 2, 3, 4, 5, 6};
+
+  LOGI() << "Test case: icon disk cache, reload";
+  IconDiskCache* cache = IconDiskCache::Open(path, 1024);
+  if (!cache || cache->Loaded() != 0) {
+    FAIL() << "new cache not empty";
+    return;
+  }
+  cache->Add(42, 1, 2, pixels, 6);
+  delete cache;
+  cache = IconDiskCache::Open(path, 1024);
+  const uint32_t* got = cache ? cache->Find(42, 1, 2, 6) : nullptr;
+  if (!got || !std::equal(pixels, pixels + 6, got)) {
+    FAIL() << "icon not reloaded";
+  } else if (cache->Find(42, 2, 1, 6) || cache->Find(43, 1, 2, 6)) {
+    FAIL() << "found icon with wrong size or key";
+  }
+  delete cache;
+
+  LOGI() << "Test case: icon disk cache, damaged file";
+  FILE* f = fopen(path.c_str(), "a");
+  fputs("junk", f);
+  fclose(f);
+  cache = IconDiskCache::Open(path, 1024);
+  if (!cache || cache->Loaded() != 0 || cache->Find(42, 1, 2, 6)) {
+    FAIL() << "damaged cache not started afresh";
+  }
+  delete cache;
+
+  LOGI() << "Test case: icon disk cache, odd sizes";
+  cache = IconDiskCache::Open(path, 1024);
+  cache->Add(7, 1, 1, pixels, 1);
+  cache->Add(8, 1, 3, pixels, 3);
+  delete cache;
+  cache = IconDiskCache::Open(path, 1024);
+  got = cache ? cache->Find(8, 1, 3, 3) : nullptr;
+  if (!cache || cache->Loaded() != 2 || !cache->Find(7, 1, 1, 1) || !got ||
+      !std::equal(pixels, pixels + 3, got)) {
+    FAIL() << "records after one with an odd number of pixels not reloaded";
+  } else if (uintptr_t(got) % 8) {
+    FAIL() << "record not 8-byte aligned";
+  }
+  delete cache;
+  unlink(path.c_str());
+
+  LOGI() << "Test case: icon disk cache, full";
+  cache = IconDiskCache::Open(path, 48);
+  // There's only room for the header and one record.
+  cache->Add(1, 1, 2, pixels, 2);
+  cache->Add(2, 1, 2, pixels, 2);
+  delete cache;
+  cache = IconDiskCache::Open(path, 1024);
+  if (!cache || cache->Loaded() != 1 || !cache->Find(1, 1, 2, 2)) {
+    FAIL() << "expected only the first record";
+  }
+  delete cache;
+
+  unlink(path.c_str());
+  rmdir(dir);
+#undef FAIL
+}
+
+static void runHandoffTests() {
+#define FAIL()    \
+  failure = true; \
+  LOGE() << "FAIL: handoff: "
+
+  LOGI() << "Test case: handoff round trip";
+  Handoff h;
+  HandoffClient c;
+  c.window = 0x1200003;
+  c.frame = 0x400021;
+  c.hidden = true;
+  c.content = Rect{10, 20, 110, 220};
+  c.original_border_width = 1;
+  c.visible_name = "two \"lines\"\nof name";
+  h.clients.push_back(c);
+  c.window = 0x1400001;
+  c.frame = 0;
+  c.hidden = false;
+  c.fullscreen = true;
+  c.pre_full_screen = Rect{-5, 0, 300, 200};
+  c.visible_name = "";
+  h.clients.push_back(c);
+  h.focus_history = {0x1400001};
+  h.hidden = {0x1200003};
+  Handoff got;
+  if (!Handoff::Parse(h.Serialize(), &got)) {
+    FAIL() << "can't parse " << h.Serialize();
+  } else if (got.clients.size() != 2 || got.focus_history != h.focus_history ||
+             got.hidden != h.hidden) {
+    FAIL() << "got " << got.clients.size() << " clients";
+  } else {
+    const HandoffClient& a = got.clients[0];
+    const HandoffClient& b = got.clients[1];
+    if (a.window != 0x1200003 || a.frame != 0x400021 || !a.hidden ||
+        a.fullscreen || !(a.content == Rect{10, 20, 110, 220}) ||
+        a.original_border_width != 1 ||
+        a.visible_name != h.clients[0].visible_name) {
+      FAIL() << "first client " << a.content << " " << a.visible_name;
+    }
+    if (b.frame || b.hidden || !b.fullscreen ||
+        !(b.pre_full_screen == Rect{-5, 0, 300, 200}) ||
+        !b.visible_name.empty()) {
+      FAIL() << "second client " << b.pre_full_screen;
+    }
+    if (got.Find(0x400021) != &got.clients[0] ||
+        got.Find(0x1400001) != &got.clients[1] || got.Find(0x1200003)) {
+      FAIL() << "Find should match frames, and unframed windows";
+    }
+  }
+
+  LOGI() << "Test case: handoff rejects damage";
+  const std::string text = h.Serialize();
+  const std::vector<std::string> bad_texts = {
+      "", text.substr(0, text.size() / 2), "lwm-handoff 0\n",
+      text + "unknown 1\n", text + "client"};
+  for (const std::string& bad : bad_texts) {
+    Handoff junk;
+    if (Handoff::Parse(bad, &junk)) {
+      FAIL() << "parsed " << bad;
+    }
+  }
+#undef FAIL
+}
+
 // RunAllTests runs all tests, then returns true on success.
 bool RunAllTests() {
   runMapToNewAreasTests();
+  runLatencyHistogramTests();
+  runShadowTreeTests();
+  runStackingTests();
+  runLRUCacheTests();
+  runSharedCacheTests();
+  runTrueColorPixelTests();
+  runArgbImageTests();
+  runBestIconTests();
+  runIconDiskCacheTests();
+  runHandoffTests();
   if (failure) {
     LOGF() << "FAAAAIIILED!!!";
   } else {
@@ -0,0 +1,224 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <utility>
+#include <vector>
+
+#include "eventloop.h"
+#include "ewmh.h"
+#include "lwm.h"
+#include "trace.h"
+#include "xasync.h"
+
+static_assert(sizeof(XEvent) <= kTracePayloadSize, "XEvent doesn't fit");
+static_assert(sizeof(TraceWindowQuery) <= kTracePayloadSize, "too big");
+static_assert(sizeof(TraceTreeQuery) <= kTracePayloadSize, "too big");
+static_assert(sizeof(TracePropertyQuery) <= kTracePayloadSize, "too big");
+static_assert(sizeof(TraceAtom) <= kTracePayloadSize, "too big");
+
+Trace* Trace::I;
+
+// The atoms whose names we've asked for, but not yet recorded.
+struct Trace::PendingAtoms {
+  std::vector<std::pair<Atom, xlib::async::Reply<std::string>>> names;
+};
+
+namespace {
+
+// Writes all of buf to fd, retrying after signals and short writes. Returns
+// false on failure.
+bool writeAll(int fd, const void* buf, size_t len) {
+  const char* p = static_cast<const char*>(buf);
+  while (len) {
+    const ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+}  // namespace
+
+// static
+bool Trace::Open(const std::string& path, bool append) {
+  const int fd = open(path.c_str(),
+                      O_RDWR | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC),
+                      0644);
+  if (fd < 0) {
+    LOGE() << "Failed to open trace file " << path << ": " << Log::Errno(errno);
+    return false;
+  }
+  TraceHeader hdr = {};
+  if (append && pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+      !memcmp(hdr.magic, kTraceMagic, sizeof(hdr.magic)) &&
+      hdr.version == kTraceVersion && hdr.record_size == sizeof(TraceRecord)) {
+    // The monotonic clock is the same for every process, so our records'
+    // times can carry on from the start of the existing trace.
+    const off_t size = lseek(fd, 0, SEEK_END);
+    if (size >= 0 && (size - sizeof(hdr)) % sizeof(TraceRecord) == 0) {
+      I = new Trace(fd, hdr.start_nanos);
+      LOGI() << "Adding to X event trace " << path;
+      return true;
+    }
+  }
+  if (append && (ftruncate(fd, 0) || lseek(fd, 0, SEEK_SET))) {
+    LOGE() << "Failed to truncate trace file " << path << ": "
+           << Log::Errno(errno);
+    close(fd);
+    return false;
+  }
+  hdr = {};
+  memcpy(hdr.magic, kTraceMagic, sizeof(hdr.magic));
+  hdr.version = kTraceVersion;
+  hdr.record_size = sizeof(TraceRecord);
+  hdr.start_nanos = MonotonicNanos();
+  if (!writeAll(fd, &hdr, sizeof(hdr))) {
+    LOGE() << "Failed to write trace header to " << path << ": "
+           << Log::Errno(errno);
+    close(fd);
+    return false;
+  }
+  I = new Trace(fd, hdr.start_nanos);
+  LOGI() << "Recording X event trace to " << path;
+  return true;
+}
+
+Trace::Trace(int fd, uint64_t start_nanos)
+    : fd_(fd), start_nanos_(start_nanos), pending_atoms_(new PendingAtoms) {}
+
+Trace::~Trace() {
+  close(fd_);
+}
+
+TraceRecord* Trace::next(TraceKind kind) {
+  if (used_ == kBufferRecords) {
+    Flush();
+  }
+  TraceRecord* rec = &buffer_[used_++];
+  rec->nanos = MonotonicNanos() - start_nanos_;
+  rec->kind = kind;
+  rec->pad = 0;
+  memset(rec->payload, 0, sizeof(rec->payload));
+  return rec;
+}
+
+void Trace::noteAtom(Atom a) {
+  if (a <= XA_LAST_PREDEFINED || atoms_.count(a)) {
+    return;
+  }
+  atoms_.insert(a);
+  // Waiting for the name here would distort the very timings we're recording.
+  pending_atoms_->names.emplace_back(a, xlib::async::GetAtomName(a));
+}
+
+void Trace::Event(const XEvent& ev) {
+  if (ev.type == PropertyNotify) {
+    noteAtom(ev.xproperty.atom);
+  } else if (ev.type == ClientMessage) {
+    noteAtom(ev.xclient.message_type);
+    // The state being changed is given by atoms in the message itself.
+    if (ev.xclient.message_type == ewmh_atom[_NET_WM_STATE]) {
+      noteAtom(ev.xclient.data.l[1]);
+      noteAtom(ev.xclient.data.l[2]);
+    }
+  }
+  memcpy(next(TraceXEvent)->payload, &ev, sizeof(ev));
+}
+
+void Trace::WindowQuery(TraceKind kind, const TraceWindowQuery& q) {
+  memcpy(next(kind)->payload, &q, sizeof(q));
+}
+
+void Trace::TreeQuery(Window w,
+                      Window root,
+                      Window parent,
+                      const Window* children,
+                      unsigned int num_children) {
+  TraceTreeQuery q = {};
+  q.window = w;
+  q.root = root;
+  q.parent = parent;
+  q.num_children = num_children;
+  const unsigned int max = sizeof(q.children) / sizeof(*q.children);
+  for (unsigned int i = 0; i < num_children && i < max; i++) {
+    q.children[i] = children[i];
+  }
+  memcpy(next(TraceQueryTree)->payload, &q, sizeof(q));
+}
+
+void Trace::PropertyQuery(Window w,
+                          Atom property,
+                          int status,
+                          Atom type,
+                          int format,
+                          unsigned long nitems,
+                          unsigned long bytes_after,
+                          const unsigned char* data) {
+  noteAtom(property);
+  noteAtom(type);
+  TracePropertyQuery q = {};
+  q.window = w;
+  q.property = property;
+  q.status = status;
+  q.type = type;
+  q.format = format;
+  q.nitems = nitems;
+  q.bytes_after = bytes_after;
+  if (data && status == Success) {
+    // Xlib returns 32-bit items as longs, so that's how big they are here.
+    const size_t item_size = format == 32   ? sizeof(long)
+                             : format == 16 ? sizeof(short)
+                                            : 1;
+    size_t len = nitems * item_size;
+    if (len > sizeof(q.data)) {
+      len = sizeof(q.data);
+    }
+    memcpy(q.data, data, len);
+    q.data_len = len;
+    if (type == XA_ATOM) {
+      const Atom* atoms = reinterpret_cast<const Atom*>(data);
+      for (size_t i = 0; i < len / sizeof(Atom); i++) {
+        noteAtom(atoms[i]);
+      }
+    }
+  }
+  memcpy(next(TraceProperty)->payload, &q, sizeof(q));
+}
+
+void Trace::Flush() {
+  if (!used_) {
+    return;
+  }
+  // The names go first, so they come before the records which use them.
+  std::vector<TraceRecord> names;
+  for (auto& it : pending_atoms_->names) {
+    const std::string& name = it.second.Get();
+    if (name.empty()) {
+      continue;
+    }
+    TraceRecord rec = {};
+    rec.nanos = MonotonicNanos() - start_nanos_;
+    rec.kind = TraceAtomName;
+    TraceAtom ta = {};
+    ta.atom = it.first;
+    ta.len = name.size() < sizeof(ta.name) ? name.size() : sizeof(ta.name);
+    memcpy(ta.name, name.data(), ta.len);
+    memcpy(rec.payload, &ta, sizeof(ta));
+    names.push_back(rec);
+  }
+  pending_atoms_->names.clear();
+  LOGE_IF(!names.empty() &&
+          !writeAll(fd_, names.data(), names.size() * sizeof(TraceRecord)))
+      << "Failed to write trace: " << Log::Errno(errno);
+  LOGE_IF(!writeAll(fd_, buffer_, used_ * sizeof(TraceRecord)))
+      << "Failed to write trace: " << Log::Errno(errno);
+  used_ = 0;
+}
@@ -0,0 +1,172 @@
+#ifndef LWM_TRACE_H_included
+#define LWM_TRACE_H_included
+
+#include <stdint.h>
+#include <memory>
+#include <set>
+#include <string>
+
+#include <X11/Xlib.h>
+
+// Trace records everything the X server tells LWM into a binary file, for
+// replaying later when trying to understand a performance problem. It is
+// enabled with the -trace=<file> command-line flag.
+//
+// The file starts with a TraceHeader, followed by any number of TraceRecords,
+// all of the same size (given in the header, so readers can skip records
+// whose kind they don't understand, or which were written by a later version
+// with bigger records). Every XEvent main() receives is recorded, as are the
+// replies to the synchronous queries made while handling them. All integers
+// are in the native byte order of the machine doing the recording, and the
+// XEvent payloads are the raw Xlib structures, so traces should be replayed on
+// the same sort of machine.
+//
+// Records are collected in a buffer, and written out with a single write()
+// when it fills up, or the trace is flushed (which happens on exit). Recording
+// an event is thus little more than a memcpy. Atom names are asked for
+// without waiting, and the replies collected when the buffer is written.
+//
+// When LWM restarts, the new process adds to the trace file rather than
+// starting a new one, so one trace covers both.
+
+constexpr char kTraceMagic[8] = {'L', 'W', 'M', 'T', 'R', 'A', 'C', 'E'};
+constexpr uint32_t kTraceVersion = 1;
+
+struct TraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;  // sizeof(TraceRecord) when it was written.
+  uint64_t start_nanos;  // MonotonicNanos() when the trace was opened.
+};
+
+// The kind of each TraceRecord, which determines what is in its payload.
+enum TraceKind : uint32_t {
+  TraceXEvent = 1,        // XEvent.
+  TraceAttributes = 2,    // TraceWindowQuery; XGetWindowAttributes.
+  TraceGeometry = 3,      // TraceWindowQuery; XGetGeometry.
+  TraceQueryTree = 4,     // TraceTreeQuery.
+  TraceQueryPointer = 5,  // TraceWindowQuery; root position and child.
+  TraceInputFocus = 6,    // TraceWindowQuery; focus window and revert_to.
+  TraceProperty = 7,      // TracePropertyQuery.
+  TraceFrame = 8,         // TraceWindowQuery; client window and its frame.
+  TraceAtomName = 9,      // TraceAtom.
+};
+
+// The payload is big enough for an XEvent, which is the biggest thing we
+// record (192 bytes on LP64 machines).
+constexpr int kTracePayloadSize = 192;
+
+struct TraceRecord {
+  uint64_t nanos;  // Since TraceHeader.start_nanos.
+  uint32_t kind;   // A TraceKind.
+  uint32_t pad;
+  unsigned char payload[kTracePayloadSize];
+};
+
+// Payload for the queries which are just about one window. Which fields are
+// used depends on the record kind.
+struct TraceWindowQuery {
+  uint32_t window;  // The window queried, or the client window for TraceFrame.
+  uint32_t ok;      // Whether the query succeeded.
+  uint32_t other;   // Parent, pointer child, focus window, or frame.
+  int32_t x, y;
+  uint32_t width, height;
+  uint32_t border_width;
+  uint32_t depth;
+  uint32_t map_state;
+  uint32_t override_redirect;
+  uint32_t mask;  // Event mask, pointer modifier state or focus revert_to.
+};
+
+// Payload for XQueryTree. If there are more children than fit, only the
+// bottom-most are recorded, but num_children is the real count.
+struct TraceTreeQuery {
+  uint32_t window;
+  uint32_t root;
+  uint32_t parent;
+  uint32_t num_children;
+  uint32_t children[(kTracePayloadSize - 16) / 4];
+};
+
+// Payload for XGetWindowProperty: the reply's metadata, and as much of the
+// data as fits. nitems is the number of items actually returned.
+struct TracePropertyQuery {
+  uint32_t window;
+  uint32_t property;
+  uint32_t status;
+  uint32_t type;
+  uint32_t format;
+  uint32_t nitems;
+  uint32_t bytes_after;
+  uint32_t data_len;  // Bytes of data recorded below.
+  unsigned char data[kTracePayloadSize - 32];
+};
+
+// Atom numbers are only meaningful to the server they came from, so the name
+// of each non-predefined atom is recorded before the first record which uses
+// it (as a property name or type, a ClientMessage type, or an item of an
+// atom-valued property). The name's record is written when the record using
+// it is, so it has the same or a later time.
+struct TraceAtom {
+  uint32_t atom;
+  uint32_t len;
+  char name[kTracePayloadSize - 8];  // Not null-terminated.
+};
+
+class Trace {
+ public:
+  // Opens the trace file, writing its header, and sets I. Returns false (and
+  // logs why) if the file can't be created. If append is set, and the file is
+  // already a trace, records are added to the end of it instead; otherwise
+  // it's overwritten.
+  static bool Open(const std::string& path, bool append);
+
+  ~Trace();
+
+  void Event(const XEvent& ev);
+  void WindowQuery(TraceKind kind, const TraceWindowQuery& q);
+  void TreeQuery(Window w,
+                 Window root,
+                 Window parent,
+                 const Window* children,
+                 unsigned int num_children);
+  void PropertyQuery(Window w,
+                     Atom property,
+                     int status,
+                     Atom type,
+                     int format,
+                     unsigned long nitems,
+                     unsigned long bytes_after,
+                     const unsigned char* data);
+
+  // Writes out everything buffered so far. This waits for the names of any
+  // new atoms, so must be called before the display is closed.
+  void Flush();
+
+  // The trace being recorded, or null if we're not recording.
+  static Trace* I;
+
+ private:
+  Trace(int fd, uint64_t start_nanos);
+
+  // Returns the next record in the buffer, with its header filled in, and its
+  // payload zeroed.
+  TraceRecord* next(TraceKind kind);
+
+  // Asks for the name of a, if we haven't already, to be recorded when the
+  // buffer is next written.
+  void noteAtom(Atom a);
+
+  struct PendingAtoms;
+
+  static constexpr int kBufferRecords = 64;
+
+  const int fd_;
+  const uint64_t start_nanos_;
+  int used_ = 0;
+  TraceRecord buffer_[kBufferRecords];
+  std::set<Atom> atoms_;
+  std::unique_ptr<PendingAtoms> pending_atoms_;
+};
+
+#endif  // LWM_TRACE_H_included
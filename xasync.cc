@@ -0,0 +1,275 @@
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#ifdef SHAPE
+#include <X11/extensions/shape.h>
+#endif
+
+#include "lwm.h"
+#include "trace.h"
+#include "xasync.h"
+
+namespace xlib {
+namespace async {
+
+namespace {
+
+xcb_connection_t* conn() {
+  static xcb_connection_t* c = XGetXCBConnection(dpy);
+  return c;
+}
+
+XWindowAttributes decodeAttributes(Window w,
+                                   unsigned long,
+                                   void* const raw[]) {
+  const auto* attr =
+      static_cast<const xcb_get_window_attributes_reply_t*>(raw[0]);
+  const auto* geom = static_cast<const xcb_get_geometry_reply_t*>(raw[1]);
+  XWindowAttributes res = {};
+  if (attr && geom) {
+    res.x = geom->x;
+    res.y = geom->y;
+    res.width = geom->width;
+    res.height = geom->height;
+    res.border_width = geom->border_width;
+    res.depth = geom->depth;
+    res.root = geom->root;
+    res.c_class = attr->_class;
+    res.bit_gravity = attr->bit_gravity;
+    res.win_gravity = attr->win_gravity;
+    res.backing_store = attr->backing_store;
+    res.backing_planes = attr->backing_planes;
+    res.backing_pixel = attr->backing_pixel;
+    res.save_under = attr->save_under;
+    res.colormap = attr->colormap;
+    res.map_installed = attr->map_is_installed;
+    res.map_state = attr->map_state;
+    res.all_event_masks = attr->all_event_masks;
+    res.your_event_mask = attr->your_event_mask;
+    res.do_not_propagate_mask = attr->do_not_propagate_mask;
+    res.override_redirect = attr->override_redirect;
+    res.screen = DefaultScreenOfDisplay(dpy);
+    Visual* visual = DefaultVisual(dpy, DefaultScreen(dpy));
+    if (XVisualIDFromVisual(visual) == attr->visual) {
+      res.visual = visual;
+    }
+  }
+  LOGD(w) << "XGetWindowAttributes: " << Rect::From(res);
+  if (Trace::I) {
+    TraceWindowQuery q = {};
+    q.window = w;
+    q.ok = attr && geom;
+    q.other = res.root;
+    q.x = res.x;
+    q.y = res.y;
+    q.width = res.width;
+    q.height = res.height;
+    q.border_width = res.border_width;
+    q.depth = res.depth;
+    q.map_state = res.map_state;
+    q.override_redirect = res.override_redirect;
+    q.mask = res.your_event_mask;
+    Trace::I->WindowQuery(TraceAttributes, q);
+  }
+  return res;
+}
+
+WindowGeometry decodeGeometry(Window w, unsigned long, void* const raw[]) {
+  const auto* geom = static_cast<const xcb_get_geometry_reply_t*>(raw[0]);
+  WindowGeometry res = {};
+  if (geom) {
+    res.ok = true;
+    // Like Xlib, we report the root as the geometry's "parent".
+    res.parent = geom->root;
+    res.rect = Rect::FromXYWH(geom->x, geom->y, geom->width, geom->height);
+    res.border_width = geom->border_width;
+    res.bpp = geom->depth;
+  }
+  if (Trace::I) {
+    TraceWindowQuery q = {};
+    q.window = w;
+    q.ok = res.ok;
+    if (geom) {
+      q.other = geom->root;
+      q.x = geom->x;
+      q.y = geom->y;
+      q.width = geom->width;
+      q.height = geom->height;
+      q.border_width = geom->border_width;
+      q.depth = geom->depth;
+    }
+    Trace::I->WindowQuery(TraceGeometry, q);
+  }
+  return res;
+}
+
+WindowTree decodeTree(Window w, unsigned long, void* const raw[]) {
+  const auto* tree = static_cast<const xcb_query_tree_reply_t*>(raw[0]);
+  WindowTree res = {};
+  if (tree) {
+    res.root = tree->root;
+    res.parent = tree->parent;
+    const xcb_window_t* ch = xcb_query_tree_children(tree);
+    const int num_ch = xcb_query_tree_children_length(tree);
+    res.children.assign(ch, ch + num_ch);
+  }
+  if (res.parent) {
+    res.self = w;
+  }
+  if (Trace::I) {
+    Trace::I->TreeQuery(w, res.root, res.parent, res.children.data(),
+                        res.children.size());
+  }
+  return res;
+}
+
+Property decodeProperty(Window w,
+                        unsigned long property,
+                        void* const raw[]) {
+  const auto* prop = static_cast<const xcb_get_property_reply_t*>(raw[0]);
+  Property res;
+  if (prop) {
+    res.ok = true;
+    res.type = prop->type;
+    res.format = prop->format;
+    res.nitems = prop->value_len;
+    res.bytes_after = prop->bytes_after;
+    const unsigned char* value =
+        static_cast<const unsigned char*>(xcb_get_property_value(prop));
+    if (prop->format == 32) {
+      // Xlib gives us longs for 32-bit items, and so shall we.
+      res.data.resize(res.nitems * sizeof(long) + 1);
+      auto* items = reinterpret_cast<unsigned long*>(res.data.data());
+      const auto* in = reinterpret_cast<const uint32_t*>(value);
+      for (unsigned long i = 0; i < res.nitems; i++) {
+        items[i] = in[i];
+      }
+    } else {
+      const int len = xcb_get_property_value_length(prop);
+      res.data.assign(value, value + len);
+      res.data.push_back(0);
+    }
+  }
+  if (Trace::I) {
+    Trace::I->PropertyQuery(w, property, res.ok ? Success : BadWindow,
+                            res.type, res.format, res.nitems, res.bytes_after,
+                            res.ok ? res.data.data() : nullptr);
+  }
+  return res;
+}
+
+#ifdef SHAPE
+// We don't link against xcb-shape just for this one request, as it's easy
+// enough to make by hand. The layouts are from the X Nonrectangular Window
+// Shape Extension Protocol.
+xcb_extension_t shape_extension = {"SHAPE", 0};
+constexpr uint8_t kShapeGetRectangles = 8;
+
+struct ShapeGetRectanglesRequest {
+  uint8_t major_opcode;  // Filled in by XCB, like the minor opcode and length.
+  uint8_t minor_opcode;
+  uint16_t length;
+  uint32_t window;
+  uint8_t kind;
+  uint8_t pad[3];
+};
+
+struct ShapeGetRectanglesReply {
+  uint8_t response_type;
+  uint8_t ordering;
+  uint16_t sequence;
+  uint32_t length;
+  uint32_t rectangles_len;
+  uint8_t pad[20];
+};
+
+bool decodeShaped(Window, unsigned long, void* const raw[]) {
+  const auto* rects = static_cast<const ShapeGetRectanglesReply*>(raw[0]);
+  return rects && rects->rectangles_len > 1;
+}
+#endif
+
+std::string decodeAtomName(Window, unsigned long, void* const raw[]) {
+  const auto* name = static_cast<const xcb_get_atom_name_reply_t*>(raw[0]);
+  if (!name) {
+    return "";
+  }
+  return std::string(xcb_get_atom_name_name(name),
+                     xcb_get_atom_name_name_length(name));
+}
+
+}  // namespace
+
+void* waitForReply(unsigned int seq) {
+  xcb_generic_error_t* err = nullptr;
+  void* res = xcb_wait_for_reply(conn(), seq, &err);
+  free(err);
+  return res;
+}
+
+void discardReply(unsigned int seq) {
+  xcb_discard_reply(conn(), seq);
+}
+
+Reply<XWindowAttributes> GetWindowAttributes(Window w) {
+  // Xlib's XGetWindowAttributes makes these two requests too, but it waits
+  // for the first reply before sending the second.
+  const unsigned int attr = xcb_get_window_attributes(conn(), w).sequence;
+  const unsigned int geom = xcb_get_geometry(conn(), w).sequence;
+  return Reply<XWindowAttributes>(decodeAttributes, w, 0, attr, geom, 2);
+}
+
+Reply<WindowGeometry> GetGeometry(Window w) {
+  return Reply<WindowGeometry>(decodeGeometry, w, 0,
+                               xcb_get_geometry(conn(), w).sequence);
+}
+
+Reply<WindowTree> QueryTree(Window w) {
+  return Reply<WindowTree>(decodeTree, w, 0,
+                           xcb_query_tree(conn(), w).sequence);
+}
+
+Reply<bool> IsShaped(Window w) {
+#ifdef SHAPE
+  // XCB drops the connection if we use an extension the server lacks.
+  static const bool present =
+      xcb_get_extension_data(conn(), &shape_extension)->present;
+  if (!present) {
+    // A Reply with no requests outstanding just returns false from Get().
+    return Reply<bool>(nullptr, w, 0, 0, 0, 0);
+  }
+  ShapeGetRectanglesRequest req = {};
+  req.window = w;
+  req.kind = ShapeBounding;
+  struct iovec parts[4];
+  parts[2].iov_base = &req;
+  parts[2].iov_len = sizeof(req);
+  parts[3].iov_base = nullptr;
+  parts[3].iov_len = 0;
+  xcb_protocol_request_t proto = {2, &shape_extension, kShapeGetRectangles, 0};
+  // XCB wants the first two iovecs for its own use.
+  const unsigned int seq = xcb_send_request(conn(), 0, parts + 2, &proto);
+  return Reply<bool>(decodeShaped, w, 0, seq);
+#else
+  return Reply<bool>(nullptr, w, 0, 0, 0, 0);
+#endif
+}
+
+Reply<std::string> GetAtomName(Atom a) {
+  return Reply<std::string>(decodeAtomName, 0, a,
+                            xcb_get_atom_name(conn(), a).sequence);
+}
+
+Reply<Property> GetProperty(Window w,
+                            Atom property,
+                            Atom type,
+                            long offset,
+                            long length) {
+  const unsigned int seq =
+      xcb_get_property(conn(), false, w, property, type, offset, length)
+          .sequence;
+  return Reply<Property>(decodeProperty, w, property, seq);
+}
+
+}  // namespace async
+}  // namespace xlib
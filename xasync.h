@@ -0,0 +1,163 @@
+#ifndef LWM_XASYNC_H_included
+#define LWM_XASYNC_H_included
+
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "xlib.h"
+
+// Asynchronous versions of the queries in xlib.h.
+//
+// Each Xlib query function sends its request, then blocks until the reply
+// comes back, so a sequence of N queries costs N round trips to the X server.
+// The functions here send the request and immediately return a Reply, which
+// collects the X server's answer when Get() is called. Sending several
+// requests before getting any of the replies means the whole lot costs about
+// one round trip, while the code can still be written in a straightforward
+// sequential style:
+//
+//   auto attr = xlib::async::GetWindowAttributes(w);
+//   auto tree = xlib::async::QueryTree(w);
+//   ... do something with attr.Get() and tree.Get() ...
+//
+// This is built on the XCB connection underlying our Xlib Display, so the
+// requests are interleaved properly with everything we send through Xlib.
+// Errors (such as BadWindow, if the window has gone away) are not passed to
+// the Xlib error handler; instead, the returned values indicate failure as
+// documented for each function.
+namespace xlib {
+namespace async {
+
+// These are the type-independent parts of Reply. waitForReply returns the
+// reply, which must be freed, or nullptr if the request failed.
+extern void* waitForReply(unsigned int seq);
+extern void discardReply(unsigned int seq);
+
+// A Reply which is destroyed without Get() having been called tells XCB to
+// throw the reply away when it arrives.
+template <typename T>
+class Reply {
+ public:
+  // Turns the raw XCB replies (or nullptrs, for requests which failed) into
+  // the value returned by Get(). The window and arg are whatever was given
+  // when the request was made.
+  using Decoder = T (*)(Window w, unsigned long arg, void* const raw[]);
+
+  // Most of our queries are a single request, but XGetWindowAttributes is
+  // really two.
+  static constexpr int kMaxRequests = 2;
+
+  Reply(Decoder decode,
+        Window w,
+        unsigned long arg,
+        unsigned int seq0,
+        unsigned int seq1 = 0,
+        int num_requests = 1)
+      : window_(w), arg_(arg), decode_(decode), num_requests_(num_requests) {
+    seqs_[0] = seq0;
+    seqs_[1] = seq1;
+  }
+
+  Reply(Reply&& other) { *this = std::move(other); }
+
+  Reply& operator=(Reply&& other) {
+    discard();
+    window_ = other.window_;
+    arg_ = other.arg_;
+    decode_ = other.decode_;
+    memcpy(seqs_, other.seqs_, sizeof(seqs_));
+    num_requests_ = other.num_requests_;
+    value_ = std::move(other.value_);
+    other.num_requests_ = 0;
+    return *this;
+  }
+
+  ~Reply() { discard(); }
+
+  // Waits for the reply to arrive, if it hasn't already been collected, and
+  // returns the result.
+  const T& Get() {
+    if (num_requests_) {
+      void* raw[kMaxRequests] = {};
+      for (int i = 0; i < num_requests_; i++) {
+        raw[i] = waitForReply(seqs_[i]);
+      }
+      value_ = decode_(window_, arg_, raw);
+      for (int i = 0; i < num_requests_; i++) {
+        free(raw[i]);
+      }
+      num_requests_ = 0;
+    }
+    return value_;
+  }
+
+ private:
+  void discard() {
+    for (int i = 0; i < num_requests_; i++) {
+      discardReply(seqs_[i]);
+    }
+    num_requests_ = 0;
+  }
+
+  Window window_ = 0;
+  unsigned long arg_ = 0;
+  Decoder decode_ = nullptr;
+  unsigned int seqs_[kMaxRequests] = {};
+  int num_requests_ = 0;  // Outstanding requests; 0 once collected.
+  T value_ = {};
+
+  Reply(const Reply&) = delete;
+  Reply& operator=(const Reply&) = delete;
+};
+
+// The equivalent of xlib::XGetWindowAttributes. On failure, the returned
+// structure is zeroed. The visual is only filled in if it's the default one.
+extern Reply<XWindowAttributes> GetWindowAttributes(Window w);
+
+// The equivalent of xlib::XGetGeometry.
+extern Reply<WindowGeometry> GetGeometry(Window w);
+
+// The equivalent of xlib::WindowTree::Query. On failure, everything is 0 and
+// there are no children.
+extern Reply<WindowTree> QueryTree(Window w);
+
+// The equivalent of isShaped: whether the window's bounding shape is made of
+// more than one rectangle. Always false if we're built without SHAPE.
+extern Reply<bool> IsShaped(Window w);
+
+// The equivalent of XGetAtomName. On failure, the name is empty.
+extern Reply<std::string> GetAtomName(Atom a);
+
+// The result of GetProperty. The data is laid out as XGetWindowProperty would
+// return it: 32-bit items are stored as longs, and there's an extra zero byte
+// on the end, so string values are null-terminated.
+struct Property {
+  bool ok = false;    // Request succeeded (the property may not exist though).
+  Atom type = None;  // None if the property doesn't exist.
+  int format = 0;
+  unsigned long nitems = 0;
+  unsigned long bytes_after = 0;
+  std::vector<unsigned char> data;
+
+  bool Exists() const { return ok && type != None; }
+
+  template <typename T>
+  const T* As() const {
+    return reinterpret_cast<const T*>(data.data());
+  }
+};
+
+// The equivalent of XGetWindowProperty, without the delete option. As there,
+// offset and length are in 32-bit units.
+extern Reply<Property> GetProperty(Window w,
+                                   Atom property,
+                                   Atom type,
+                                   long offset,
+                                   long length);
+
+}  // namespace async
+}  // namespace xlib
+
+#endif  // LWM_XASYNC_H_included
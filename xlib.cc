@@ -1,4 +1,8 @@
+#include "iconcache.h"
+#include "lru.h"
 #include "lwm.h"
+#include "trace.h"
+#include "xasync.h"
 
 #include <set>
 
@@ -173,27 +177,38 @@ void SendClientMessage(Window w, Atom a, long data0, long data1) {
 }
 
 extern XWindowAttributes XGetWindowAttributes(Window w) {
-  XWindowAttributes res{};
-  ::XGetWindowAttributes(dpy, w, &res);
-  LOGD(w) << "XGetWindowAttributes: " << Rect::From(res);
-  return res;
+  return async::GetWindowAttributes(w).Get();
 }
 
 WindowGeometry XGetGeometry(Window w) {
-  WindowGeometry res{};
-  Window parent;
-  int x, y;
-  unsigned int width, height, border_width, bpp;
-  // XGetGeometry returns a Status, which is 0 on failure.
-  if (!::XGetGeometry(dpy, w, &parent, &x, &y, &width, &height, &border_width,
-                      &bpp)) {
-    return res;  // ok = false on creation.
+  return async::GetGeometry(w).Get();
+}
+
+int XGetWindowProperty(Window w,
+                       Atom property,
+                       long offset,
+                       long length,
+                       bool del,
+                       Atom req_type,
+                       Atom* actual_type,
+                       int* format,
+                       unsigned long* nitems,
+                       unsigned long* bytes_after,
+                       unsigned char** data) {
+  // https://tronche.com/gui/x/xlib/window-information/XGetWindowProperty.html
+  const int res =
+      ::XGetWindowProperty(dpy, w, property, offset, length, del, req_type,
+                           actual_type, format, nitems, bytes_after, data);
+  // Possible errors: BadAtom, BadValue, BadWindow.
+  if (Trace::I) {
+    // The outputs are only filled in if the request succeeded.
+    if (res == Success) {
+      Trace::I->PropertyQuery(w, property, res, *actual_type, *format,
+                              *nitems, *bytes_after, *data);
+    } else {
+      Trace::I->PropertyQuery(w, property, res, None, 0, 0, 0, nullptr);
+    }
   }
-  res.ok = true;
-  res.parent = parent;
-  res.rect = Rect::FromXYWH(x, y, width, height);
-  res.border_width = border_width;
-  res.bpp = bpp;
   return res;
 }
 
@@ -230,27 +245,21 @@ bool IsLWMWindow(Window w) {
   return lwm_owned_windows.count(w);
 }
 
-WindowTree WindowTree::Query(Display* dpy, Window w) {
-  WindowTree res = {};
-  Window* ch = nullptr;
-  unsigned int num_ch = 0;
-  // It doesn't matter which root window we give this call.
-  XQueryTree(dpy, w, &res.root, &res.parent, &ch, &num_ch);
-  XFreer ch_freer(ch);
-  if (res.parent) {
-    res.self = w;
-  }
-  res.children.reserve(num_ch);
-  for (int i = 0; i < num_ch; i++) {
-    res.children.push_back(ch[i]);
+void AdoptNamedWindow(Window w) {
+  lwm_owned_windows.insert(w);
+}
+
+void DestroyNamedWindows(const std::set<Window>& keep) {
+  for (const Window w : lwm_owned_windows) {
+    if (!keep.count(w)) {
+      XDestroyWindow(dpy, w);
+    }
   }
-  return res;
+  lwm_owned_windows = keep;
 }
 
-// Returns the parent window of w, or NULL if we hit the root or on error.
-Window WindowTree::ParentOf(Window w) {
-  WindowTree wt = WindowTree::Query(LScr::I->Dpy(), w);
-  return (wt.parent == wt.root) ? 0 : wt.parent;
+WindowTree WindowTree::Query(Display*, Window w) {
+  return async::QueryTree(w).Get();
 }
 
 // targetImageIconSize returns the max size we want to use for window icons.
@@ -278,63 +287,84 @@ void ImageIcon::ConfigureIconSizes() {
   XSetIconSizes(dpy, LScr::I->Root(), &sz, 1);
 }
 
-static std::map<unsigned long, ImageIcon*>* image_icon_cache;
-// The refcounts are used to keep track of how many clones of the same image
-// have been returned. The internally-kept ImageIcon doesn't count, only clones
-// cause the refcount to be increased.
-// When an image is cloned, an internal variable is set (gc_hash_), which causes
-// the removeCacheRef function to be called when that ImageIcon is destroyed.
+// The cache of ImageIcons lets windows with the same icon share one set of
+// pixmaps. Each ImageIcon handed out is a clone of the one in the cache, and
+// holds a reference to it (in gc_hash_), which it releases when destroyed.
+// Icons made from _NET_WM_ICON data are keyed by a hash of the pixels, so are
+// kept for a while after the last window using them goes away: browsers in
+// particular open and close windows with the same icon all day. They're
+// evicted, least recently used first, once the pixmaps of all the cached
+// icons use more server memory than the iconCacheKB resource allows.
 // Note (particularly for testing) that windows which specify a pixmap directly
 // typically don't trigger the caching behaviour, as each window has its own
-// copy of the pixmap. To definitely test the reference counting, use Chrome
-// or Firefox, both of which have their icons as a bunch of pixels embedded in
-// the _NET_WM_ICON property. As we calculate the hash based on the pixel data,
-// this triggers reuse of scaled images.
-static std::map<unsigned long, int>* image_cache_refcounts;
+// copy of the pixmap. Those icons are keyed by the pixmap's ID, which may be
+// reused once the pixmap is freed, so they're thrown away as soon as they're
+// not in use. To test the caching, use Chrome or Firefox, both of which have
+// their icons as a bunch of pixels embedded in the _NET_WM_ICON property.
+static SharedCache<uint64_t, ImageIcon*>* image_icon_cache;
 
-ImageIcon* fromCache(unsigned long hash) {
+SharedCache<uint64_t, ImageIcon*>* iconCache() {
   if (!image_icon_cache) {
-    return nullptr;
+    const size_t budget =
+        size_t(Resources::I->GetInt(Resources::ICON_CACHE_KB)) * 1024;
+    image_icon_cache =
+        new SharedCache<uint64_t, ImageIcon*>(budget, [](ImageIcon*& icon) {
+          icon->destroyResources();
+          delete icon;
+        });
   }
-  auto it = image_icon_cache->find(hash);
-  if (it == image_icon_cache->end()) {
-    return nullptr;
-  }
-  return it->second;
+  return image_icon_cache;
 }
 
-void removeCacheRef(unsigned long hash) {
-  const int remainingRefs = --((*image_cache_refcounts)[hash]);
-  if (remainingRefs == 0) {
-    ImageIcon* icon = (*image_icon_cache)[hash];
-    image_icon_cache->erase(hash);
-    image_cache_refcounts->erase(hash);
-    icon->destroyResources();
-    delete icon;
-  }
+// static
+ImageIcon* ImageIcon::fromCache(uint64_t hash) {
+  ImageIcon** icon = iconCache()->Acquire(hash);
+  return icon ? (*icon)->clone(hash) : nullptr;
 }
 
-void toCache(unsigned long hash, ImageIcon* icon) {
-  if (!image_icon_cache) {
-    image_icon_cache = new std::map<unsigned long, ImageIcon*>;
-    image_cache_refcounts = new std::map<unsigned long, int>;
+// static
+ImageIcon* ImageIcon::toCache(uint64_t hash, ImageIcon* icon, bool retain) {
+  // The server stores 24-bit pixmaps with 32 bits per pixel, and we have
+  // three of them.
+  const size_t cost = 3 * 4 * icon->Width() * icon->Height();
+  iconCache()->Insert(hash, icon, cost, retain);
+  return icon->clone(hash);
+}
+
+// hashData hashes the pixels of an icon. It's a simple multiply-and-rotate
+// hash, taking two words at a time to keep the multiplier busy: not of
+// cryptographic quality, but quick, and plenty good enough to tell icons
+// apart.
+uint64_t hashData(const unsigned long* data, unsigned long len) {
+  constexpr uint64_t kMul1 = 0x9e3779b97f4a7c15ULL;
+  constexpr uint64_t kMul2 = 0xc2b2ae3d27d4eb4fULL;
+  auto mix = [](uint64_t h, uint64_t v) {
+    h ^= v * kMul1;
+    return ((h << 31) | (h >> 33)) * kMul2;
+  };
+  uint64_t a = kMul2;
+  uint64_t b = kMul1 ^ len;
+  unsigned long i = 0;
+  for (; i + 1 < len; i += 2) {
+    a = mix(a, data[i]);
+    b = mix(b, data[i + 1]);
   }
-  (*image_icon_cache)[hash] = icon;
-  // Don't add a refcount here; instead we increment refcounts only on clone.
-}
-
-unsigned long hashData(unsigned long* data, unsigned long len) {
-  // For simplicity, coerce the data into a string, and then hash it.
-  std::string s((char*)data, len * sizeof(unsigned long));
-  std::hash<std::string> h;
-  return h(s);
+  if (i < len) {
+    a = mix(a, data[i]);
+  }
+  // Mix the two halves together, and the bits down (as for MurmurHash3).
+  uint64_t h = a ^ ((b << 32) | (b >> 32));
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
 }
 
-unsigned long hashPixmaps(Pixmap img, Pixmap mask) {
+uint64_t hashPixmaps(Pixmap img, Pixmap mask) {
   // Assuming the same image and mask are used together (which is probably a
   // safe assumption), we can just use the img as the hash.
   mask = mask;
-  return (unsigned long)img;
+  return img;
 }
 
 ImageIcon::ImageIcon(Pixmap active_img,
@@ -352,11 +382,18 @@ ImageIcon::ImageIcon(Pixmap active_img,
 
 ImageIcon::~ImageIcon() {
   if (gc_hash_) {
-    removeCacheRef(gc_hash_);
+    image_icon_cache->Release(gc_hash_);
   }
 }
 
-ImageIcon* ImageIcon::clone(unsigned long hash) {
+// static
+void ImageIcon::FreeUnused() {
+  if (image_icon_cache) {
+    image_icon_cache->EvictUnused();
+  }
+}
+
+ImageIcon* ImageIcon::clone(uint64_t hash) {
   ImageIcon* res = new ImageIcon(active_img_, inactive_img_, menu_img_, img_w_,
                                  img_h_, depth_);
   res->gc_hash_ = hash;
@@ -369,120 +406,100 @@ void ImageIcon::destroyResources() {
   XFreePixmap(dpy, menu_img_);
 }
 
-// copyWithScaling scales down the contents of src into dest.
-// The src image *must* be at least as large as the dest image.
-// This function applies some very simple anti-aliasing. It could be improved
-// by using sub-pixel accuracy, and weighted averages, but this doesn't seem to
-// be necessary, given the results we get from this much simpler approach.
-void copyWithScaling(XImage* src, XImage* dest) {
-  for (int y = 0; y < dest->height; y++) {
-    const int src_min_y = y * src->height / dest->height;
-    const int src_max_y = (y + 1) * src->height / dest->height;  // exclusive
-    for (int x = 0; x < dest->width; x++) {
-      const int src_min_x = x * src->width / dest->width;
-      const int src_max_x = (x + 1) * src->width / dest->width;  // exclusive
-      // An unsigned long has plenty of space to the left of even the red
-      // component, so we don't bother shifting the components down and up
-      // again. However, we must treat each component separately for the
-      // averaging, otherwise we'll get bleed between the components due to
-      // integer rounding when we divide by the number of pixels.
-      unsigned long r = 0;
-      unsigned long g = 0;
-      unsigned long b = 0;
-      for (int sy = src_min_y; sy < src_max_y; sy++) {
-        for (int sx = src_min_x; sx < src_max_x; sx++) {
-          const unsigned long val = XGetPixel(src, sx, sy);
-          r += val & 0xff0000;
-          g += val & 0xff00;
-          b += val & 0xff;
-        }
+// pixmapFromArgb makes a pixmap from opaque pixels, such as those produced by
+// ArgbImage::Composite. The usual 24-bit TrueColor visual stores its pixels in
+// the same layout, in which case we can copy the rows straight in, rather than
+// going through XPutPixel for each pixel.
+Pixmap pixmapFromArgb(const uint32_t* pixels, int width, int height) {
+  Visual* visual = DefaultVisual(dpy, LScr::kOnlyScreenIndex);
+  XImage* img = XCreateImage(dpy, visual, 24, ZPixmap, 0, nullptr, width,
+                             height, 32, 0);
+  if (!img) {
+    return None;
+  }
+  img->data = (char*)calloc(img->height, img->bytes_per_line);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  constexpr int host_order = MSBFirst;
+#else
+  constexpr int host_order = LSBFirst;
+#endif
+  const bool direct = img->bits_per_pixel == 32 &&
+                      img->byte_order == host_order &&
+                      visual->red_mask == 0xff0000 &&
+                      visual->green_mask == 0xff00 && visual->blue_mask == 0xff;
+  for (int y = 0; y < height; y++) {
+    const uint32_t* row = pixels + y * width;
+    if (direct) {
+      memcpy(img->data + y * img->bytes_per_line, row, width * 4);
+    } else {
+      for (int x = 0; x < width; x++) {
+        XPutPixel(img, x, y, row[x] & 0xffffff);
       }
-      // We're never called in a case where dest is larger than src, so the
-      // following calculation cannot divide by zero.
-      const int div = (src_max_y - src_min_y) * (src_max_x - src_min_x);
-      r = (r / div) & 0xff0000;
-      g = (g / div) & 0xff00;
-      b = (b / div) & 0xff;
-      XPutPixel(dest, x, y, r | g | b);
     }
   }
-}
-
-Pixmap pixmapFromXImage(XImage* img) {
-  Pixmap pm =
-      XCreatePixmap(dpy, LScr::I->Root(), img->width, img->height, img->depth);
-  GC igc = XCreateGC(dpy, pm, 0, nullptr);
-  XPutImage(dpy, pm, igc, img, 0, 0, 0, 0, img->width, img->height);
-  XFreeGC(dpy, igc);
+  Pixmap pm = XCreatePixmap(dpy, LScr::I->Root(), width, height, img->depth);
+  XPutImage(dpy, pm, LScr::I->GetCopyGC(), img, 0, 0, 0, 0, width, height);
+  XDestroyImage(img);
   return pm;
 }
 
-void allocateDataForXImage(XImage* img) {
-  img->data = (char*)calloc(img->height, img->bytes_per_line);
-}
-
-// Background is a little helper, used to provide a suitable background colour
-// to the xImageDataToImage function.
-// The case this is used in is when the user has configured a top border width,
-// which means the top edge of the icon used for an active window needs the
-// active border colour for its background, rather than the title background.
-// For this reason, we only really need two colours, and a vertical index from
-// which to use the second colour (so we ignore the X coordinate entirely).
-// It should be noted that as xImageDataToImage works on the original image,
-// baking in the expected background colour before scaling the image down,
-// calls to .At(x, y) provide coordinates in the original image's coordinate
-// system, not in the (usually more restricted) space of the destination image.
-class Background {
- public:
-  explicit Background(unsigned long colour)
-      : top_(colour), boundary_(0), bottom_(colour) {}
-  Background(unsigned long top, int boundary, unsigned long bottom)
-      : top_(top), boundary_(boundary), bottom_(bottom) {}
-
-  unsigned long At(int x, int y) const {
-    x = x;  // Unused, but the API looks a bit weird without X.
-    return (y > boundary_ ? bottom_ : top_) | 0xff000000;
-  }
-
- private:
-  unsigned long top_;
-  int boundary_;
-  unsigned long bottom_;
-};
-
-void xImageDataToImage(XImage* dest,
-                       XImage* orig,
-                       XImage* mask,
-                       const Background& background) {
+// argbFromXImage converts a 24-bit image, and its optional 1-bit mask, into
+// an ArgbImage. Pixels outside the mask are fully transparent, and the rest
+// are fully opaque.
+ArgbImage argbFromXImage(XImage* orig, XImage* mask) {
+  ArgbImage res(orig->width, orig->height);
   for (int y = 0; y < orig->height; y++) {
+    uint32_t* row = res.Row(y);
     for (int x = 0; x < orig->width; x++) {
-      unsigned long rgb = XGetPixel(orig, x, y) | 0xff000000;
-      XPutPixel(dest, x, y, XGetPixel(mask, x, y) ? rgb : background.At(x, y));
+      if (!mask || XGetPixel(mask, x, y)) {
+        row[x] = (XGetPixel(orig, x, y) & 0xffffff) | 0xff000000;
+      }
     }
   }
+  return res;
 }
 
-void pixelDataToImage(XImage* img,
-                      unsigned long* data,
-                      int width,
-                      int height,
-                      unsigned long background) {
-  const unsigned long bgr = background & 0xff0000;
-  const unsigned long bgg = background & 0xff00;
-  const unsigned long bgb = background & 0xff;
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      const unsigned long argb = *data++;
-      const unsigned long a = (argb >> 24) & 0xff;  // alpha for foreground.
-      const unsigned long bga = 0xff - a;           // alpha for background.
-      // Treat the 3 channels separately, to avoid cross-channel bleed (which
-      // makes the icons of rhythmbox and xfce4-mixer look like CGA vomit).
-      unsigned long r = (((argb & 0xff0000) * a + bgr * bga) / 0xff) & 0xff0000;
-      unsigned long g = (((argb & 0xff00) * a + bgg * bga) / 0xff) & 0xff00;
-      unsigned long b = (((argb & 0xff) * a + bgb * bga) / 0xff) & 0xff;
-      XPutPixel(img, x, y, r | g | b);
-    }
+// iconBackgrounds returns the backgrounds icons are composited onto: those of
+// the active and inactive title bars, and of the menu. The active background
+// is given, as it depends on where the icon came from.
+std::vector<ArgbImage::Background> iconBackgrounds(
+    const ArgbImage::Background& active) {
+  return {
+      active,
+      ArgbImage::Background(LScr::I->InactiveBorder()),
+      ArgbImage::Background(
+          Resources::I->GetColour(Resources::POPUP_BACKGROUND_COLOUR)),
+  };
+}
+
+// compositeIcon scales src down to the given size, and composites it onto
+// each of the backgrounds, all in one go. The images are returned one after
+// another. This doesn't touch any global state, so is safe to call from any
+// thread.
+std::vector<uint32_t> compositeIcon(
+    const ArgbImage& src,
+    int width,
+    int height,
+    const std::vector<ArgbImage::Background>& backgrounds) {
+  const ArgbImage scaled = src.Downscale(width, height);
+  std::vector<uint32_t> composited(backgrounds.size() * width * height);
+  std::vector<uint32_t*> out;
+  for (size_t i = 0; i < backgrounds.size(); i++) {
+    out.push_back(composited.data() + i * width * height);
   }
+  scaled.Composite(backgrounds.data(), out.data(), backgrounds.size());
+  return composited;
+}
+
+// static
+ImageIcon* ImageIcon::fromComposited(const uint32_t* pixels,
+                                     int width,
+                                     int height) {
+  const int size = width * height;
+  return new ImageIcon(pixmapFromArgb(pixels, width, height),
+                       pixmapFromArgb(pixels + size, width, height),
+                       pixmapFromArgb(pixels + 2 * size, width, height), width,
+                       height, 24);
 }
 
 // static
@@ -490,10 +507,10 @@ ImageIcon* ImageIcon::Create(Pixmap img, Pixmap mask) {
   if (!img) {
     return nullptr;
   }
-  const unsigned long pm_hash = hashPixmaps(img, mask);
+  const uint64_t pm_hash = hashPixmaps(img, mask);
   ImageIcon* result = fromCache(pm_hash);
   if (result) {
-    return result->clone(pm_hash);
+    return result;
   }
 
   const WindowGeometry geom = XGetGeometry(img);
@@ -511,126 +528,118 @@ ImageIcon* ImageIcon::Create(Pixmap img, Pixmap mask) {
 
   XImage* orig_img = XGetImage(dpy, img, 0, 0, geom.rect.width(),
                                geom.rect.height(), 0xffffff, ZPixmap);
+  if (!orig_img) {
+    return nullptr;
+  }
   XImage* mask_img = nullptr;
   if (mask) {
     mask_img = XGetImage(dpy, mask, 0, 0, geom.rect.width(), geom.rect.height(),
                          1, ZPixmap);
   }
-
-  // src_img will be filled in with the data from orig_img, but with the mask
-  // (and background) applied.
-  XImage* src_img =
-      XCreateImage(dpy, DefaultVisual(dpy, LScr::kOnlyScreenIndex), 24, ZPixmap,
-                   0, nullptr, geom.rect.width(), geom.rect.height(), 32, 0);
-  XImage* dest_img =
-      XCreateImage(dpy, DefaultVisual(dpy, LScr::kOnlyScreenIndex), 24, ZPixmap,
-                   0, nullptr, width, height, 32, 0);
-  if (!src_img || !dest_img) {
-    return nullptr;
-  }
-  allocateDataForXImage(src_img);
-  allocateDataForXImage(dest_img);
-
-  // For each possible background, generate the RGB values by applying the
-  // image values and background value with the alpha channel.
-  // If the user has configured a top border width, the 'active' icon has two
-  // background colours, one for the top edge and one for the rest. Note that
-  // the vertical separation is at topBorderWidth(), but we scale that to the
-  // source image's coordinates, as xImageDataToImage runs before we scale the
-  // image down to our target size.
-  xImageDataToImage(
-      src_img, orig_img, mask_img,
-      Background(LScr::I->ActiveBorder(),
-                 topBorderWidth() * geom.rect.height() / targetSize,
-                 Resources::I->GetColour(Resources::TITLE_BG_COLOUR)));
-  copyWithScaling(src_img, dest_img);
-  const Pixmap active_pm = pixmapFromXImage(dest_img);
-
-  xImageDataToImage(src_img, orig_img, mask_img,
-                    Background(LScr::I->InactiveBorder()));
-  copyWithScaling(src_img, dest_img);
-  const Pixmap inactive_pm = pixmapFromXImage(dest_img);
-
-  xImageDataToImage(
-      src_img, orig_img, mask_img,
-      Background(Resources::I->GetColour(Resources::POPUP_BACKGROUND_COLOUR)));
-  copyWithScaling(src_img, dest_img);
-  const Pixmap menu_pm = pixmapFromXImage(dest_img);
-
+  const ArgbImage src = argbFromXImage(orig_img, mask_img);
   XDestroyImage(orig_img);
   if (mask_img) {
     XDestroyImage(mask_img);
   }
-  XDestroyImage(src_img);
-  XDestroyImage(dest_img);
 
-  result = new ImageIcon(active_pm, inactive_pm, menu_pm, width, height, 24);
-  toCache(pm_hash, result);
-  return result->clone(pm_hash);
+  // If the user has configured a top border width, the 'active' icon has two
+  // background colours, one for the top edge and one for the rest. The
+  // separation is at topBorderWidth() in the title bar, which we scale to the
+  // icon's size.
+  const std::vector<uint32_t> composited = compositeIcon(
+      src, width, height,
+      iconBackgrounds(ArgbImage::Background(
+          LScr::I->ActiveBorder(), topBorderWidth() * height / targetSize,
+          Resources::I->GetColour(Resources::TITLE_BG_COLOUR))));
+  return toCache(pm_hash, fromComposited(composited.data(), width, height),
+                 false);
 }
 
 // Use Google Chrome or Chromium to test CreateFromPixels.
 // static
-ImageIcon* ImageIcon::CreateFromPixels(unsigned long* data, unsigned long len) {
-  if (data == nullptr || len < 2) {
+ImageIcon* ImageIcon::CreateFromPixels(const unsigned long* data,
+                                       unsigned long len) {
+  PixelJob job(data, len);
+  if (!job.Valid()) {
     return nullptr;
   }
-  const unsigned long pm_hash = hashData(data, len);
-  ImageIcon* result = fromCache(pm_hash);
+  ImageIcon* result = job.Cached();
   if (result) {
-    return result->clone(pm_hash);
+    return result;
   }
+  job.Run();
+  return job.Finish();
+}
 
+ImageIcon::PixelJob::PixelJob(const unsigned long* data, unsigned long len) {
+  if (data == nullptr || len < 2) {
+    return;
+  }
   const int src_width = data[0];
   const int src_height = data[1];
   if (src_width == 0 || src_height == 0 || len < (2 + src_width * src_height)) {
     fprintf(stderr, "Invalid width (%d) vs height (%d) vs size (%d)\n",
             src_width, src_height, int(len));
-    return nullptr;
+    return;
   }
+  hash_ = hashData(data, len);
+  src_width_ = src_width;
+  src_height_ = src_height;
+  pixels_.assign(data + 2, data + 2 + src_width * src_height);
 
   // Calculate the destination size of the icon, either the same as source, or
   // the desired size if that's smaller.
   // This code assumes the icon is square (if not, it will be distorted).
   // But it's almost guaranteed to be so.
   const int targetSize = targetImageIconSize();
-  const int width = (src_width < targetSize) ? src_width : targetSize;
-  const int height = (src_height < targetSize) ? src_height : targetSize;
-
-  XImage* src_img =
-      XCreateImage(dpy, DefaultVisual(dpy, LScr::kOnlyScreenIndex), 24, ZPixmap,
-                   0, nullptr, src_width, src_height, 32, 0);
-  XImage* dest_img =
-      XCreateImage(dpy, DefaultVisual(dpy, LScr::kOnlyScreenIndex), 24, ZPixmap,
-                   0, nullptr, width, height, 32, 0);
-  if (!src_img || !dest_img) {
-    return nullptr;
+  width_ = (src_width < targetSize) ? src_width : targetSize;
+  height_ = (src_height < targetSize) ? src_height : targetSize;
+  backgrounds_ = iconBackgrounds(ArgbImage::Background(
+      Resources::I->GetColour(Resources::TITLE_BG_COLOUR)));
+
+  // The pixels we make depend on the size and backgrounds as well as the
+  // icon, all of which must be in the key for the disk cache.
+  std::vector<unsigned long> key = {hash_ & 0xffffffff, hash_ >> 32,
+                                    (unsigned long)width_,
+                                    (unsigned long)height_};
+  for (const auto& bg : backgrounds_) {
+    key.insert(key.end(), {bg.top, (unsigned long)bg.boundary, bg.bottom});
   }
-  allocateDataForXImage(src_img);
-  allocateDataForXImage(dest_img);
-
-  // For each possible background, generate the RGB values by applying the
-  // image values and background value with the alpha channel.
-  pixelDataToImage(src_img, data + 2, src_width, src_height,
-                   Resources::I->GetColour(Resources::TITLE_BG_COLOUR));
-  copyWithScaling(src_img, dest_img);
-  const Pixmap active_pm = pixmapFromXImage(dest_img);
+  disk_key_ = hashData(key.data(), key.size());
+}
 
-  pixelDataToImage(src_img, data + 2, src_width, src_height,
-                   LScr::I->InactiveBorder());
-  copyWithScaling(src_img, dest_img);
-  const Pixmap inactive_pm = pixmapFromXImage(dest_img);
+ImageIcon* ImageIcon::PixelJob::Cached() const {
+  ImageIcon* result = fromCache(hash_);
+  if (result || !IconDiskCache::I) {
+    return result;
+  }
+  // We may have made this icon before LWM last restarted.
+  const uint32_t* pixels = IconDiskCache::I->Find(
+      disk_key_, width_, height_, backgrounds_.size() * width_ * height_);
+  if (!pixels) {
+    return nullptr;
+  }
+  return toCache(hash_, fromComposited(pixels, width_, height_), true);
+}
 
-  pixelDataToImage(src_img, data + 2, src_width, src_height,
-                   Resources::I->GetColour(Resources::POPUP_BACKGROUND_COLOUR));
-  copyWithScaling(src_img, dest_img);
-  const Pixmap menu_pm = pixmapFromXImage(dest_img);
+void ImageIcon::PixelJob::Run() {
+  composited_ = compositeIcon(
+      ArgbImage::FromPixels(pixels_.data(), src_width_, src_height_), width_,
+      height_, backgrounds_);
+}
 
-  XDestroyImage(src_img);
-  XDestroyImage(dest_img);
-  result = new ImageIcon(active_pm, inactive_pm, menu_pm, width, height, 24);
-  toCache(pm_hash, result);
-  return result->clone(pm_hash);
+ImageIcon* ImageIcon::PixelJob::Finish() const {
+  // Another job may have made the same icon while this one was running.
+  ImageIcon* result = Cached();
+  if (result) {
+    return result;
+  }
+  if (IconDiskCache::I) {
+    IconDiskCache::I->Add(disk_key_, width_, height_, composited_.data(),
+                          composited_.size());
+  }
+  return toCache(hash_, fromComposited(composited_.data(), width_, height_),
+                 true);
 }
 
 void ImageIcon::paint(Window w,
@@ -644,9 +653,6 @@ void ImageIcon::paint(Window w,
   }
   const int xo = (width - (int)img_w_) / 2;
   const int yo = (height - (int)img_h_) / 2;
-  XGCValues gv;
-  gv.function = GXcopy;
-  GC gc = XCreateGC(dpy, w, GCFunction, &gv);
   // If the pixmap is smaller than what we want to draw, adjust the coordinates
   // so we draw within the bounding box.
   if (xo > 0) {
@@ -661,8 +667,8 @@ void ImageIcon::paint(Window w,
   // coordinates to draw something in the middle of the source pixmap.
   const int src_x = (xo < 0) ? -xo : 0;
   const int src_y = (yo < 0) ? -yo : 0;
-  XCopyArea(dpy, pm, w, gc, src_x, src_y, width, height, x, y);
-  XFreeGC(dpy, gc);
+  XCopyArea(dpy, pm, w, LScr::I->GetCopyGC(), src_x, src_y, width, height, x,
+            y);
 }
 
 }  // namespace xlib
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <set>
 #include <string>
 #include <vector>
 
@@ -19,6 +20,8 @@
 #include <X11/cursorfont.h>
 #include <X11/extensions/Xrandr.h>
 
+#include "argb.h"
+
 #include "geometry.h"
 
 namespace xlib {
@@ -52,6 +55,20 @@ extern void SendClientMessage(Window w, Atom a, long data0, long data1);
 
 extern XWindowAttributes XGetWindowAttributes(Window w);
 
+// Unlike the other wrappers, this is the same as the Xlib function, except
+// that the display is implicit.
+extern int XGetWindowProperty(Window w,
+                              Atom property,
+                              long offset,
+                              long length,
+                              bool del,
+                              Atom req_type,
+                              Atom* actual_type,
+                              int* format,
+                              unsigned long* nitems,
+                              unsigned long* bytes_after,
+                              unsigned char** data);
+
 struct WindowGeometry {
   Window parent;
   Rect rect;
@@ -72,6 +89,15 @@ extern Window CreateNamedWindow(const std::string& name,
 
 extern bool IsLWMWindow(Window w);
 
+// Marks w, a window made by a previous LWM (see handoff.h), as one of ours.
+extern void AdoptNamedWindow(Window w);
+
+// Destroys all of our windows, except for those in keep.
+extern void DestroyNamedWindows(const std::set<Window>& keep);
+
+// The largest size of icon we'd ever draw; anything bigger is scaled down.
+extern int targetImageIconSize();
+
 struct WindowTree {
   Window self;
   Window parent;
@@ -81,10 +107,6 @@ struct WindowTree {
 
   // Query returns the set of children of the given window.
   static WindowTree Query(Display* dpy, Window w);
-
-  // Parent returns the parent window of w, or 0 if the parent is the root
-  // window.
-  static Window ParentOf(Window w);
 };
 
 // ImageIcon holds and image, and optionally a mask, for painting an icon on
@@ -108,7 +130,48 @@ class ImageIcon {
   // than one icon, which appears after the first.
   // Again, returns null if there was a problem.
   // The data is not freed - that's the caller's job.
-  static ImageIcon* CreateFromPixels(unsigned long* data, unsigned long len);
+  static ImageIcon* CreateFromPixels(const unsigned long* data,
+                                     unsigned long len);
+
+  // PixelJob splits CreateFromPixels into three steps, so that the middle
+  // one, which does all the work on the pixels but never talks to the X
+  // server, can be run on another thread.
+  class PixelJob {
+   public:
+    // Validates and copies the first icon in data. This must be done on the
+    // main thread, as it looks up the configured sizes and colours.
+    PixelJob(const unsigned long* data, unsigned long len);
+
+    // Whether the data held a sensible icon; if not, there's nothing to do.
+    bool Valid() const { return width_ > 0; }
+
+    // Returns the icon, if one has already been made from the same data,
+    // either since LWM started, or (if it's in IconDiskCache) before.
+    ImageIcon* Cached() const;
+
+    // Jobs with the same key make the same pixels.
+    uint64_t Key() const { return disk_key_; }
+
+    // Composites and scales the icon into client-side buffers. This is safe
+    // to call from any thread, and only needs doing if Cached() is null.
+    void Run();
+
+    // Makes the ImageIcon from the results of Run, on the main thread.
+    ImageIcon* Finish() const;
+
+   private:
+    uint64_t hash_ = 0;
+    // The key for IconDiskCache.
+    uint64_t disk_key_ = 0;
+    int src_width_ = 0;
+    int src_height_ = 0;
+    std::vector<unsigned long> pixels_;
+    int width_ = 0;
+    int height_ = 0;
+    std::vector<ArgbImage::Background> backgrounds_;
+    // One image per background, one after another.
+    std::vector<uint32_t> composited_;
+  };
 
   // Paints the image with the 'inactive' background on the given window,
   // centred within the box given by x, y, w, h.
@@ -135,8 +198,15 @@ class ImageIcon {
   // looks ugly).
   static void ConfigureIconSizes();
 
+  unsigned int Width() const { return img_w_; }
+  unsigned int Height() const { return img_h_; }
+
   void destroyResources();
 
+  // Frees the server resources of the cached icons no window is using, such
+  // as before a restart.
+  static void FreeUnused();
+
  private:
   ImageIcon(Pixmap active_img,
             Pixmap inactive_img,
@@ -145,9 +215,21 @@ class ImageIcon {
             unsigned int img_h,
             unsigned int depth);
 
+  // Makes the pixmaps from images composited onto the active, inactive and
+  // menu backgrounds, in that order, one after another in pixels.
+  static ImageIcon* fromComposited(const uint32_t* pixels,
+                                   int width,
+                                   int height);
+
   void paint(Window w, Pixmap img, int x, int y, int width, int height);
 
-  ImageIcon* clone(unsigned long hash);
+  ImageIcon* clone(uint64_t hash);
+
+  // Returns a clone of the cached icon for hash, if there is one.
+  static ImageIcon* fromCache(uint64_t hash);
+  // Adds icon to the cache, and returns a clone of it. If retain is false,
+  // the icon is thrown away as soon as the last clone is destroyed.
+  static ImageIcon* toCache(uint64_t hash, ImageIcon* icon, bool retain);
 
   Pixmap active_img_;
   Pixmap inactive_img_;
@@ -155,7 +237,7 @@ class ImageIcon {
   unsigned int img_w_ = 0;
   unsigned int img_h_ = 0;
   unsigned int depth_ = 0;
-  unsigned long gc_hash_ = 0;
+  uint64_t gc_hash_ = 0;
 };
 
 // XFreer calls XFree on the data pointer it's constructed with when its
@@ -0,0 +1,76 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "xvfb.h"
+
+namespace {
+
+// How long we give Xvfb to start up.
+constexpr int kStartTimeoutMillis = 10000;
+
+}  // namespace
+
+// static
+Xvfb* Xvfb::Start(int width, int height) {
+  // Xvfb picks its own display number, and writes it to the -displayfd file
+  // descriptor once it's ready, which saves both guessing and polling.
+  int fds[2];
+  if (pipe(fds)) {
+    LOGE() << "Failed to create pipe for Xvfb: " << Log::Errno(errno);
+    return nullptr;
+  }
+  const std::string fd_arg = std::to_string(fds[1]);
+  const std::string screen_arg =
+      std::to_string(width) + "x" + std::to_string(height) + "x24";
+  const pid_t pid = fork();
+  if (pid < 0) {
+    LOGE() << "Failed to fork for Xvfb: " << Log::Errno(errno);
+    close(fds[0]);
+    close(fds[1]);
+    return nullptr;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    execlp("Xvfb", "Xvfb", "-displayfd", fd_arg.c_str(), "-screen", "0",
+           screen_arg.c_str(), "-nolisten", "tcp", "-noreset", nullptr);
+    LOGE() << "Failed to run Xvfb: " << Log::Errno(errno);
+    _exit(EXIT_FAILURE);
+  }
+  close(fds[1]);
+
+  std::string number;
+  struct pollfd pfd = {fds[0], POLLIN, 0};
+  while (number.empty() || number.back() != '\n') {
+    const int n = poll(&pfd, 1, kStartTimeoutMillis);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    char buf[16];
+    const ssize_t got = (n > 0) ? read(fds[0], buf, sizeof(buf)) : 0;
+    if (got <= 0) {
+      LOGE() << "Xvfb didn't report a display number"
+             << (n == 0 ? " in time" : "");
+      close(fds[0]);
+      kill(pid, SIGTERM);
+      waitpid(pid, nullptr, 0);
+      return nullptr;
+    }
+    number.append(buf, got);
+  }
+  close(fds[0]);
+  number.pop_back();
+  return new Xvfb(pid, ":" + number);
+}
+
+Xvfb::Xvfb(pid_t pid, const std::string& display_name)
+    : pid_(pid), display_name_(display_name) {}
+
+Xvfb::~Xvfb() {
+  kill(pid_, SIGTERM);
+  waitpid(pid_, nullptr, 0);
+}
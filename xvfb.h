@@ -0,0 +1,33 @@
+#ifndef LWM_XVFB_H_included
+#define LWM_XVFB_H_included
+
+#include <sys/types.h>
+#include <string>
+
+// Xvfb runs a private, headless X server, for the tools which need a real X
+// server to run LWM against (lwmreplay and lwmbench). The server is started
+// on the first free display number, so it won't interfere with the user's own.
+class Xvfb {
+ public:
+  // Starts an Xvfb with a single 24-bit screen of the given size, and waits
+  // until it's ready to accept connections. Returns null (having logged why)
+  // on failure.
+  static Xvfb* Start(int width, int height);
+
+  // Kills the server.
+  ~Xvfb();
+
+  // The display name to give to XOpenDisplay, or to use as $DISPLAY.
+  const std::string& DisplayName() const { return display_name_; }
+
+ private:
+  Xvfb(pid_t pid, const std::string& display_name);
+
+  const pid_t pid_;
+  const std::string display_name_;
+
+  Xvfb(const Xvfb&) = delete;
+  Xvfb& operator=(const Xvfb&) = delete;
+};
+
+#endif  // LWM_XVFB_H_included